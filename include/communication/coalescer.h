@@ -0,0 +1,86 @@
+#ifndef INCLUDE_COMMUNICATION_COALESCER_H_
+#define INCLUDE_COMMUNICATION_COALESCER_H_
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <utility>
+#include <vector>
+#include "communication/msg.h"
+
+namespace singa {
+/**
+ * Counters of all Coalescer instances in this procs.
+ */
+struct CoalescerStats{
+  std::atomic<uint64_t> batches; //!< num of kBatch envelopes
+  std::atomic<uint64_t> batched_msgs; //!< num of msgs sent in envelopes
+  std::atomic<uint64_t> single_msgs; //!< num of msgs sent individually
+  //!< flushes due to the size threshold, the deadline and end-of-step marker
+  std::atomic<uint64_t> size_flushes, deadline_flushes, step_flushes;
+};
+
+/**
+ * Batch messages of the stub headed to the same remote procs.
+ *
+ * Buffered messages of one procs are serialized into one kBatch envelope (one
+ * frame per message) when their bytes reach the size threshold, when the
+ * oldest one has waited for the delay, or at the end-of-step marker (kFlush)
+ * from workers. A message larger than the threshold flushes the buffer and is
+ * sent individually, so the order of messages to one procs is kept.
+ */
+class Coalescer{
+ public:
+  typedef std::vector<std::pair<int, Msg*>> Outbox;
+  /**
+   * @param procs_id id of this procs, the source of envelopes
+   * @param max_bytes size threshold of an envelope
+   * @param delay useconds a message can be buffered
+   */
+  Coalescer(int procs_id, size_t max_bytes, int delay);
+  ~Coalescer();
+  /**
+   * Buffer a message to the procs.
+   *
+   * @param ready (procs id, msg) to be sent now are appended in order
+   */
+  void Add(int procs_id, Msg* msg, Outbox* ready);
+  /**
+   * Flush procs whose oldest message has waited for the delay.
+   */
+  void FlushExpired(Outbox* ready);
+  /**
+   * Flush all procs, e.g., for the end-of-step marker.
+   */
+  void FlushAll(Outbox* ready);
+  /**
+   * @return useconds to the earliest deadline, -1 if nothing is buffered;
+   * see Poller::WaitMicros()
+   */
+  int Timeout() const;
+  /**
+   * Reconstruct the messages of a kBatch envelope; the envelope is deleted.
+   */
+  static void Split(Msg* batch, std::vector<Msg*>* msgs);
+  static const CoalescerStats& stats();
+
+ protected:
+  typedef std::chrono::steady_clock Clock;
+  struct Pending{
+    std::vector<Msg*> msgs;
+    size_t bytes;
+    Clock::time_point deadline;
+  };
+  void Flush(int procs_id, Pending* pending, Outbox* ready);
+
+ protected:
+  int procs_id_;
+  size_t max_bytes_;
+  std::chrono::microseconds delay_;
+  std::map<int, Pending> pending_;
+  //!< num of procs with buffered messages
+  int npending_;
+  //!< buffer for serializing messages into frames
+  std::vector<char> buf_;
+};
+}  // namespace singa
+#endif  // INCLUDE_COMMUNICATION_COALESCER_H_
@@ -1,10 +1,14 @@
 #ifndef INCLUDE_COMMUNICATION_MSG_H_
 #define INCLUDE_COMMUNICATION_MSG_H_
 #include <string>
+#include <atomic>
+#include <memory>
+#include <stdint.h>
 #include <czmq.h>
 #include <glog/logging.h>
 
 using std::string;
+using std::shared_ptr;
 namespace singa {
 class BaseMsg{
   public:
@@ -31,6 +35,31 @@ class BaseMsg{
   virtual int type() const=0;
   virtual void set_target(int target)=0;
   virtual int target() const=0;
+  /**
+   * Version and size (num of floats) of the Param carried by this message
+   */
+  virtual void set_version(int version)=0;
+  virtual int version() const=0;
+  virtual void set_size(int size)=0;
+  virtual int size() const=0;
+  /**
+   * Encoding of the Param payload, i.e., ParamProto::WireEncoding
+   */
+  virtual void set_encoding(int encoding)=0;
+  virtual int encoding() const=0;
+  /**
+   * Compression of the gradient payload, i.e., ParamProto::UpdateCodec, or
+   * of the values in responses (and for kPut, of the responses to come),
+   * i.e., ParamProto::ResponseCodec
+   */
+  virtual void set_codec(int codec)=0;
+  virtual int codec() const=0;
+  /**
+   * Version of the values held by the worker, i.e., the base of delta
+   * responses (ParamProto::ResponseCodec); -1 for none
+   */
+  virtual void set_base_version(int version)=0;
+  virtual int base_version() const=0;
 
   /**
    * Copy src and dst address, including group_id, id, flag
@@ -42,6 +71,13 @@ class BaseMsg{
    * Add a frame (a chunck of bytes) into the message
    */
   virtual void add_frame(const void*, int nBytes)=0;
+  /**
+   * Add a frame without copying the memory.
+   *
+   * @param holder keeps the memory alive until the frame is released by the
+   * communication library
+   */
+  virtual void add_frame(const void*, int nBytes, shared_ptr<void> holder)=0;
   virtual int frame_size()=0;
   virtual void* frame_data()=0;
   /**
@@ -55,15 +91,63 @@ class BaseMsg{
 #define USE_ZMQ
 
 #ifdef USE_ZMQ
+/**
+ * Fixed-layout binary header which is sent as the first frame of every
+ * message. Fields are in host byte order; all procs are assumed to run on
+ * machines with the same endianness.
+ */
+struct MsgHeader{
+  uint16_t magic; //!< kMsgMagic, distinguishes it from the text header
+  uint8_t layout; //!< kMsgLayout, increased whenever the fields change
+  uint8_t encoding; //!< wire encoding of the payload
+  uint32_t src, dst, target;
+  int32_t version; //!< Param version
+  int32_t size; //!< num of floats of the Param
+  int32_t base_version; //!< base of the delta payload
+  uint8_t codec; //!< compression of the payload
+  uint8_t reserved[3];
+  int64_t timestamp; //!< useconds since epoch when the msg was sent
+} __attribute__((packed));
+
+const uint16_t kMsgMagic=0xA55A;
+const uint8_t kMsgLayout=5;
+//!< max num of Msg objects (and empty zmsg/frames) cached per thread
+const size_t kMsgPoolSize=1024;
+//!< max num of zero-copy frames per Msg
+const int kMaxZeroCopyFrames=4;
+
+/**
+ * Counters of the Msg object pools, which are summed over all threads.
+ *
+ * *_allocs counts heap allocations (pool misses) and *_reuses counts
+ * objects taken from the pools. In steady state, only reuses should grow.
+ */
+struct MsgPoolStats{
+  std::atomic<uint64_t> msg_allocs, msg_reuses;
+  std::atomic<uint64_t> zmsg_allocs, zmsg_reuses;
+  std::atomic<uint64_t> frame_allocs, frame_reuses;
+};
+
 class Msg : public BaseMsg{
  public:
-  Msg() {
-    msg_=zmsg_new();
-  }
-  virtual ~Msg(){
-    if(msg_!=NULL)
-      zmsg_destroy(&msg_);
-  }
+  /**
+   * The zmsg is created lazily, e.g., when the first frame is added.
+   */
+  Msg():src_(0), dst_(0), target_(0), version_(0), size_(0), encoding_(0),
+    codec_(0), base_version_(-1), timestamp_(0), msg_(nullptr),
+    frame_(nullptr), nzcframes_(0){}
+  virtual ~Msg();
+  /**
+   * Msg objects are allocated from a thread-local pool, so that sockets and
+   * PMWorker/PMServer can keep using new/delete without heap allocations in
+   * steady state.
+   */
+  static void* operator new(size_t size);
+  static void operator delete(void* ptr, size_t size);
+  /**
+   * @return the pool counters of all threads
+   */
+  static const MsgPoolStats& pool_stats();
   virtual void set_src(int group_id, int id, int flag){
     src_=(group_id<<kOff1)|(id<<kOff2)|flag;
   }
@@ -127,6 +211,43 @@ class Msg : public BaseMsg{
     int ret=target_&kMask3;
     return ret;
   }
+  virtual void set_version(int version){
+    version_=version;
+  }
+  virtual int version() const{
+    return version_;
+  }
+  virtual void set_size(int size){
+    size_=size;
+  }
+  virtual int size() const{
+    return size_;
+  }
+  virtual void set_encoding(int encoding){
+    encoding_=encoding;
+  }
+  virtual int encoding() const{
+    return encoding_;
+  }
+  virtual void set_codec(int codec){
+    codec_=codec;
+  }
+  virtual int codec() const{
+    return codec_;
+  }
+  virtual void set_base_version(int version){
+    base_version_=version;
+  }
+  virtual int base_version() const{
+    return base_version_;
+  }
+  /**
+   * @return useconds since epoch when the msg was sent by the source, which
+   * is 0 for msgs not received from sockets or received with text headers
+   */
+  int64_t timestamp() const{
+    return timestamp_;
+  }
 
   virtual BaseMsg* CopyAddr(){
     Msg* msg=new Msg();
@@ -141,44 +262,136 @@ class Msg : public BaseMsg{
   }
 
   virtual void add_frame(const void* addr, int nBytes){
-    zmsg_addmem(msg_, addr, nBytes);
+    zmsg_addmem(zmsg(), addr, nBytes);
   }
+  /**
+   * An empty frame is added as placeholder, which is replaced by a zmq_msg_t
+   * created through zmq_msg_init_data when sending.
+   */
+  virtual void add_frame(const void* addr, int nBytes, shared_ptr<void> holder);
   virtual int frame_size(){
-    return zframe_size(frame_);
+    if(frame_==NULL)
+      return 0;
+    const ZeroCopyFrame* zc=FindZeroCopyFrame(frame_);
+    return zc!=nullptr?zc->size:zframe_size(frame_);
   }
 
   virtual void* frame_data(){
-    return zframe_data(frame_);
+    if(frame_==NULL)
+      return nullptr;
+    const ZeroCopyFrame* zc=FindZeroCopyFrame(frame_);
+    return zc!=nullptr?zc->data:zframe_data(frame_);
   }
+  /**
+   * Detach the current frame from the message without copying.
+   *
+   * The cursor is reset, i.e., next_frame() should not be called afterwards.
+   * @return the handle that owns the frame memory, i.e., frame_data().
+   */
+  shared_ptr<void> release_frame();
 
   virtual bool next_frame(){
-    frame_=zmsg_next(msg_);
+    frame_=msg_==NULL?NULL:zmsg_next(msg_);
     return frame_!=NULL;
   }
 
-  void ParseFromZmsg(zmsg_t* msg){
-    char* tmp=zmsg_popstr(msg);
-    sscanf(tmp, "%d %d %d", &src_, &dst_, &target_);
-    //LOG(ERROR)<<"recv "<<src_<<" "<<dst_<<" "<<target_;
-    frame_=zmsg_next(msg);
-    msg_=msg;
-  }
+  /**
+   * Take the ownership of msg and parse the header from its first frame.
+   * Both the binary header and the text header are accepted.
+   */
+  void ParseFromZmsg(zmsg_t* msg);
+  /**
+   * Push the header as the first frame and release the underlying zmsg.
+   * Zero-copy frames are copied into the zmsg.
+   */
+  zmsg_t* DumpToZmsg();
+  /**
+   * Send the message through a ZeroMQ socket; zero-copy frames are sent
+   * without copying.
+   *
+   * @param route identity frame prepended for ROUTER sockets; it is not
+   * owned by the message.
+   * @return 1 for success, 0 for failure
+   */
+  int SendTo(zsock_t* sock, zframe_t* route=nullptr);
+  /**
+   * Receive the message from a ZeroMQ socket.
+   *
+   * The header is parsed without allocating a frame for it.
+   * @param route if not null, the first frame (identity of the sender) is
+   * received into it, e.g., for ROUTER sockets.
+   * @return 1 for success, 0 for failure
+   */
+  int ReceiveFrom(zsock_t* sock, string* route=nullptr);
+  /**
+   * @return num of bytes of the message serialized by SerializeTo()
+   */
+  size_t ByteSize();
+  /**
+   * Serialize the header and all frames into a flat buffer, e.g., for
+   * transports other than ZeroMQ.
+   *
+   * @param buf must have at least ByteSize() bytes
+   */
+  void SerializeTo(char* buf);
+  /**
+   * Reconstruct the message from bytes generated by SerializeTo(); the
+   * frames are copied.
+   */
+  void ParseFromBytes(const char* buf, size_t len);
 
-  zmsg_t* DumpToZmsg(){
-    zmsg_pushstrf(msg_, "%d %d %d",src_, dst_,target_);
-    //LOG(ERROR)<<"send "<<src_<<" "<<dst_<<" "<<target_;
-    zmsg_t* tmp=msg_;
-    msg_=NULL;
-    return tmp;
+  /**
+   * Send the text header "src dst target version size encoding codec
+   * base_version" instead
+   * of the binary MsgHeader, e.g., to talk with tools parsing the old format.
+   * It is a per-procs setting.
+   */
+  static void set_text_header(bool text){
+    text_header_=text;
+  }
+  static bool text_header(){
+    return text_header_;
   }
 
  protected:
+  //!< push the header frame
+  void PushHeader();
+  //!< fill the binary header with the fields of this message
+  void FillHeader(MsgHeader* h) const;
+  //!< parse the binary or text header
+  void ParseHeader(const void* data, size_t size);
+  //!< the underlying zmsg, created on demand
+  zmsg_t* zmsg();
+  //!< destroy the frames and return the zmsg to the pool
+  void ClearZmsg();
+
+  //!< memory of a frame added via add_frame(addr, nBytes, holder)
+  struct ZeroCopyFrame{
+    zframe_t* placeholder;
+    void* data;
+    size_t size;
+    shared_ptr<void> holder;
+  };
+  const ZeroCopyFrame* FindZeroCopyFrame(const zframe_t* frame) const{
+    for(int i=0;i<nzcframes_;i++)
+      if(zcframes_[i].placeholder==frame)
+        return zcframes_+i;
+    return nullptr;
+  }
+  //!< remove the i-th zero-copy frame from zcframes_
+  void EraseZeroCopyFrame(int i);
   static const unsigned int kOff1=16, kOff2=4, kOff3=24;
   static const unsigned int kMask1=(1<<kOff1)-1, kMask2=(1<<kOff2)-1,
                kMask3=(1<<kOff3)-1;
   unsigned int src_, dst_, target_;
+  int version_, size_, encoding_, codec_, base_version_;
+  int64_t timestamp_;
   zmsg_t* msg_;
   zframe_t *frame_;
+  //!< zero-copy frames, a fixed array to avoid allocations
+  ZeroCopyFrame zcframes_[kMaxZeroCopyFrames];
+  int nzcframes_;
+  static bool text_header_;
 };
 #endif
 
@@ -0,0 +1,63 @@
+#ifndef INCLUDE_COMMUNICATION_MSG_STATS_H_
+#define INCLUDE_COMMUNICATION_MSG_STATS_H_
+#include <stdint.h>
+#include <chrono>
+#include <string>
+#include "utils/histogram.h"
+
+namespace singa {
+enum MsgMetric{
+  kRouterQueue=0, //!< useconds from sending to Router::Receive
+  kDealerQueue, //!< useconds from sending to Dealer::Receive
+  kServiceTime, //!< useconds for Server::Run to handle a request
+  kMsgBytes, //!< bytes of sent messages
+  kStaleness, //!< versions a response lags behind the requested version
+  kNumMsgMetrics
+};
+//!< msg types (see MsgType) with statistics
+const int kMaxStatsMsgTypes=20;
+//!< destinations are distinguished by their flags, e.g., kServer
+const int kNumStatsDsts=4;
+
+/**
+ * @return useconds since epoch, which are carried in message headers for
+ * measuring queueing delays; delays across hosts include their clock skew
+ */
+inline int64_t NowMicros(){
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Histograms of the communication layer per metric, msg type and
+ * destination.
+ *
+ * Every thread records into its own histograms without locks; Dump() merges
+ * the histograms of all threads.
+ */
+class MsgStats{
+ public:
+  /**
+   * Record a value of the calling thread.
+   *
+   * @param dst_flag flag of the destination, e.g., kServer
+   */
+  static void Record(MsgMetric metric, int type, int dst_flag,
+      uint64_t value);
+  /**
+   * Record the queueing delay of a received message, given its timestamp.
+   */
+  static void RecordDelay(MsgMetric metric, int type, int dst_flag,
+      int64_t timestamp){
+    int64_t now=NowMicros();
+    if(timestamp>0&&now>=timestamp)
+      Record(metric, type, dst_flag, now-timestamp);
+  }
+  /**
+   * @return summaries of values recorded since the last call, one line per
+   * (metric, type, destination) with values
+   */
+  static std::string Dump();
+};
+}  // namespace singa
+#endif  // INCLUDE_COMMUNICATION_MSG_STATS_H_
@@ -0,0 +1,159 @@
+#ifndef INCLUDE_COMMUNICATION_SHM_SOCKET_H_
+#define INCLUDE_COMMUNICATION_SHM_SOCKET_H_
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "communication/socket.h"
+
+namespace singa {
+/**
+ * Default capacity (in bytes) of a shared memory ring.
+ */
+const size_t kShmRingSize=1<<27;
+
+/**
+ * Control block at the beginning of a shared memory ring.
+ *
+ * Producers reserve space by advancing head with CAS, write the record and
+ * then commit it by publishing the sequence number in the record header. The
+ * single consumer reads committed records in order, clears them and advances
+ * tail.
+ *
+ * The creator pid and its start time identify the run that created the ring,
+ * senders ignore rings left by processes that have exited and stop waiting
+ * on a full ring whose creator has exited.
+ *
+ * A receiver polling several rings links them to the doorbell of one ring
+ * (see ShmPoller), which senders ring as well as their own.
+ */
+struct ShmRingHeader{
+  uint32_t magic;
+  std::atomic<uint32_t> ready; //!< set by the creator once initialized
+  uint64_t capacity; //!< bytes of the data area, multiple of kShmAlign
+  int32_t creator; //!< pid of the creator
+  uint64_t epoch; //!< start time of the creator process
+  //!< name of the ring whose doorbell is also rung, valid once bell_linked
+  char bell_ring[64];
+  std::atomic<uint32_t> bell_linked;
+  alignas(64) std::atomic<uint64_t> head; //!< reserved by producers
+  alignas(64) std::atomic<uint64_t> tail; //!< consumed by the consumer
+  alignas(64) std::atomic<uint32_t> doorbell; //!< futex word
+  std::atomic<uint32_t> waiters; //!< num of consumers sleeping on doorbell
+};
+
+/**
+ * Header of each variable-size record in the ring.
+ */
+struct ShmRecord{
+  //!< position of the record in the ring plus 1, written when committed;
+  //!< records are zeroed when consumed, hence stale bytes never match
+  std::atomic<uint64_t> seq;
+  uint32_t len; //!< bytes of the payload, or of the whole record for padding
+  uint32_t padding; //!< 1 if the record only skips the end of the ring
+};
+
+/**
+ * Socket over a multi-producer single-consumer ring in /dev/shm.
+ *
+ * Each receiving procs creates one ring as its inbox; other procs on the same
+ * host open it for sending. Messages are serialized into the ring with
+ * variable size; a futex doorbell wakes up the blocked receiver.
+ */
+class ShmSocket : public Socket{
+ public:
+  /**
+   * @param name file name under /dev/shm, see RingName()
+   * @param create true for the receiving side, which creates the ring;
+   * false for senders, which wait until the ring is created by a running
+   * process
+   * @param capacity bytes of the ring, only used by the creator
+   * @param timeout mseconds to wait for the ring to be created
+   */
+  ShmSocket(const std::string& name, bool create, size_t capacity=kShmRingSize,
+      int timeout=5000);
+  virtual ~ShmSocket();
+  /**
+   * Remove the ring name if this socket created it; the ring stays mapped
+   * until all sockets on it are destroyed.
+   */
+  void Unlink();
+  /**
+   * Send the message, blocking if the ring is full.
+   *
+   * @return 0 if the ring is full and its receiver has exited
+   */
+  virtual int Send(Msg* msg);
+  /**
+   * Receive a message, blocking until one arrives.
+   */
+  virtual Msg* Receive();
+  virtual void* InternalID() const{
+    return ring_;
+  }
+  /**
+   * @return true if a message can be received without blocking
+   */
+  bool Readable() const;
+  /**
+   * Block on the doorbell until a message is readable.
+   *
+   * @param timeout in mseconds, negative for no timeout
+   * @return true if readable
+   */
+  bool Wait(int timeout);
+  /**
+   * @return the ring name for the inbox of the procs, unique per job
+   */
+  static std::string RingName(int port, int procs_id);
+
+ protected:
+  friend class ShmPoller;
+  /**
+   * Ring the doorbell of the ring and of the ring linked to it, if any.
+   */
+  void Ring();
+  /**
+   * Let senders of this ring also ring the doorbell of the other ring,
+   * both created by this procs.
+   */
+  void LinkDoorbell(const ShmSocket& other);
+  /**
+   * @return true if the process that created the ring is running
+   */
+  bool ReceiverAlive() const;
+  /**
+   * Sleep until the doorbell changes from bell or the deadline passes.
+   *
+   * @return false if the deadline has passed
+   */
+  bool Sleep(uint32_t bell, int timeout,
+      std::chrono::steady_clock::time_point deadline);
+
+ protected:
+  std::string name_, path_;
+  bool owner_;
+  int fd_;
+  size_t mapsize_;
+  ShmRingHeader* ring_;
+  char* data_;
+  //!< header of the linked ring mapped by the sender, nullptr if not mapped
+  ShmRingHeader* bell_;
+};
+
+/**
+ * Poller for ShmSocket.
+ *
+ * With more than one socket, all rings are linked to the doorbell of the
+ * first one, hence the poller sleeps on a single futex. The rings must be
+ * created by this procs.
+ */
+class ShmPoller: public BasePoller{
+ public:
+  virtual void Add(Socket* socket);
+  virtual Socket* Wait(int timeout);
+ protected:
+  std::vector<ShmSocket*> sockets_;
+};
+} /* singa */
+#endif // INCLUDE_COMMUNICATION_SHM_SOCKET_H_
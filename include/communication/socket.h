@@ -6,6 +6,20 @@
 namespace singa {
 
 const string kInprocRouterEndpoint="inproc://router";
+/**
+ * @return endpoint of the i-th router given the endpoint of the first one,
+ * e.g., "inproc://router-1" for the second stub thread.
+ */
+inline string RouterEndpoint(const string& endpoint, int i){
+  return i==0?endpoint:endpoint+"-"+std::to_string(i);
+}
+/**
+ * @return index of the router which forwards messages to dst; all messages
+ * of a (src, dst) pair go through the same router, hence keep their order.
+ */
+inline int RouterPartition(int dst, int nrouters){
+  return (static_cast<uint32_t>(dst)*2654435761u>>16)%nrouters;
+}
 class Socket{
   public:
   Socket(){}
@@ -58,6 +72,18 @@ class Poller: public BasePoller{
   Poller();
   virtual void Add(Socket* socket);
   virtual Socket* Wait(int duration);
+  /**
+   * Wait with a timeout in useconds. ZeroMQ polls in mseconds, hence the
+   * sockets are polled without blocking for the last (partial) msecond.
+   *
+   * @param timeout negative for no timeout
+   */
+  Socket* WaitMicros(int64_t timeout);
+  /**
+   * @return true if the last Wait() returned nullptr due to interruption
+   * rather than timeout
+   */
+  bool Terminated();
  protected:
   zpoller_t *poller_;
   std::map<zsock_t*, Socket*> zsock2Socket_;
@@ -69,8 +95,10 @@ class Dealer : public Socket{
    * @param id local dealer ID within a procs if the dealer is from worker or
    * server thread, starts from 1 (0 is used by the router); or the connected
    * remote procs ID for inter-process dealers from the stub thread.
+   * @param nrouters num of routers (stub threads) in this procs; the dealer
+   * has one ZeroMQ socket connected to each of them
    */
-  Dealer(int id=-1);
+  Dealer(int id=-1, int nrouters=1);
   virtual ~Dealer();
   /**
     * Setup the connection with the router.
@@ -81,17 +109,34 @@ class Dealer : public Socket{
     * router, hence we can fix the endpoint to be "inproc://router" for
     * intra-process. For inter-process, the endpoint follows ZeroMQ's
     * format, i.e., IP:port, where IP is the connected process.
+    * With multiple routers, the i-th socket connects to
+    * RouterEndpoint(endpoint, i).
     * @return 1 connection sets up successfully; 0 otherwise
     */
   virtual int Connect(string endpoint);
+  /**
+   * Send the message through the router of RouterPartition(msg->dst()).
+   */
   virtual int Send(Msg* msg);
+  /**
+   * Receive a message from any router.
+   */
   virtual Msg* Receive();
+  /**
+   * Send a message without frames, e.g., kConnect, to every router, which
+   * then knows the address of this dealer.
+   */
+  int Broadcast(Msg* msg);
   virtual void* InternalID() const{
     return dealer_;
   }
+  const std::vector<zsock_t*>& sockets() const{
+    return sockets_;
+  }
  protected:
   int id_;
-  zsock_t* dealer_;
+  zsock_t* dealer_; //!< the first socket
+  std::vector<zsock_t*> sockets_;
   zpoller_t* poller_;
 };
 
@@ -104,7 +149,8 @@ class Router : public Socket{
    * There is only one router per procs, hence its local id is 0 and is not set
    * explicitly.
    *
-   * @param bufsize buffer at most this number of messages
+   * @param bufsize warn if more messages are buffered for dealers that have
+   * not connected
    */
   Router(int bufsize=100);
  /**
@@ -122,6 +168,8 @@ class Router : public Socket{
   virtual int Bind(string endpoint);
  /**
    * If the destination socket has not connected yet, buffer this the message.
+   * The buffer is not bounded here; workers limit their in-flight requests,
+   * see ClusterProto get_hwm and update_hwm.
    */
   virtual int Send(Msg* msg);
   virtual Msg* Receive();
@@ -132,7 +180,9 @@ class Router : public Socket{
   zsock_t* router_;
   zpoller_t* poller_;
   std::map<int, zframe_t*> id2addr_;
-  std::map<int, std::vector<zmsg_t*>> bufmsg_;
+  std::map<int, std::vector<Msg*>> bufmsg_;
+  //!< identity of the sender of the last received message
+  string route_;
   int nBufmsg_, bufsize_;
 };
 
@@ -167,6 +167,16 @@ class Layer {
     name_=name;
     layer_proto_.set_name(name);
   }
+  /**
+   * @return key in Factory<Param> of the class of params created by this
+   * layer, see UpdaterProto param_type
+   */
+  const string& param_type() const {
+    return param_type_;
+  }
+  void set_param_type(const string& type){
+    param_type_=type;
+  }
   virtual const string type() const {
     return layer_proto_.type();
   }
@@ -254,6 +264,7 @@ protected:
   Blob<float> data_, grad_;
   // DArray pos_, neg_;//for CD
   LayerProto layer_proto_;
+  string param_type_="Param";
   vector<SLayer> srclayers_, dstlayers_;
 };
 
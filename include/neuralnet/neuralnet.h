@@ -37,14 +37,17 @@ class NeuralNet {
    * setup (done outside of this funcion).
    *
    * @param np proto for the neural network.
+   * @param param_type key of the Param class in Factory<Param>
    */
-  static shared_ptr<NeuralNet> SetupNeuralNet(const NetProto& np, Phase phase);
+  static shared_ptr<NeuralNet> SetupNeuralNet(const NetProto& np, Phase phase,
+      const string& param_type="Param");
 
  public:
   /**
    * construct the net structure from protocol buffer.
    */
-  NeuralNet(NetProto net_proto, int group_size=1);
+  NeuralNet(NetProto net_proto, int group_size=1,
+      const string& param_type="Param");
   /**
    * construct a json string representing the neuralnet graph.
    * The json string can be used by other graph engine to draw a figure for
@@ -150,6 +153,8 @@ class NeuralNet {
 
   map<string, LayerProto> name2layerproto_;
   int group_size_;
+  //!< key of the Param class of all params, see Layer::param_type()
+  string param_type_;
   Graph graph_;
 };
 }  // namespace singa
@@ -2,9 +2,11 @@
 #define INCLUDE_TRAINER_PM_SERVER_H_
 
 #include <czmq.h>
+#include <list>
 #include <memory>
 #include <vector>
 #include <map>
+#include <mutex>
 #include <string.h>
 #include "proto/model.pb.h"
 #include "utils/updater.h"
@@ -16,6 +18,8 @@ using std::string;
 using std::shared_ptr;
 
 namespace singa{
+//!< num of lock stripes of the ParamShard of servers
+const int kParamStripes=64;
 
 /**
  * Parameter manager at the server side.
@@ -33,12 +37,82 @@ namespace singa{
  */
 class PMServer{
 public:
-  typedef std::map<int, shared_ptr<Param>> ParamShard;
+  /**
+   * Params of all servers in a procs, which are accessed by all server
+   * threads concurrently.
+   *
+   * Params are distributed onto lock-striped maps by id. The stripe of a
+   * param must be locked via Lock() to access its entry and while handling
+   * requests for it.
+   *
+   * Each entry also records the server (in the group) owning the param,
+   * which changes when the param is moved, and the num of requests for it.
+   */
+  class ParamShard{
+   public:
+    explicit ParamShard(int nstripes=kParamStripes);
+    /**
+     * @return lock of the stripe of the param, which is released when the
+     * returned object is destroyed
+     */
+    std::unique_lock<std::mutex> Lock(int id){
+      return std::unique_lock<std::mutex>(stripes_[id%nstripes_].mutex);
+    }
+    /**
+     * @return the param, nullptr if it does not exist
+     */
+    shared_ptr<Param> Find(int id) const;
+    /**
+     * Find the param without locking its stripe, e.g., to read its
+     * snapshots while it is being updated. The index is copied on Insert()
+     * and Erase(), which are rare.
+     *
+     * @return the param, nullptr if it does not exist
+     */
+    shared_ptr<Param> Lookup(int id) const;
+    /**
+     * Insert the param, replacing the one with the same id if exists.
+     */
+    void Insert(int id, shared_ptr<Param> param);
+    /**
+     * Remove the param data; its owner is kept for forwarding requests.
+     */
+    void Erase(int id);
+    /**
+     * @return id of the server owning the param, -1 if unknown
+     */
+    int Owner(int id) const;
+    void SetOwner(int id, int server_id);
+    void CountRequest(int id){
+      stripes_[id%nstripes_].params[id].nrequests++;
+    }
+    /**
+     * @return num of requests for the param since the last call
+     */
+    uint64_t TakeRequests(int id);
+
+   protected:
+    struct Entry{
+      Entry():owner(-1), nrequests(0){}
+      shared_ptr<Param> param;
+      int owner;
+      uint64_t nrequests;
+    };
+    struct Stripe{
+      std::mutex mutex;
+      std::map<int, Entry> params;
+    };
+    int nstripes_;
+    std::unique_ptr<Stripe[]> stripes_;
+    //!< params of all stripes, accessed via atomic_load/store
+    shared_ptr<const std::map<int, shared_ptr<Param>>> index_;
+    std::mutex index_mutex_;
+  };
 
 	void Setup(int group_id, int server_id, shared_ptr<ParamShard> shard,
        const UpdaterProto& proto);
 
-	~PMServer();
+	virtual ~PMServer();
 
 	/**
 	 * Process GET request.
@@ -46,13 +120,31 @@ public:
    * @return the orignal message or response message
    */
 	virtual Msg* HandleGet(Msg** msg);
+  /**
+   * Answer a GET request from the snapshot of the requested version, or
+   * the latest one if it is fresh enough, without locking the param; see
+   * ClusterProto param_snapshots.
+   *
+   * @return the response, nullptr if no snapshot can answer it, then the
+   * request is handled by HandleGet()
+   */
+  virtual Msg* HandleGetFromSnapshot(Msg** msg);
+
+  /**
+   * Process SUBSCRIBE request, which is answered like a GET request; the
+   * worker then receives the param values via Publish().
+   *
+   * @return the orignal message or response message
+   */
+  virtual Msg* HandleSubscribe(Msg** msg);
 
 	/**
 	 * Process Update request.
    *
-   * @return the orignal message or response message
+   * @param responses the orignal message or response messages are appended
+   * to it, which may respond to requests buffered earlier
    */
-	virtual Msg* HandleUpdate(Msg** msg);
+	virtual void HandleUpdate(Msg** msg, vector<Msg*>* responses);
 
 	/**
 	 * Process PUT request.
@@ -63,7 +155,8 @@ public:
 	virtual Msg* HandlePut(Msg **msg);
 
 	/**
-   * TODO Process SYNC request.
+   * Process SYNC request, from workers (e.g., for ElasticParam) or from
+   * servers of neighbor groups, whose changes are applied without response.
 	 */
 	virtual Msg* HandleSyncRequest(Msg** msg);
 
@@ -73,17 +166,210 @@ public:
 	virtual int HandleSyncResponse(Msg** msg);
 
   /**
-   * Scheduler for synchronizing server groups.
+   * Generate SYNC requests for servers of the neighbor groups, carrying the
+   * changes of the params of this server since the last call.
+   *
+   * Changes received from neighbors are excluded, i.e., they are not sent
+   * back or forwarded, hence the server groups must be fully connected (see
+   * Cluster::CheckServerTopology()). Msgs are sent to the servers of the
+   * params in the neighbor groups given by ParamPlacement.
+   */
+  virtual void GenSyncMsgs(const vector<int>& neighbors, vector<Msg*>* msgs);
+
+  /**
+   * Generate the kLoad msg to the coordinator, i.e., server 0 of the group,
+   * carrying the bytes/sec of requests for each param owned by this server
+   * in the last secs seconds.
+   */
+  virtual Msg* GenLoadMsg(double secs);
+  /**
+   * Collect loads at the coordinator. Once all servers of the group have
+   * reported, a kMigrate msg is appended to responses if the load is
+   * unbalanced, see ClusterProto rebalance_threshold.
+   */
+  virtual void HandleLoad(Msg** msg, vector<Msg*>* responses);
+  /**
+   * Move the param to the server given in the kMigrate msg.
    *
-   * TODO implement the Caffe's synchronization scheduler for data parallelism
+   * The param is frozen at the current version: its data and history are
+   * sent to the new server, and later requests are forwarded there. Both
+   * the data and forwarded requests go through the stub, hence they arrive
+   * in order.
    */
-  virtual bool SyncNow();
+  virtual void HandleMigrate(Msg** msg, vector<Msg*>* responses);
+  /**
+   * Install a moved param and append kRoute msgs to the stubs of all procs,
+   * which route later requests (and syncs from other groups) to this server.
+   */
+  virtual void HandleMigrateData(Msg** msg, vector<Msg*>* responses);
 
  protected:
+  /**
+   * Forward the request to the owner of its param if it is not this server,
+   * called while holding the lock of the param.
+   *
+   * @return true if the request is forwarded, i.e., its dst is changed
+   */
+  bool Forward(Msg* msg);
+  /**
+   * @return kMigrate msg for moving one param from the most loaded server to
+   * the least loaded server, nullptr if the loads are balanced
+   */
+  Msg* Rebalance();
+  /**
+   * Push the values of the param to its subscribers if its version is a
+   * multiple of push_interval, called while holding the lock of the param
+   * after its version changes.
+   *
+   * @param responses pushes are appended to it, except to the workers that
+   * are already answered by responses for the param
+   */
+  void Publish(shared_ptr<Param> param, vector<Msg*>* responses);
+  /**
+   * Snapshot the values of the param if param_snapshots>0, called while
+   * holding the lock of the param after its values change.
+   */
+  void Snapshot(shared_ptr<Param> param);
+  /**
+   * @return versions a GET response may lag behind the requested version
+   */
+  virtual int staleness() const{
+    return 0;
+  }
+  /**
+   * Get the delta base of the param for the worker group of the request,
+   * called while holding the lock of the param. The base is reset if the
+   * request does not acknowledge it, i.e., the full values are sent.
+   *
+   * @return nullptr if the param has no response_codec
+   */
+  shared_ptr<DeltaBase> GetDeltaBase(shared_ptr<Param> param,
+      const Msg* request);
+  /**
+   * Drop the delta bases of the param, e.g., after it moves to another
+   * server.
+   */
+  void EraseDeltaBases(int id);
+
+ protected:
+  typedef std::pair<int, int> DeltaKey; //!< (worker group, param id)
   int group_id_, server_id_;
   shared_ptr<ParamShard> shard_;
   shared_ptr<Dealer> dealer_;
   shared_ptr<Updater> updater_;
+  //!< key of the Param class in Factory<Param>, see UpdaterProto param_type
+  string param_type_;
+  //!< param values at the last sync with neighbor groups, per id of params
+  //!< owned by this server
+  std::map<int, vector<float>> sync_base_;
+  std::mutex sync_base_mutex_;
+  vector<float> sync_buf_;
+  //!< (param id, bytes/sec) reported per server, accessed by the thread
+  //!< handling kLoad of the coordinator
+  std::map<int, vector<std::pair<int, float>>> loads_;
+  //!< addresses of pushes per param, which are accessed while holding the
+  //!< locks of their params
+  std::map<int, vector<Msg*>> subscribers_;
+  std::mutex subscribers_mutex_;
+  //!< delta bases with their positions in delta_lru_, whose front is the
+  //!< most recently used; the bases are accessed while holding the locks of
+  //!< their params
+  std::map<DeltaKey, std::pair<shared_ptr<DeltaBase>,
+    std::list<DeltaKey>::iterator>> delta_bases_;
+  std::list<DeltaKey> delta_lru_;
+  size_t delta_bytes_=0;
+  std::mutex delta_mutex_;
+};
+
+/**
+ * Parameter manager at the server side for bulk synchronous training.
+ *
+ * Gradients of one param from all worker groups of the server group are
+ * summed for each version; then the averaged gradient is applied once and
+ * all the requests are responded together. Updates of earlier versions,
+ * e.g., from a resumed worker, are answered with the current values without
+ * being applied; updates of later versions wait for their version.
+ */
+class SyncPMServer: public PMServer{
+ public:
+  virtual void HandleUpdate(Msg** msg, vector<Msg*>* responses);
+
+ protected:
+  /**
+   * Updates of one param for the current version.
+   */
+  struct Round{
+    Round():nupdates(0){}
+    int nupdates;
+    //!< sum of gradients received so far
+    vector<float> grad;
+    //!< addresses of the requests to respond
+    vector<Msg*> requests;
+    //!< updates for later versions, applied once the param reaches them
+    vector<Msg*> early;
+  };
+  /**
+   * @return the round of the param, created on the first call
+   */
+  Round* GetRound(int id);
+  /**
+   * Add the update of the current version to the round; respond to all
+   * requests of the round once the updates of all worker groups are added.
+   */
+  void Apply(shared_ptr<Param> param, Round* round, Msg** msg,
+      vector<Msg*>* responses);
+
+ protected:
+  //!< rounds are accessed while holding the locks of their params
+  std::map<int, Round> rounds_;
+  std::mutex rounds_mutex_;
+};
+
+/**
+ * Parameter manager at the server side for stale synchronous parallel
+ * training.
+ *
+ * Updates are applied once they arrive, as in async mode. The version of a
+ * param is the min clock of all worker groups of the server group, where the
+ * clock of a group is the version of its next update. A request for version
+ * v, i.e., a kGet or the response of a kUpdate whose next version is v, is
+ * answered once version()>=v-staleness; otherwise it is deferred until the
+ * slower groups catch up.
+ */
+class SSPPMServer: public PMServer{
+ public:
+  explicit SSPPMServer(int staleness): staleness_(staleness){}
+  virtual Msg* HandleGet(Msg** msg);
+  virtual int staleness() const{
+    return staleness_;
+  }
+  virtual void HandleUpdate(Msg** msg, vector<Msg*>* responses);
+
+ protected:
+  struct Clocks{
+    //!< clock of each worker group of the server group
+    vector<int> clocks;
+    //!< deferred kGet requests, or addresses of kUpdate requests to respond
+    vector<Msg*> deferred;
+  };
+  /**
+   * @return clocks of the param, which start from its version on the first
+   * call
+   */
+  Clocks* GetClocks(shared_ptr<Param> param);
+  bool Ready(shared_ptr<Param> param, int version) const{
+    return param->version()>=version-staleness_;
+  }
+  /**
+   * Respond to the deferred or incoming request whose version is ready.
+   */
+  Msg* Respond(shared_ptr<Param> param, Msg* msg);
+
+ protected:
+  int staleness_;
+  //!< clocks are accessed while holding the locks of their params
+  std::map<int, Clocks> clocks_;
+  std::mutex clocks_mutex_;
 };
 
 } // namespace singa
@@ -87,31 +87,62 @@ public:
   }
 
   /**
-   * @return server id where the parameter is maintained.
+   * @param target param id or slice of a param, see SliceTarget()
+   * @return server id where the parameter (slice) is maintained.
    */
-  virtual int Sharding(int param_id);
+  virtual int Sharding(int target);
 
 	/**
-	 * Generate a request message to Get the parameter object.
+	 * Generate request messages to Get the parameter object, one per slice.
+	 *
+	 * @param msgs the requests are appended to it
 	 */
-	virtual Msg* Get(shared_ptr<Param> param, int step);
+	virtual void Get(shared_ptr<Param> param, int step, vector<Msg*>* msgs);
   virtual Msg* Get(Msg** msg);
 
 	/**
-	 * Generate a request message to Update the parameter object.
+	 * Generate request messages to Subscribe to the parameter object, one
+	 * per slice, which are answered like Get requests; later values are
+	 * pushed by the servers, see ClusterProto push_interval.
+	 *
+	 * @param msgs the requests are appended to it
 	 */
-	virtual Msg* Update(shared_ptr<Param> param, int step);
+	virtual void Subscribe(shared_ptr<Param> param, int step,
+      vector<Msg*>* msgs);
+
+	/**
+	 * Generate request messages to Update the parameter object, one per
+	 * slice.
+	 *
+	 * @param msgs the requests are appended to it
+	 */
+	virtual void Update(shared_ptr<Param> param, int step, vector<Msg*>* msgs);
   virtual Msg* Update(Msg** msg);
 
+	/**
+	 * Generate a request message to Sync the parameter object with the
+	 * server, e.g., by elastic averaging.
+	 *
+	 * @param step the param is waited to be of this version after syncing
+	 * @param arg passed to Param::GenSyncMsg
+	 */
+	virtual Msg* Sync(shared_ptr<Param> param, int step, void* arg);
+
 	/**
 	 * Collect a Param object returned from server.
+	 *
+	 * @return a kGet request for the full values of the slice if the msg is a
+	 * delta against values no longer held, to be sent by the worker; otherwise
+	 * nullptr
 	 */
 	virtual Msg* Collect(Msg**);
 
 	/**
-	 * Generate a request message to Put the parameter object.
+	 * Generate request messages to Put the parameter object, one per slice.
+	 *
+	 * @param msgs the requests are appended to it
 	 */
-	virtual Msg* Put(shared_ptr<Param> param, int step);
+	virtual void Put(shared_ptr<Param> param, int step, vector<Msg*>* msgs);
   virtual Msg* Put(Msg** msg);
 
  protected:
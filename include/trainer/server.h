@@ -1,22 +1,129 @@
 #ifndef INCLUDE_TRAINER_SERVER_H_
 #define INCLUDE_TRAINER_SERVER_H_
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <queue>
+#include <utility>
+#include <vector>
 #include "trainer/pm_server.h"
 #include "communication/socket.h"
+#include "proto/cluster.pb.h"
 
 using std::shared_ptr;
 namespace singa {
+//!< seconds between two logs of the server throughput
+const int kServerStatsInterval=60;
+
 class Server{
  public:
   Server(int group_id, int server_id);
   void Setup(const UpdaterProto& proto, shared_ptr<PMServer::ParamShard> shard,
     shared_ptr<Dealer> dealer);
+  /**
+   * Receive requests and send responses.
+   *
+   * With server_threads>1, requests are dispatched to the server threads by
+   * param id; responses are queued and sent by this thread as the sockets
+   * are not thread-safe. Similarly, msgs for syncing with neighbor server
+   * groups are generated by a background thread and sent by this thread.
+   */
   void Run();
 
  protected:
+  /**
+   * Handle one request.
+   *
+   * @param responses responses to send are appended to it, which may be
+   * for requests handled earlier, e.g., in synchronous training
+   */
+  void HandleRequest(Msg* msg, std::vector<Msg*>* responses);
+  /**
+   * Loop of the i-th server thread, handling dispatched requests in order
+   * until a nullptr request is dispatched.
+   */
+  void HandleRequests(int i);
+  /**
+   * Dispatch the request received from sock to the server thread of its
+   * param.
+   */
+  void Dispatch(Msg* msg, Socket* sock);
+  /**
+   * Queue msgs to be sent through sock by the receiving thread, which is
+   * notified through the notifier of the calling thread.
+   */
+  void Enqueue(std::vector<Msg*>* msgs, Socket* sock, Dealer* notifier);
+  /**
+   * Send responses queued by the server threads.
+   */
+  void SendResponses();
+  /**
+   * Send changes of params to the servers of neighbor groups every
+   * sync_interval mseconds until stop_ is set.
+   */
+  void Gossip(ServerTopology topology);
+  /**
+   * Log updates/sec (and message statistics if there are no workers in this
+   * procs) every kServerStatsInterval seconds.
+   */
+  void ReportThroughput();
+  /**
+   * Send the loads of params to the coordinator every rebalance_interval
+   * seconds, see ClusterProto.
+   */
+  void ReportLoad();
+  /**
+   * @return the socket to send msg, which is the one the worker's requests
+   * come from (sock if none) for responses to workers, or dealer_ for msgs
+   * to servers and stubs, e.g., forwarded requests, and for pushes to
+   * workers that may not be connected to sock
+   */
+  Socket* SocketFor(Msg* msg, Socket* sock){
+    int flag=msg->dst_flag();
+    if(flag==kServer||flag==kStub||msg->type()==kPush)
+      return dealer_.get();
+    // responses buffered by the PMServer may be for requests received
+    // through another socket than the one releasing them
+    auto it=reply_socks_.find(msg->dst());
+    return it!=reply_socks_.end()?it->second:sock;
+  }
+
+ protected:
+  typedef std::pair<Msg*, Socket*> Request;
+  /**
+   * Requests dispatched to one server thread.
+   */
+  struct RequestQueue{
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::queue<Request> requests;
+  };
+
   int group_id_, server_id_;
   shared_ptr<PMServer> pmserver_;
   shared_ptr<Dealer> dealer_;
+  //!< receives requests from workers directly, see direct_server_access
+  shared_ptr<Router> router_;
+
+  int nthreads_;
+  std::vector<std::unique_ptr<RequestQueue>> queues_;
+  //!< responses of the server threads and the sockets to send them
+  std::vector<Request> outbox_;
+  std::mutex outbox_mutex_;
+  //!< socket of the requests from each worker address, only used by Run()
+  std::map<int, Socket*> reply_socks_;
+  //!< server threads notify Run() of responses in outbox_ through it
+  shared_ptr<Router> notifier_;
+  //!< stops the gossip thread
+  bool stop_;
+  std::mutex stop_mutex_;
+  std::condition_variable stop_cv_;
+  std::atomic<uint64_t> nupdates_;
+  uint64_t last_nupdates_;
+  std::chrono::steady_clock::time_point last_report_, last_load_report_;
 };
 } /* Server */
 #endif //INCLUDE_TRAINER_SERVER_H_
@@ -1,5 +1,7 @@
 #ifndef INCLUDE_TRAINER_TRAINER_H_
 #define INCLUDE_TRAINER_TRAINER_H_
+#include <deque>
+#include <map>
 #include "proto/cluster.pb.h"
 #include "proto/model.pb.h"
 #include "utils/updater.h"
@@ -11,8 +13,15 @@
 #include "trainer/pm_server.h"
 #include "trainer/worker.h"
 #include "trainer/server.h"
+#include "communication/shm_socket.h"
 
 namespace singa {
+/**
+ * @return id of the procs running the worker or server
+ * @param flag kServer, kWorkerParam or kWorkerLayer
+ */
+int ProcsIDOf(int group_id, int id, int flag);
+
 /**
  * Every running process has a training object which launches one or more
  * worker (and server) threads.
@@ -34,7 +43,38 @@ class Trainer{
   // point.
 
  protected:
+  /**
+   * Create the first router and connect to all other procs, see
+   * ConnectProcs().
+   */
+  void SetupStub();
+  /**
+   * Connect to the stubs of all other procs in the hostfile and exchange
+   * kConnect handshakes, then wait for the kReady barrier coordinated by
+   * procs 0, i.e., all procs are connected to each other.
+   *
+   * Fails if not done within stub_timeout mseconds.
+   */
+  void ConnectProcs();
+  /**
+   * @return a socket for sending messages to the stub of the procs, i.e., a
+   * shared memory ring if it is on the same host, otherwise a dealer
+   */
+  shared_ptr<Socket> ConnectTo(int procs_id);
+  /**
+   * Start the stub threads, each running Route() with one router.
+   */
   void Run();
+  /**
+   * Forward messages received by one router, i.e., to local workers and
+   * servers, or to other procs.
+   *
+   * Local dealers send a message through router RouterPartition(dst), hence
+   * the stub threads share the load of forwarding; messages from other procs
+   * arrive at router 0.
+   * @param partition index of the router
+   */
+  void Route(int partition);
   /**
    * Register default implementations for all base classes used in the system,
    * e.g., the Updater, BaseMsg, etc.
@@ -45,6 +85,18 @@ class Trainer{
    * implementation class as the value, e.g., <"Updater" SGDUpdater>.
    */
   void RegisterDefaultClasses(const singa::ModelProto& proto);
+
+ protected:
+  //!< true if some procs are reached through shared memory
+  bool shm_;
+  //!< the shared memory inbox of this procs, forwarded by a detached thread
+  shared_ptr<ShmSocket> shm_inbox_;
+  //!< the first router, which receives messages from other procs
+  shared_ptr<Router> router_;
+  //!< sockets to other procs connected at startup, used by the first router
+  std::map<int, shared_ptr<Socket>> peers_;
+  //!< messages (not for the startup) received before all procs are ready
+  std::deque<Msg*> early_msgs_;
 };
 } /* singa */
 #endif // INCLUDE_TRAINER_TRAINER_H_
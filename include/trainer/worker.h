@@ -1,10 +1,12 @@
 #ifndef INCLUDE_TRAINER_WORKER_H_
 #define INCLUDE_TRAINER_WORKER_H_
 #include <map>
+#include <chrono>
 #include <exception>
 #include "neuralnet/neuralnet.h"
 #include "proto/model.pb.h"
 #include "trainer/pm_worker.h"
+#include "utils/updater.h"
 #include "utils/cluster.h"
 #include "communication/socket.h"
 #include "communication/msg.h"
@@ -53,8 +55,68 @@ class Worker {
 
   int Put(shared_ptr<Param> param, int step);
   int Get(shared_ptr<Param> param, int step);
+  /**
+   * Subscribe to the pushes of the param regardless of its version, see
+   * ClusterProto push_interval.
+   */
+  int Subscribe(shared_ptr<Param> param, int step);
+  /**
+   * Send the gradient to servers, or apply it locally if params are synced
+   * with servers every sync_frequency steps (see UpdaterProto).
+   */
   int Update(shared_ptr<Param> param, int step);
   int Collect(shared_ptr<Param> param, int step);
+  /**
+   * Send a msg through param_dealer_ after acquiring a credit of its type
+   * and destination server; wait for (and collect) responses if the num of
+   * in-flight msgs reaches the high-water mark of its type.
+   *
+   * @return 1 for success, 0 if the connection is broken
+   */
+  int SendParamMsg(Msg* msg);
+  /**
+   * Send msgs, e.g., requests for all slices of a param, via SendParamMsg();
+   * msgs after a failure are deleted.
+   *
+   * @return 1 for success, 0 if the connection is broken
+   */
+  int SendParamMsgs(vector<Msg*>* msgs);
+  /**
+   * Register the dealer at all stub threads with the address of this worker.
+   *
+   * @param flag kWorkerParam or kWorkerLayer
+   */
+  void Connect(Dealer* dealer, int flag);
+  /**
+   * Receive a response from the stub or (direct connections to) servers;
+   * the credit of the request is returned.
+   *
+   * @param block if false, return nullptr if no msg has arrived
+   * @return nullptr if the connection is broken
+   */
+  Msg* ReceiveParamMsg(bool block=true);
+  /**
+   * Collect the response msg via PMWorker::Collect() and send the request
+   * it generates, e.g., for the full values of a slice whose delta is
+   * dropped.
+   *
+   * @return 1 for success, 0 if the connection is broken
+   */
+  int CollectParamMsg(Msg* msg);
+  /**
+   * Return the credit of the request answered by the response msg.
+   */
+  void ReleaseCredit(Msg* msg);
+  /**
+   * @return the dealer connected directly to the server, created on the
+   * first call; see ClusterProto direct_server_access
+   */
+  Dealer* ServerDealer(int group_id, int server_id);
+  /**
+   * @return the high-water mark of in-flight msgs of the type per server, 0
+   * for unlimited
+   */
+  int HighWaterMark(int type) const;
   /**
     * check validation/test firstly, then TrainOneBatch
     * Performance collects performance for the whole neuralnet.
@@ -167,6 +229,25 @@ class Worker {
   shared_ptr<NeuralNet> train_net_, test_net_, validation_net_;
   shared_ptr<Dealer> layer_dealer_, param_dealer_;
   Poller layer_poller_, param_poller_;
+  //!< Msg pool counters at the last display, see Msg::pool_stats()
+  uint64_t last_allocs_, last_reuses_;
+  //!< bytes of update msgs and of their dense fp32 gradients since last display
+  uint64_t update_bytes_, dense_bytes_;
+  //!< num of in-flight requests per (type, destination)
+  std::map<std::pair<int, int>, int> inflight_;
+  //!< destination of the in-flight request per (type, param id), as the
+  //!< response may come from another server if the param has moved
+  std::map<std::pair<int, int>, int> request_dst_;
+  //!< seconds waiting for credits per msg type since last display
+  std::map<int, double> stall_time_;
+  //!< dealers connected to servers directly, indexed by (group, server id)
+  std::map<std::pair<int, int>, shared_ptr<Dealer>> server_dealers_;
+  //!< sending time of pending kGet per param id
+  std::map<int, std::chrono::steady_clock::time_point> get_start_;
+  //!< round trip time (useconds) of kGet since last display
+  vector<double> get_rtt_;
+  //!< updates params locally if they are synced periodically
+  shared_ptr<Updater> updater_;
 };
 
 class WorkerException: public std::exception{
@@ -66,13 +66,30 @@ class SyncedMemory {
  public:
   SyncedMemory()
       : cpu_ptr_(NULL), gpu_ptr_(NULL), size_(0), head_(UNINITIALIZED),
-        own_cpu_data_(false) {}
+        own_cpu_data_(false), generation_(0) {}
   explicit SyncedMemory(size_t size)
       : cpu_ptr_(NULL), gpu_ptr_(NULL), size_(size), head_(UNINITIALIZED),
-        own_cpu_data_(false) {}
+        own_cpu_data_(false), generation_(0) {}
   ~SyncedMemory();
   const void* cpu_data();
   void set_cpu_data(void* data);
+  /**
+   * Pin the cpu buffer, e.g., for zero-copy sending. The buffer stays valid
+   * and unchanged while the returned handle is alive; mutable_cpu_data()
+   * switches to a fresh copy of the buffer (copy-on-write) before returning.
+   */
+  shared_ptr<void> pin_cpu_data();
+  /**
+   * Use external memory as the cpu buffer without copying.
+   *
+   * @param data must have the same size as this SyncedMemory
+   * @param holder owns the memory; it is released when the buffer is replaced
+   */
+  void adopt_cpu_data(void* data, size_t size, shared_ptr<void> holder);
+  /**
+   * @return num of copy-on-writes happened so far
+   */
+  int generation() const { return generation_; }
   const void* gpu_data();
   void* mutable_cpu_data();
   void* mutable_gpu_data();
@@ -83,11 +100,15 @@ class SyncedMemory {
  private:
   void to_cpu();
   void to_gpu();
+  void copy_on_write();
   void* cpu_ptr_;
   void* gpu_ptr_;
   size_t size_;
   SyncedHead head_;
   bool own_cpu_data_;
+  //!< owns (or references) the memory of cpu_ptr_, its copies are pins
+  shared_ptr<void> cpu_holder_;
+  int generation_;
 
 };  // class SyncedMemory
 
@@ -73,13 +73,101 @@ class Cluster {
     return endpoint(procs_id());
   }
   /**
-   * @return endpoint of the router of a procs with the specified id
+   * @return endpoint of the router of a procs with the specified id, i.e.,
+   * tcp://host:port from the hostfile line "host[:port]", where the port is
+   * start_port by default
    */
   const string endpoint(int procs_id) const {
     CHECK_LT(procs_id, nprocs());
     CHECK_GE(procs_id, 0);
     return endpoints_.at(procs_id);
   }
+  /**
+   * @return host name (or IP) of the procs with the specified id
+   */
+  const string host(int procs_id) const;
+  /**
+   * @return tcp port of the router of the procs with the specified id
+   */
+  int port(int procs_id) const;
+  /**
+   * @return true if the procs runs on the same host as the calling procs
+   */
+  bool colocated(int procs_id) const {
+    return procs_id==procs_id_||
+      (!addrs_.empty()&&addrs_.at(procs_id)==addrs_.at(procs_id_));
+  }
+  int start_port() const {
+    return cluster_.start_port();
+  }
+  bool shm_transport() const {
+    return cluster_.shm_transport();
+  }
+  size_t shm_ring_size() const {
+    return cluster_.shm_ring_size();
+  }
+  bool coalesce() const {
+    return cluster_.coalesce();
+  }
+  size_t coalesce_bytes() const {
+    return cluster_.coalesce_bytes();
+  }
+  int coalesce_delay() const {
+    return cluster_.coalesce_delay();
+  }
+  int get_hwm() const {
+    return cluster_.get_hwm();
+  }
+  int update_hwm() const {
+    return cluster_.update_hwm();
+  }
+  int router_bufsize() const {
+    return cluster_.router_bufsize();
+  }
+  int stub_threads() const {
+    return cluster_.stub_threads();
+  }
+  bool direct_server_access() const {
+    return cluster_.direct_server_access();
+  }
+  int server_threads() const {
+    return cluster_.server_threads();
+  }
+  ClusterProto::ParamPlacementPolicy param_placement() const {
+    return cluster_.param_placement();
+  }
+  int rebalance_interval() const {
+    return cluster_.rebalance_interval();
+  }
+  float rebalance_threshold() const {
+    return cluster_.rebalance_threshold();
+  }
+  int push_interval() const {
+    return cluster_.push_interval();
+  }
+  int param_snapshots() const {
+    return cluster_.param_snapshots();
+  }
+  int delta_base_mbytes() const {
+    return cluster_.delta_base_mbytes();
+  }
+  /**
+   * @return topology of the server group, nullptr if not configured
+   */
+  const ServerTopology* server_topology(int group_id) const;
+  /**
+   * @return endpoint of the router of a server for direct connections from
+   * workers of this procs, i.e., inproc if the server runs in this procs
+   * @param procs_id id of the procs running the server, see ProcsIDOf()
+   */
+  const string server_endpoint(int group_id, int server_id, int procs_id)
+    const;
+  /**
+   * @return tcp port bound by the router of a server for direct connections
+   */
+  int server_port(int group_id, int server_id) const {
+    return server_start_port_+group_id*nservers_per_group()+server_id;
+  }
   const string workspace() {return cluster_.workspace();}
   const string vis_folder(){
     return cluster_.workspace()+"/visualization";
@@ -111,10 +199,26 @@ class Cluster {
  private:
   Cluster(const ClusterProto &cluster, int procs_id) ;
   void SetupFolders(const ClusterProto &cluster);
+  void ResolveHosts();
+  /**
+   * Set server_start_port_ and check that the server ports do not overlap
+   * the ports of the procs.
+   */
+  void SetupServerPorts();
+  /**
+   * Check that server groups which sync with neighbors are fully connected.
+   * Changes received from a neighbor are not forwarded, hence groups that
+   * are not neighbors would never see each other's updates.
+   */
+  void CheckServerTopology() const;
 
  private:
   int procs_id_;
   std::vector<std::string> endpoints_;
+  //!< resolved address of each procs' host, for checking co-location
+  std::vector<std::string> addrs_;
+  //!< port of the first server for direct connections
+  int server_start_port_;
   // cluster config proto
   ClusterProto cluster_;
   // make this class a singlton
@@ -0,0 +1,112 @@
+#ifndef INCLUDE_UTILS_CODEC_H_
+#define INCLUDE_UTILS_CODEC_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "proto/model.pb.h"
+
+/**
+ * Conversion kernels between the fp32 Blob content and the encodings used for
+ * sending parameter values and gradients.
+ *
+ * SIMD versions are used when the CPU supports them, i.e., F16C for fp16 and
+ * SSE2 for bf16; the results are the same as the scalar versions (round to
+ * nearest even).
+ */
+namespace singa {
+/**
+ * @return num of bytes for n floats in the encoding
+ */
+size_t EncodedBytes(ParamProto::WireEncoding encoding, int n);
+/**
+ * Encode n floats from src into dst, which has EncodedBytes() bytes.
+ */
+void EncodeFloats(ParamProto::WireEncoding encoding, const float* src, int n,
+    void* dst);
+/**
+ * Decode n floats from src (generated by EncodeFloats) into dst.
+ */
+void DecodeFloats(ParamProto::WireEncoding encoding, const void* src, int n,
+    float* dst);
+
+void FloatToHalf(const float* src, int n, uint16_t* dst);
+void HalfToFloat(const uint16_t* src, int n, float* dst);
+void FloatToBF16(const float* src, int n, uint16_t* dst);
+void BF16ToFloat(const uint16_t* src, int n, float* dst);
+/**
+ * Find the magnitude threshold of the k largest (in magnitude) values.
+ *
+ * @param scratch buffer reused across calls to avoid allocations
+ * @return the k-th largest magnitude; 0 if k >= n
+ */
+float TopKThreshold(const float* src, int n, int k,
+    std::vector<float>* scratch);
+/**
+ * Move values whose magnitude is at least threshold out of src, i.e., append
+ * their indices and values to idx and val and reset them to 0 in src.
+ *
+ * Zero values are never moved.
+ * @param max at most this num of values are moved
+ * @return num of moved values
+ */
+int ExtractSparse(float* src, int n, float threshold, int max,
+    std::vector<int>* idx, std::vector<float>* val);
+/**
+ * @return num of bytes of n quantized floats, see Quantize()
+ */
+size_t QuantizedBytes(ParamProto::UpdateCodec codec, int n, int cols);
+/**
+ * Quantize n floats of src into dst with kSign1Bit or kLinear8Bit, and leave
+ * the quantization error in src.
+ *
+ * For kSign1Bit, src is a row major matrix with cols columns; dst has the
+ * (positive, negative) means of every column followed by the sign bits.
+ * For kLinear8Bit, dst has the (min, max) of every kQuantChunk floats followed
+ * by one byte per float.
+ * @param scratch buffer reused across calls to avoid allocations
+ */
+void Quantize(ParamProto::UpdateCodec codec, float* src, int n, int cols,
+    void* dst, std::vector<float>* scratch);
+/**
+ * Reconstruct n floats from src (generated by Quantize) into dst.
+ */
+void Dequantize(ParamProto::UpdateCodec codec, const void* src, int n,
+    int cols, float* dst);
+const int kQuantChunk=256;
+/**
+ * dst=a^b for nbytes bytes; dst may alias a or b.
+ */
+void XorBytes(const void* a, const void* b, size_t nbytes, void* dst);
+/**
+ * Transpose n elements of elem_size bytes into elem_size planes, i.e., the
+ * k-th bytes of all elements are stored together, which groups the (mostly
+ * zero) sign and exponent bytes of XOR deltas for CompressBytes().
+ */
+void ShuffleBytes(const void* src, size_t n, int elem_size, void* dst);
+/**
+ * Inverse of ShuffleBytes().
+ */
+void UnshuffleBytes(const void* src, size_t n, int elem_size, void* dst);
+/**
+ * LZ77-style compression of n bytes of src, appended to dst as sequences of
+ * (num of literals, literals, match length, match offset) in varints; runs
+ * are matches with offset 1.
+ *
+ * @return num of bytes appended
+ */
+size_t CompressBytes(const void* src, size_t n, std::vector<char>* dst);
+/**
+ * Decompress nbytes of src (generated by CompressBytes) into dst, which must
+ * have exactly n bytes after decompression.
+ */
+void DecompressBytes(const void* src, size_t nbytes, void* dst, size_t n);
+
+/**
+ * Scalar versions, exposed for testing the SIMD kernels.
+ */
+uint16_t FloatToHalf(float f);
+float HalfToFloat(uint16_t h);
+uint16_t FloatToBF16(float f);
+float BF16ToFloat(uint16_t h);
+}  // namespace singa
+#endif  // INCLUDE_UTILS_CODEC_H_
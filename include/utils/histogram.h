@@ -0,0 +1,73 @@
+#ifndef INCLUDE_UTILS_HISTOGRAM_H_
+#define INCLUDE_UTILS_HISTOGRAM_H_
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+
+namespace singa {
+//!< bucket i counts values in [2^(i-1), 2^i), bucket 0 counts 0
+const int kHistBuckets=64;
+
+/**
+ * Histogram with power-of-two buckets written by a single thread.
+ *
+ * Counters are updated by relaxed loads and stores (no locked instructions),
+ * and can be read concurrently by other threads, e.g., for dumping.
+ */
+class Histogram{
+ public:
+  Histogram();
+  void Add(uint64_t value){
+    Inc(&buckets_[Bucket(value)], 1);
+    Inc(&count_, 1);
+    Inc(&sum_, value);
+  }
+  static int Bucket(uint64_t value){
+    return value==0?0:std::min(kHistBuckets-1, 64-__builtin_clzll(value));
+  }
+
+ protected:
+  static void Inc(std::atomic<uint64_t>* x, uint64_t delta){
+    x->store(x->load(std::memory_order_relaxed)+delta,
+        std::memory_order_relaxed);
+  }
+
+ protected:
+  friend class HistogramData;
+  std::atomic<uint64_t> buckets_[kHistBuckets];
+  std::atomic<uint64_t> count_, sum_;
+};
+
+/**
+ * Plain copy of histograms, e.g., merged from all threads.
+ */
+class HistogramData{
+ public:
+  HistogramData();
+  void Merge(const Histogram& hist);
+  /**
+   * Subtract an earlier snapshot to get the values added since then.
+   */
+  void Subtract(const HistogramData& other);
+  uint64_t count() const {
+    return count_;
+  }
+  double mean() const {
+    return count_==0?0:static_cast<double>(sum_)/count_;
+  }
+  /**
+   * @return upper bound of the bucket containing the q-quantile, q in [0,1]
+   */
+  uint64_t Percentile(double q) const;
+  /**
+   * @return "count, mean, p50, p99, max" as a string
+   */
+  std::string ToString() const;
+
+ protected:
+  uint64_t buckets_[kHistBuckets];
+  uint64_t count_, sum_;
+};
+}  // namespace singa
+#endif  // INCLUDE_UTILS_HISTOGRAM_H_
@@ -3,28 +3,119 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <memory>
 #include <functional>
+#include <random>
 #include "proto/model.pb.h"
 #include "utils/blob.h"
 #include "communication/msg.h"
 // Base paramter class.
 namespace singa {
+//!< low bits of msg targets for the param id, the high bits (up to 24 bits
+//!< in total) are the slice index, see Param::Slice()
+const int kSliceShift=16;
+inline int SliceTarget(int param_id, int slice){
+  return (slice<<kSliceShift)|param_id;
+}
+inline int ParamOfTarget(int target){
+  return target&((1<<kSliceShift)-1);
+}
+inline int SliceOfTarget(int target){
+  return target>>kSliceShift;
+}
+
+/**
+ * Values of a param at one version in the wire encoding, which stay
+ * unchanged while the snapshot is referenced.
+ */
+struct ParamSnapshot{
+  int version, size, encoding;
+  const void* bytes;
+  size_t nbytes;
+  //!< pins the data blob (fp32) or owns the encoded values
+  shared_ptr<void> holder;
+};
+//!< snapshots of a param from the latest version
+typedef std::vector<shared_ptr<const ParamSnapshot>> ParamSnapshots;
+
+/**
+ * Values of a param last sent by a server to one worker group, against
+ * which the next response is delta encoded, see ParamProto response_codec.
+ */
+struct DeltaBase{
+  //!< id of the values acknowledged by the worker group, -1 if not sent
+  int version=-1;
+  //!< values in Param::delta_encoding()
+  std::vector<char> bytes;
+};
+
 class Param {
  public:
   Param();
   virtual ~Param();
 
   virtual Msg* GenGetMsg(void* arg=nullptr);
-  virtual Msg* GenPutMsg(void* arg=nullptr);
-  virtual Msg* GenUpdateMsg(void* arg=nullptr);
+  /**
+   * @param slice only the values of this slice are sent, see Slice()
+   */
+  virtual Msg* GenPutMsg(void* arg=nullptr, int slice=0);
+  virtual Msg* GenUpdateMsg(void* arg=nullptr, int slice=0);
   virtual Msg* GenSyncMsg(void* arg=nullptr);
 
-  virtual Msg* HandleGetMsg(Msg** msg);
+  /**
+   * @param staleness the requested version may be newer than version() by
+   * at most staleness, e.g., for stale synchronous servers
+   * @param base if not null, the values are delta encoded against it, see
+   * AddValueFrames()
+   */
+  virtual Msg* HandleGetMsg(Msg** msg, int staleness=0,
+      DeltaBase* base=nullptr);
   virtual Msg* HandlePutMsg(Msg** msg);
-  virtual int ParseUpdateMsg(Msg** msg);
+  virtual int ParseUpdateMsg(Msg** msg, int staleness=0);
+  /**
+   * @param arg DeltaBase of the receiver or nullptr, see HandleGetMsg()
+   */
   virtual Msg* GenUpdateResponseMsg(void* arg=nullptr);
   virtual Msg* HandleSyncMsg(Msg** msg);
+  /**
+   * Generate the kMigrateData msg carrying the version, hyper-params, shape,
+   * data and history (fp32) of this param to its new server.
+   */
+  virtual Msg* GenMigrateMsg();
+  /**
+   * Restore the param from a kMigrateData msg, which is consumed.
+   */
+  virtual void HandleMigrateMsg(Msg** msg);
+  /**
+   * Snapshot the current values at the server, called while the param is
+   * locked after the values change. For fp32 the data blob is pinned, hence
+   * the next update copies it (copy-on-write); other encodings are encoded
+   * once here for all Gets of the version.
+   *
+   * @param capacity num of snapshots kept, older ones are released when
+   * their in-flight msgs are sent
+   */
+  void TakeSnapshot(int capacity);
+  /**
+   * Thread-safe without locking the param.
+   *
+   * @param version -1 for the latest version
+   * @return the snapshot of the version, nullptr if it is not kept
+   */
+  shared_ptr<const ParamSnapshot> GetSnapshot(int version=-1) const;
+  /**
+   * Answer a GET request with the snapshot, which is referenced by the
+   * (zero-copy) response frame.
+   */
+  static Msg* HandleGetMsg(Msg** msg, shared_ptr<const ParamSnapshot> snapshot);
 
+  /**
+   * Read the values of the slice in the msg target; once every slice has
+   * arrived, the version is set to the min of the latest slice versions.
+   *
+   * @return 0 if the msg is a delta against values no longer held, then the
+   * slice is not counted and must be requested again with base version -1
+   */
   virtual int ParseGetResponseMsg(Msg** msg);
   virtual int ParsePutResponseMsg(Msg** msg);
   virtual int ParseUpdateResponseMsg(Msg** msg);
@@ -50,11 +141,25 @@ class Param {
   float weight_decay_multiplier() {
     return proto_.weight_decay_multiplier();
   }
-  /*
-  const int split_threshold(){
-    return proto_.split_threshold();
+  /**
+   * Split the param into contiguous slices of whole rows (the last dim is
+   * the columns) with at most max_size values each, but at least one row.
+   * Slices are placed, requested and updated independently, e.g., on
+   * different servers. Called by Setup() with split_threshold.
+   *
+   * @param max_size no split if it is not positive
+   */
+  void Slice(int max_size);
+  int nslices() const {
+    return slice_offsets_.size()<2?1:slice_offsets_.size()-1;
+  }
+  int slice_offset(int slice) const {
+    return slice_offsets_.size()<2?0:slice_offsets_[slice];
+  }
+  int slice_size(int slice) const {
+    return slice_offsets_.size()<2?size():
+      slice_offsets_[slice+1]-slice_offsets_[slice];
   }
-  */
   /**
    * if the Param shares data with others, then point to the owner.
    * otherwise points to itself.
@@ -120,7 +225,105 @@ class Param {
   float* mutable_cpu_history(){
     return history_.mutable_cpu_data();
   }
+  const ParamProto& proto() const {
+    return proto_;
+  }
+  /**
+   * @return encoding of the values kept as delta bases, i.e., the wire
+   * encoding for XOR deltas and fp32 otherwise
+   */
+  ParamProto::WireEncoding delta_encoding() const {
+    return proto_.response_codec()==ParamProto::kLinear8BitDelta?
+      ParamProto::kFP32:proto_.wire_encoding();
+  }
+  /**
+   * @return id of the delta base of the slice held by the worker, sent with
+   * requests as the base_version; -1 if none
+   */
+  int delta_version(int slice) const {
+    return delta_versions_.empty()?-1:delta_versions_[slice];
+  }
  protected:
+  /**
+   * Add the content of the blob as a frame in the wire encoding of this Param.
+   *
+   * For fp32, the frame is zero-copy, i.e., the blob memory is pinned until
+   * the frame is sent, writing to the blob before that allocates new memory
+   * (copy-on-write). Other encodings are converted into wire_buf_.
+   *
+   * @param slice only the values of this slice are added
+   */
+  void AddBlobFrame(Msg* msg, Blob<float>* blob, int slice=0);
+  /**
+   * Read the current frame of the msg into the blob.
+   *
+   * @param adopt if true, the blob takes over the frame memory instead of
+   * copying it when the memory is properly aligned and encoded in fp32, and
+   * the frame has the values of all slices.
+   * @param slice the frame has the values of this slice
+   */
+  void ReadBlobFrame(Msg* msg, Blob<float>* blob, bool adopt, int slice=0);
+  /**
+   * Add the values (at the server) for a response.
+   *
+   * Without base, or if the base is not acknowledged by the receiver, the
+   * full values are sent; otherwise a frame with the id of the base and a
+   * frame with the delta are sent according to response_codec. In both
+   * cases the base is replaced by the values the receiver reconstructs,
+   * whose new id is set as the msg base_version.
+   */
+  void AddValueFrames(Msg* msg, DeltaBase* base);
+  /**
+   * Apply the delta frames to the delta base of the slice (at the worker)
+   * and copy the result into data_; deltas against a base other than the
+   * one held are dropped with a warning.
+   *
+   * @return false if the delta is dropped
+   */
+  bool ReadDeltaFrames(Msg* msg, int slice);
+  /**
+   * Keep the values of the slice in data_ as the delta base with the id.
+   */
+  void KeepDeltaBase(int slice, int version);
+  /**
+   * Add the largest gradient entries (plus the residual of previous steps) as
+   * an index frame and a value frame according to update_codec; the rest is
+   * kept in residual_. Indices are relative to the slice.
+   */
+  void AddSparseGradFrames(Msg* msg, int slice);
+  /**
+   * Scatter the sparse gradient frames into grad_, other entries are 0.
+   */
+  void ReadSparseGradFrames(Msg* msg);
+  /**
+   * Add the gradient (plus the residual of previous steps) quantized by
+   * update_codec; the quantization error is kept in residual_.
+   */
+  void AddQuantizedGradFrames(Msg* msg, int slice);
+  void ReadQuantizedGradFrames(Msg* msg);
+  /**
+   * Add grad_ into residual_ for the values of the slice.
+   * @return residual_ content of the slice
+   */
+  float* AccumulateResidual(int slice);
+  /**
+   * @return num of columns for kSign1Bit scales, i.e., the last dim
+   */
+  int QuantizeColumns() const;
+  /**
+   * Add the (rows, columns) of the size values as a frame, from which the
+   * server gets QuantizeColumns() of the worker.
+   */
+  void AddShapeFrame(Msg* msg, int size);
+  /**
+   * Reshape the blobs by the shape frame of size values.
+   */
+  void ReadShapeFrame(Msg* msg, int size);
+  /**
+   * Fail if the msg encoding differs from the wire encoding of this Param.
+   */
+  void CheckEncoding(Msg* msg);
+
   /**
    * name of the parameter used to share wights between neuralnets
    */
@@ -131,40 +334,89 @@ class Param {
 
   ParamProto proto_;
   int fan_in_;
+  //!< buffer for encoding payloads, shared with in-flight messages
+  shared_ptr<void> wire_buf_;
+  size_t wire_bytes_;
+  //!< gradient not sent yet by sparse or quantized update codecs
+  Blob<float> residual_;
+  //!< buffers reused by update codecs
+  std::vector<int> sparse_idx_;
+  std::vector<float> sparse_val_, sparse_buf_;
+  //!< offsets of the slices and the size, empty if not sliced
+  std::vector<int> slice_offsets_;
+  //!< latest version of each slice from responses or pushes, and whether
+  //!< the slice has arrived since the version of the param was last set to
+  //!< the min of them
+  std::vector<int> slice_versions_;
+  std::vector<bool> slice_received_;
+  //!< num of distinct slices received, i.e., true in slice_received_
+  int nslices_received_;
+  //!< replaced as a whole by TakeSnapshot(), accessed via atomic_load/store
+  shared_ptr<const ParamSnapshots> snapshots_;
+  //!< delta bases of all slices at the worker and their ids
+  std::vector<char> delta_base_;
+  std::vector<int> delta_versions_;
+  //!< buffers reused for delta encoding and decoding
+  std::vector<char> delta_buf_, delta_scratch_;
+  std::vector<float> delta_diff_;
 };
+//!< num of consecutive values (one cache line) sampled by RandomSyncParam
+const int kSyncBlock=16;
 /**
  * Sync with server by randomly sampling some parameters for every sync.
+ *
+ * Blocks of kSyncBlock values are sampled with a fixed stride from a random
+ * start, hence only (start, stride, num of blocks) are sent instead of the
+ * indices, and the sampled values are visited sequentially. The worker sends
+ * the changes of the sampled values since the last sync; the server adds
+ * them to its values and responds with its values before adding, from which
+ * the worker gets the new server values.
+ */
 class RandomSyncParam: public Param{
  public:
-  virtual zmsg_t* HandleSyncMsg(zmsg_t** msg);
-  virtual zmsg_t *GenSyncMsgFromWorker(float sample_ratio);
-  virtual void ParseSyncMsgFromPS(zmsg_t** msg);
-  virtual void Setup(const ParamProto& proto, const vector<int>& shape, int fan_in);
-  virtual void Init();
+  RandomSyncParam();
+  virtual void Setup(const ParamProto& proto, const std::vector<int>& shape,
+      int fan_in);
+  virtual void Init(int v=0);
+  /**
+   * @param arg unused
+   */
+  virtual Msg* GenSyncMsg(void* arg=nullptr);
+  virtual Msg* HandleSyncMsg(Msg** msg);
+  virtual int ParseSyncResponseMsg(Msg** msg);
+  virtual int ParseGetResponseMsg(Msg** msg);
 
-  float* mutable_cpu_snapshot(){
-    return snapshot_.mutable_cpu_data();
-  }
   const float* cpu_snapshot(){
     return snapshot_.cpu_data();
   }
 
  protected:
-  const vector<int> RandomSample(int seed, int m, int n);
-
-
+  //!< data at the last sync, only the sampled values are updated per sync
   Blob<float> snapshot_;
+  std::mt19937 gen_;
 };
- */
 /**
  * Sync with server by elastic SGD see http://arxiv.org/abs/1412.6651.
+ *
+ * Workers update the params locally and send them to servers periodically.
+ * The server moves the center param by the elastic difference
+ * alpha*(worker-center) and responds with it, which is then subtracted from
+ * the worker param.
+ */
 class ElasticParam: public Param{
  public:
-  virtual zmsg_t* HandleSyncMsg(zmsg_t** msg);
-  virtual zmsg_t *GenSyncMsgFromWorker(float moving_rate);
-  virtual void ParseSyncMsgFromPS(zmsg_t** msg);
+  /**
+   * The param is synced as a whole, i.e., it is not sliced.
+   */
+  virtual void Setup(const ParamProto& proto, const std::vector<int>& shape,
+      int fan_in);
+  /**
+   * @param arg pointer to the moving rate alpha (float)
+   */
+  virtual Msg* GenSyncMsg(void* arg=nullptr);
+  virtual Msg* HandleSyncMsg(Msg** msg);
+  virtual int ParseSyncResponseMsg(Msg** msg);
 };
- */
 
 
 }  // namespace singa
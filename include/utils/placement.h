@@ -0,0 +1,74 @@
+#ifndef INCLUDE_UTILS_PLACEMENT_H_
+#define INCLUDE_UTILS_PLACEMENT_H_
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "utils/param.h"
+
+namespace singa {
+/**
+ * Load of a param (slice) on its server per training step of one worker
+ * group.
+ */
+struct ParamLoad{
+  int id; //!< param id or slice, see SliceTarget()
+  double bytes; //!< bytes of the Get response and the Update request
+  double flops; //!< floating point operations of the Updater
+};
+
+/**
+ * Placement of params onto the servers of a group.
+ *
+ * Params are assigned by greedy bin-packing (longest processing time first),
+ * which balances both the bytes and the flops of servers. The placement is
+ * computed from the same NeuralNet config in every procs, hence all workers
+ * share it without communication. Params moved at runtime by the servers
+ * (see ClusterProto rebalance_interval) are updated through Move(), which
+ * may be called concurrently with Server().
+ */
+class ParamPlacement{
+ public:
+  /**
+   * @return load of the slice of the param, 0 for params whose updates are
+   * sent by their owners
+   */
+  static ParamLoad Load(shared_ptr<Param> param, int slice=0);
+  /**
+   * Assign params to nservers servers.
+   *
+   * Params are visited in descending order of their loads (normalized by
+   * the total bytes and flops), and each is assigned to the server whose max
+   * normalized load after the assignment is the smallest.
+   */
+  void Setup(std::vector<ParamLoad> loads, int nservers);
+  /**
+   * @param target param id or slice of a param, see SliceTarget()
+   * @return server id (in a group) of the param; params not placed by
+   * Setup() are assigned by id modulo num of servers, and their k-th slices
+   * go to the k-th next server
+   */
+  int Server(int target, int nservers, int server_group=0) const;
+  /**
+   * Route requests of the param (slice) from workers of the server group to
+   * the given server.
+   */
+  void Move(int server_group, int target, int server);
+  /**
+   * @return bytes and flops per step of every server
+   */
+  std::string ToString() const;
+
+ protected:
+  std::map<int, int> id2server_;
+  std::vector<double> bytes_, flops_;
+  //!< servers of moved params, per (server group, target)
+  std::map<std::pair<int, int>, int> moved_;
+  mutable std::mutex moved_mutex_;
+  //!< size of moved_, read without the lock as most params never move
+  std::atomic<int> nmoved_{0};
+};
+}  // namespace singa
+#endif  // INCLUDE_UTILS_PLACEMENT_H_
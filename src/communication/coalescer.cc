@@ -0,0 +1,116 @@
+#include <glog/logging.h>
+#include "communication/coalescer.h"
+#include "proto/model.pb.h"
+
+namespace singa {
+static CoalescerStats stats_;
+
+Coalescer::Coalescer(int procs_id, size_t max_bytes, int delay):
+  procs_id_(procs_id), max_bytes_(max_bytes), delay_(delay), npending_(0){
+}
+
+Coalescer::~Coalescer(){
+  for(auto& entry: pending_)
+    for(Msg* msg: entry.second.msgs)
+      delete msg;
+}
+
+void Coalescer::Add(int procs_id, Msg* msg, Outbox* ready){
+  Pending* pending=&pending_[procs_id];
+  size_t nbytes=msg->ByteSize();
+  if(nbytes>=max_bytes_){
+    // large messages are not copied into envelopes
+    if(pending->msgs.size())
+      Flush(procs_id, pending, ready);
+    stats_.single_msgs++;
+    ready->push_back(std::make_pair(procs_id, msg));
+    return;
+  }
+  if(pending->msgs.empty()){
+    pending->bytes=0;
+    pending->deadline=Clock::now()+delay_;
+    npending_++;
+  }
+  pending->msgs.push_back(msg);
+  pending->bytes+=nbytes;
+  if(pending->bytes>=max_bytes_){
+    stats_.size_flushes++;
+    Flush(procs_id, pending, ready);
+  }
+}
+
+void Coalescer::FlushExpired(Outbox* ready){
+  if(npending_==0)
+    return;
+  auto now=Clock::now();
+  for(auto& entry: pending_){
+    if(entry.second.msgs.size()&&entry.second.deadline<=now){
+      stats_.deadline_flushes++;
+      Flush(entry.first, &entry.second, ready);
+    }
+  }
+}
+
+void Coalescer::FlushAll(Outbox* ready){
+  if(npending_==0)
+    return;
+  stats_.step_flushes++;
+  for(auto& entry: pending_)
+    if(entry.second.msgs.size())
+      Flush(entry.first, &entry.second, ready);
+}
+
+int Coalescer::Timeout() const{
+  if(npending_==0)
+    return -1;
+  auto deadline=Clock::time_point::max();
+  for(auto& entry: pending_)
+    if(entry.second.msgs.size())
+      deadline=std::min(deadline, entry.second.deadline);
+  auto wait=std::chrono::duration_cast<std::chrono::microseconds>(
+      deadline-Clock::now()).count();
+  return wait<=0?0:static_cast<int>(wait);
+}
+
+void Coalescer::Flush(int procs_id, Pending* pending, Outbox* ready){
+  npending_--;
+  if(pending->msgs.size()==1){
+    stats_.single_msgs++;
+    ready->push_back(std::make_pair(procs_id, pending->msgs[0]));
+    pending->msgs.clear();
+    return;
+  }
+  Msg* batch=new Msg();
+  batch->set_src(procs_id_, kStub);
+  batch->set_dst(procs_id, kStub);
+  batch->set_type(kBatch);
+  batch->set_size(pending->msgs.size());
+  for(Msg* msg: pending->msgs){
+    buf_.resize(msg->ByteSize());
+    msg->SerializeTo(buf_.data());
+    batch->add_frame(buf_.data(), buf_.size());
+    delete msg;
+  }
+  stats_.batches++;
+  stats_.batched_msgs+=pending->msgs.size();
+  pending->msgs.clear();
+  ready->push_back(std::make_pair(procs_id, batch));
+}
+
+void Coalescer::Split(Msg* batch, std::vector<Msg*>* msgs){
+  CHECK_EQ(batch->type(), kBatch);
+  for(int i=0;i<batch->size();i++){
+    if(i>0)
+      CHECK(batch->next_frame());
+    Msg* msg=new Msg();
+    msg->ParseFromBytes(static_cast<char*>(batch->frame_data()),
+        batch->frame_size());
+    msgs->push_back(msg);
+  }
+  delete batch;
+}
+
+const CoalescerStats& Coalescer::stats(){
+  return stats_;
+}
+}  // namespace singa
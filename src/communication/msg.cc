@@ -1,5 +1,400 @@
+#include <algorithm>
+#include <vector>
 #include "communication/msg.h"
+#include "communication/msg_stats.h"
 
 namespace singa {
-} /* singa */
+bool Msg::text_header_=false;
+
+/*************************Thread-local object pools***************************/
+static MsgPoolStats pool_stats_;
+
+/**
+ * Per-thread caches of Msg memory, empty zmsg and empty (placeholder) frames.
+ * The vectors are reserved up-front, hence recycling never allocates.
+ */
+struct MsgPool{
+  MsgPool(){
+    msgs.reserve(kMsgPoolSize);
+    zmsgs.reserve(kMsgPoolSize);
+    frames.reserve(kMsgPoolSize);
+  }
+  ~MsgPool();
+  std::vector<void*> msgs;
+  std::vector<zmsg_t*> zmsgs;
+  std::vector<zframe_t*> frames;
+};
+
+static thread_local bool pool_destroyed=false;
+
+/**
+ * @return the pool of the calling thread, nullptr during thread exit
+ */
+static MsgPool* LocalPool(){
+  if(pool_destroyed)
+    return nullptr;
+  static thread_local MsgPool pool;
+  return &pool;
+}
+
+MsgPool::~MsgPool(){
+  pool_destroyed=true;
+  for(void* ptr: msgs)
+    ::operator delete(ptr);
+  for(zmsg_t* zmsg: zmsgs)
+    zmsg_destroy(&zmsg);
+  for(zframe_t* frame: frames)
+    zframe_destroy(&frame);
+}
+
+static zframe_t* NewEmptyFrame(){
+  MsgPool* pool=LocalPool();
+  if(pool!=nullptr&&!pool->frames.empty()){
+    zframe_t* frame=pool->frames.back();
+    pool->frames.pop_back();
+    pool_stats_.frame_reuses++;
+    return frame;
+  }
+  pool_stats_.frame_allocs++;
+  return zframe_new_empty();
+}
+
+static void RecycleEmptyFrame(zframe_t* frame){
+  MsgPool* pool=LocalPool();
+  if(pool!=nullptr&&pool->frames.size()<kMsgPoolSize)
+    pool->frames.push_back(frame);
+  else
+    zframe_destroy(&frame);
+}
+
+void* Msg::operator new(size_t size){
+  MsgPool* pool=LocalPool();
+  if(size==sizeof(Msg)&&pool!=nullptr&&!pool->msgs.empty()){
+    void* ptr=pool->msgs.back();
+    pool->msgs.pop_back();
+    pool_stats_.msg_reuses++;
+    return ptr;
+  }
+  pool_stats_.msg_allocs++;
+  return ::operator new(size);
+}
+
+void Msg::operator delete(void* ptr, size_t size){
+  MsgPool* pool=LocalPool();
+  if(size==sizeof(Msg)&&pool!=nullptr&&pool->msgs.size()<kMsgPoolSize)
+    pool->msgs.push_back(ptr);
+  else
+    ::operator delete(ptr);
+}
+
+const MsgPoolStats& Msg::pool_stats(){
+  return pool_stats_;
+}
+
+zmsg_t* Msg::zmsg(){
+  if(msg_==NULL){
+    MsgPool* pool=LocalPool();
+    if(pool!=nullptr&&!pool->zmsgs.empty()){
+      msg_=pool->zmsgs.back();
+      pool->zmsgs.pop_back();
+      pool_stats_.zmsg_reuses++;
+    }else{
+      msg_=zmsg_new();
+      pool_stats_.zmsg_allocs++;
+    }
+  }
+  return msg_;
+}
+
+void Msg::ClearZmsg(){
+  if(msg_==NULL)
+    return;
+  while(zmsg_size(msg_)>0){
+    zframe_t* frame=zmsg_pop(msg_);
+    if(FindZeroCopyFrame(frame)!=nullptr)
+      RecycleEmptyFrame(frame);
+    else
+      zframe_destroy(&frame);
+  }
+  for(int i=0;i<nzcframes_;i++)
+    zcframes_[i].holder.reset();
+  nzcframes_=0;
+  frame_=NULL;
+  MsgPool* pool=LocalPool();
+  if(pool!=nullptr&&pool->zmsgs.size()<kMsgPoolSize)
+    pool->zmsgs.push_back(msg_);
+  else
+    zmsg_destroy(&msg_);
+  msg_=NULL;
+}
+
+Msg::~Msg(){
+  ClearZmsg();
+}
 
+void Msg::EraseZeroCopyFrame(int i){
+  CHECK_LT(i, nzcframes_);
+  for(;i<nzcframes_-1;i++)
+    zcframes_[i]=zcframes_[i+1];
+  nzcframes_--;
+  zcframes_[nzcframes_].holder.reset();
+}
+
+/*******************************Header**************************************/
+void Msg::ParseHeader(const void* data, size_t size){
+  const MsgHeader* h=static_cast<const MsgHeader*>(data);
+  if(size==sizeof(MsgHeader)&&h->magic==kMsgMagic){
+    CHECK_EQ(h->layout, kMsgLayout)<<"Incompatible message header layout";
+    src_=h->src;
+    dst_=h->dst;
+    target_=h->target;
+    version_=h->version;
+    size_=h->size;
+    encoding_=h->encoding;
+    codec_=h->codec;
+    base_version_=h->base_version;
+    timestamp_=h->timestamp;
+  }else{
+    // text header from procs running with text_header enabled
+    char buf[96];
+    size_t len=std::min(size, sizeof(buf)-1);
+    memcpy(buf, data, len);
+    buf[len]='\0';
+    version_=size_=encoding_=codec_=0;
+    base_version_=-1;
+    timestamp_=0;
+    CHECK_GE(sscanf(buf, "%u %u %u %d %d %d %d %d", &src_, &dst_, &target_,
+          &version_, &size_, &encoding_, &codec_, &base_version_), 3)
+      <<"Unknown message header";
+  }
+}
+
+void Msg::FillHeader(MsgHeader* h) const{
+  h->magic=kMsgMagic;
+  h->layout=kMsgLayout;
+  h->encoding=encoding_;
+  h->codec=codec_;
+  memset(h->reserved, 0, sizeof(h->reserved));
+  h->src=src_;
+  h->dst=dst_;
+  h->target=target_;
+  h->version=version_;
+  h->size=size_;
+  h->base_version=base_version_;
+  h->timestamp=NowMicros();
+}
+
+void Msg::PushHeader(){
+  if(text_header_){
+    zmsg_pushstrf(zmsg(), "%u %u %u %d %d %d %d %d",src_, dst_,target_,
+        version_, size_, encoding_, codec_, base_version_);
+  }else{
+    MsgHeader h;
+    FillHeader(&h);
+    zmsg_pushmem(zmsg(), &h, sizeof(h));
+  }
+}
+
+void Msg::ParseFromZmsg(zmsg_t* msg){
+  ClearZmsg();
+  zframe_t* header=zmsg_pop(msg);
+  CHECK_NOTNULL(header);
+  ParseHeader(zframe_data(header), zframe_size(header));
+  zframe_destroy(&header);
+  frame_=zmsg_first(msg);
+  msg_=msg;
+}
+
+zmsg_t* Msg::DumpToZmsg(){
+  if(nzcframes_>0){
+    zmsg_t* copy=zmsg_new();
+    for(zframe_t* frame=zmsg_first(msg_);frame!=NULL;frame=zmsg_next(msg_)){
+      const ZeroCopyFrame* zc=FindZeroCopyFrame(frame);
+      if(zc!=nullptr)
+        zmsg_addmem(copy, zc->data, zc->size);
+      else
+        zmsg_addmem(copy, zframe_data(frame), zframe_size(frame));
+    }
+    ClearZmsg();
+    msg_=copy;
+  }
+  PushHeader();
+  zmsg_t* tmp=msg_;
+  msg_=NULL;
+  frame_=NULL;
+  return tmp;
+}
+
+/******************************Zero-copy frames*******************************/
+void Msg::add_frame(const void* addr, int nBytes, shared_ptr<void> holder){
+  if(nzcframes_==kMaxZeroCopyFrames){
+    // fall back to copying
+    add_frame(addr, nBytes);
+    return;
+  }
+  zframe_t* frame=NewEmptyFrame();
+  zcframes_[nzcframes_++]=ZeroCopyFrame{frame, const_cast<void*>(addr),
+    static_cast<size_t>(nBytes), holder};
+  zmsg_append(zmsg(), &frame);
+}
+
+shared_ptr<void> Msg::release_frame(){
+  CHECK_NOTNULL(frame_);
+  zframe_t* frame=frame_;
+  frame_=NULL;
+  zmsg_remove(msg_, frame);
+  for(int i=0;i<nzcframes_;i++){
+    if(zcframes_[i].placeholder==frame){
+      shared_ptr<void> handle(zcframes_[i].holder, zcframes_[i].data);
+      EraseZeroCopyFrame(i);
+      RecycleEmptyFrame(frame);
+      return handle;
+    }
+  }
+  return shared_ptr<void>(zframe_data(frame), [frame](void*){
+      zframe_t* tmp=frame;
+      zframe_destroy(&tmp);
+  });
+}
+
+/*****************************ZeroMQ send/receive****************************/
+/**
+ * Called by ZeroMQ once a zero-copy frame has been sent.
+ */
+static void FreeHolder(void* data, void* hint){
+  delete static_cast<shared_ptr<void>*>(hint);
+}
+
+int Msg::SendTo(zsock_t* sock, zframe_t* route){
+  void* handle=zsock_resolve(sock);
+  bool ok=true;
+  if(route!=nullptr)
+    ok=zmq_send(handle, zframe_data(route), zframe_size(route),
+        ZMQ_SNDMORE)>=0;
+  // the header is small enough to be stored inside zmq_msg_t, hence sending
+  // it from the stack does not allocate
+  int flag=msg_!=NULL&&zmsg_size(msg_)>0?ZMQ_SNDMORE:0;
+  if(ok&&text_header_){
+    char buf[96];
+    int len=snprintf(buf, sizeof(buf), "%u %u %u %d %d %d %d %d", src_,
+        dst_, target_, version_, size_, encoding_, codec_, base_version_);
+    ok=zmq_send(handle, buf, len, flag)>=0;
+  }else if(ok){
+    MsgHeader h;
+    FillHeader(&h);
+    ok=zmq_send(handle, &h, sizeof(h), flag)>=0;
+  }
+  while(ok&&msg_!=NULL&&zmsg_size(msg_)>0){
+    zframe_t* frame=zmsg_pop(msg_);
+    bool more=zmsg_size(msg_)>0;
+    const ZeroCopyFrame* zc=FindZeroCopyFrame(frame);
+    if(zc==nullptr){
+      ok=zframe_send(&frame, sock, more?ZFRAME_MORE:0)==0;
+    }else{
+      zmq_msg_t part;
+      auto* holder=new shared_ptr<void>(zc->holder);
+      zmq_msg_init_data(&part, zc->data, zc->size, FreeHolder, holder);
+      if(zmq_msg_send(&part, handle, more?ZMQ_SNDMORE:0)<0){
+        zmq_msg_close(&part);
+        ok=false;
+      }
+      EraseZeroCopyFrame(zc-zcframes_);
+      RecycleEmptyFrame(frame);
+    }
+  }
+  ClearZmsg();
+  return ok;
+}
+
+int Msg::ReceiveFrom(zsock_t* sock, string* route){
+  ClearZmsg();
+  void* handle=zsock_resolve(sock);
+  zmq_msg_t part;
+  zmq_msg_init(&part);
+  if(route!=nullptr){
+    if(zmq_msg_recv(&part, handle, 0)<0){
+      zmq_msg_close(&part);
+      return 0;
+    }
+    route->assign(static_cast<char*>(zmq_msg_data(&part)),
+        zmq_msg_size(&part));
+  }
+  if(zmq_msg_recv(&part, handle, 0)<0){
+    zmq_msg_close(&part);
+    return 0;
+  }
+  ParseHeader(zmq_msg_data(&part), zmq_msg_size(&part));
+  bool more=zmq_msg_more(&part);
+  zmq_msg_close(&part);
+  while(more){
+    zframe_t* frame=zframe_recv(sock);
+    if(frame==NULL)
+      return 0;
+    more=zframe_more(frame);
+    zmsg_append(zmsg(), &frame);
+  }
+  frame_=msg_==NULL?NULL:zmsg_first(msg_);
+  return 1;
+}
+
+/*****************************Byte serialization*****************************/
+/*
+ * Serialized format: MsgHeader, num of frames (uint32_t), then for each frame
+ * its size (uint32_t) followed by its bytes.
+ */
+size_t Msg::ByteSize(){
+  size_t nbytes=sizeof(MsgHeader)+sizeof(uint32_t);
+  if(msg_==NULL)
+    return nbytes;
+  for(zframe_t* frame=zmsg_first(msg_);frame!=NULL;frame=zmsg_next(msg_)){
+    const ZeroCopyFrame* zc=FindZeroCopyFrame(frame);
+    nbytes+=sizeof(uint32_t)+(zc==nullptr?zframe_size(frame):zc->size);
+  }
+  return nbytes;
+}
+
+void Msg::SerializeTo(char* buf){
+  FillHeader(reinterpret_cast<MsgHeader*>(buf));
+  buf+=sizeof(MsgHeader);
+  uint32_t nframes=msg_==NULL?0:zmsg_size(msg_);
+  memcpy(buf, &nframes, sizeof(uint32_t));
+  buf+=sizeof(uint32_t);
+  if(msg_==NULL)
+    return;
+  for(zframe_t* frame=zmsg_first(msg_);frame!=NULL;frame=zmsg_next(msg_)){
+    const void* data=zframe_data(frame);
+    uint32_t size=zframe_size(frame);
+    const ZeroCopyFrame* zc=FindZeroCopyFrame(frame);
+    if(zc!=nullptr){
+      data=zc->data;
+      size=zc->size;
+    }
+    memcpy(buf, &size, sizeof(uint32_t));
+    buf+=sizeof(uint32_t);
+    memcpy(buf, data, size);
+    buf+=size;
+  }
+}
+
+void Msg::ParseFromBytes(const char* buf, size_t len){
+  CHECK_GE(len, sizeof(MsgHeader)+sizeof(uint32_t));
+  const char* end=buf+len;
+  const MsgHeader* h=reinterpret_cast<const MsgHeader*>(buf);
+  CHECK_EQ(h->magic, kMsgMagic);
+  ParseHeader(buf, sizeof(MsgHeader));
+  buf+=sizeof(MsgHeader);
+  uint32_t nframes;
+  memcpy(&nframes, buf, sizeof(uint32_t));
+  buf+=sizeof(uint32_t);
+  ClearZmsg();
+  for(uint32_t i=0;i<nframes;i++){
+    uint32_t size;
+    memcpy(&size, buf, sizeof(uint32_t));
+    buf+=sizeof(uint32_t);
+    CHECK_LE(buf+size, end);
+    zmsg_addmem(zmsg(), buf, size);
+    buf+=size;
+  }
+  frame_=msg_==NULL?NULL:zmsg_first(msg_);
+}
+} /* singa */
@@ -0,0 +1,76 @@
+#include <mutex>
+#include <vector>
+#include "communication/msg_stats.h"
+#include "proto/model.pb.h"
+
+namespace singa {
+/**
+ * Histograms of one thread.
+ */
+struct ThreadMsgStats{
+  Histogram hist[kNumMsgMetrics][kMaxStatsMsgTypes][kNumStatsDsts];
+};
+
+static std::mutex stats_mutex;
+/**
+ * Histograms of all threads; they are never freed as Dump() may read them
+ * after the threads exit.
+ */
+static std::vector<ThreadMsgStats*> all_stats;
+//!< merged histograms at the last Dump()
+static HistogramData last_dump[kNumMsgMetrics][kMaxStatsMsgTypes]
+  [kNumStatsDsts];
+
+static ThreadMsgStats* LocalStats(){
+  static thread_local ThreadMsgStats* stats=nullptr;
+  if(stats==nullptr){
+    stats=new ThreadMsgStats();
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    all_stats.push_back(stats);
+  }
+  return stats;
+}
+
+void MsgStats::Record(MsgMetric metric, int type, int dst_flag,
+    uint64_t value){
+  if(type<0||type>=kMaxStatsMsgTypes)
+    return;
+  LocalStats()->hist[metric][type][dst_flag%kNumStatsDsts].Add(value);
+}
+
+static const char* MetricName(int metric){
+  switch(metric){
+    case kRouterQueue: return "router queue (us)";
+    case kDealerQueue: return "dealer queue (us)";
+    case kServiceTime: return "service time (us)";
+    case kStaleness: return "staleness";
+    default: return "bytes";
+  }
+}
+
+std::string MsgStats::Dump(){
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  std::string ret;
+  for(int m=0;m<kNumMsgMetrics;m++){
+    for(int t=0;t<kMaxStatsMsgTypes;t++){
+      for(int d=0;d<kNumStatsDsts;d++){
+        HistogramData data;
+        for(auto* stats: all_stats)
+          data.Merge(stats->hist[m][t][d]);
+        HistogramData delta=data;
+        delta.Subtract(last_dump[m][t][d]);
+        last_dump[m][t][d]=data;
+        if(delta.count()==0)
+          continue;
+        std::string type=MsgType_IsValid(t)?MsgType_Name(
+            static_cast<MsgType>(t)):std::to_string(t);
+        std::string dst=EntityType_IsValid(d)?EntityType_Name(
+            static_cast<EntityType>(d)):std::to_string(d);
+        ret+="\t"+std::string(MetricName(m))+" "+type+" to "+dst+": "
+          +delta.ToString()+"\n";
+      }
+    }
+  }
+  return ret;
+}
+}  // namespace singa
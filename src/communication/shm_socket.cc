@@ -0,0 +1,321 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <glog/logging.h>
+#include "communication/shm_socket.h"
+
+namespace singa {
+const uint32_t kShmMagic=0x53484D52;
+//!< records start at multiples of kShmAlign bytes
+const size_t kShmAlign=16;
+//!< bytes reserved for the ShmRingHeader, the data area starts after it
+const size_t kShmHeaderBytes=4096;
+//!< yields of a sender on a full ring between two checks of the receiver
+const int kShmLivenessWaits=1024;
+
+inline size_t ShmAlign(size_t nbytes){
+  return (nbytes+kShmAlign-1)/kShmAlign*kShmAlign;
+}
+
+static int Futex(std::atomic<uint32_t>* addr, int op, uint32_t val,
+    const struct timespec* timeout){
+  // not FUTEX_PRIVATE_FLAG, the word is shared by processes
+  return syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), op, val,
+      timeout, nullptr, 0);
+}
+
+/**
+ * @return the start time (field 22 of /proc/<pid>/stat) of the process, 0 if
+ * it does not exist
+ */
+static uint64_t StartTime(pid_t pid){
+  std::ifstream in("/proc/"+std::to_string(pid)+"/stat");
+  std::string stat;
+  std::getline(in, stat);
+  // the command (field 2) may contain spaces, fields after it are numbers
+  size_t end=stat.rfind(')');
+  if(end==std::string::npos)
+    return 0;
+  std::istringstream fields(stat.substr(end+1));
+  std::string field;
+  for(int i=3;i<22;i++)
+    fields>>field;
+  uint64_t start=0;
+  fields>>start;
+  return start;
+}
+
+static void RingBell(ShmRingHeader* ring){
+  ring->doorbell.fetch_add(1, std::memory_order_release);
+  if(ring->waiters.load()>0)
+    Futex(&ring->doorbell, FUTEX_WAKE, INT_MAX, nullptr);
+}
+
+/**
+ * @return the header of the ring mapped for ringing its doorbell, nullptr if
+ * the ring does not exist
+ */
+static ShmRingHeader* MapHeader(const std::string& name){
+  int fd=open(("/dev/shm/"+name).c_str(), O_RDWR);
+  if(fd<0)
+    return nullptr;
+  void* addr=mmap(nullptr, kShmHeaderBytes, PROT_READ|PROT_WRITE, MAP_SHARED,
+      fd, 0);
+  close(fd);
+  return addr==MAP_FAILED?nullptr:static_cast<ShmRingHeader*>(addr);
+}
+
+std::string ShmSocket::RingName(int port, int procs_id){
+  return "singa-"+std::to_string(port)+"-"+std::to_string(procs_id);
+}
+
+ShmSocket::ShmSocket(const std::string& name, bool create, size_t capacity,
+    int timeout): name_(name), path_("/dev/shm/"+name), owner_(create),
+  fd_(-1), ring_(nullptr), data_(nullptr), bell_(nullptr){
+  static_assert(sizeof(ShmRingHeader)<=kShmHeaderBytes,
+      "ShmRingHeader is too large");
+  static_assert(sizeof(ShmRecord)==kShmAlign, "ShmRecord must be aligned");
+  if(create){
+    capacity=capacity/kShmAlign*kShmAlign;
+    CHECK_GT(capacity, 0);
+    // remove the ring left by a crashed run
+    unlink(path_.c_str());
+    fd_=open(path_.c_str(), O_CREAT|O_EXCL|O_RDWR, 0600);
+    CHECK_GE(fd_, 0)<<"Cannot create shared memory ring "<<path_;
+    mapsize_=kShmHeaderBytes+capacity;
+    CHECK_EQ(ftruncate(fd_, mapsize_), 0);
+    void* addr=mmap(nullptr, mapsize_, PROT_READ|PROT_WRITE, MAP_SHARED, fd_,0);
+    CHECK_NE(addr, MAP_FAILED);
+    ring_=new(addr) ShmRingHeader();
+    CHECK(ring_->head.is_lock_free());
+    ring_->magic=kShmMagic;
+    ring_->capacity=capacity;
+    ring_->creator=getpid();
+    ring_->epoch=StartTime(getpid());
+    ring_->head.store(0);
+    ring_->tail.store(0);
+    ring_->doorbell.store(0);
+    ring_->waiters.store(0);
+    ring_->bell_linked.store(0);
+    ring_->ready.store(1, std::memory_order_release);
+  }else{
+    // the receiver may not have created the ring yet
+    auto start=std::chrono::steady_clock::now();
+    while(true){
+      fd_=open(path_.c_str(), O_RDWR);
+      if(fd_>=0){
+        struct stat st;
+        CHECK_EQ(fstat(fd_, &st), 0);
+        if(static_cast<size_t>(st.st_size)>kShmHeaderBytes){
+          mapsize_=st.st_size;
+          void* addr=mmap(nullptr, mapsize_, PROT_READ|PROT_WRITE, MAP_SHARED,
+              fd_, 0);
+          CHECK_NE(addr, MAP_FAILED);
+          ring_=static_cast<ShmRingHeader*>(addr);
+          // a ring left by an exited run is replaced when the receiver starts
+          if(ring_->ready.load(std::memory_order_acquire)
+              &&StartTime(ring_->creator)==ring_->epoch)
+            break;
+          munmap(addr, mapsize_);
+          ring_=nullptr;
+        }
+        close(fd_);
+        fd_=-1;
+      }
+      CHECK_LT(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now()-start).count(), timeout)
+        <<"Shared memory ring "<<path_<<" is not created";
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    CHECK_EQ(ring_->magic, kShmMagic);
+  }
+  data_=reinterpret_cast<char*>(ring_)+kShmHeaderBytes;
+}
+
+ShmSocket::~ShmSocket(){
+  if(bell_!=nullptr&&bell_!=ring_)
+    munmap(bell_, kShmHeaderBytes);
+  if(ring_!=nullptr)
+    munmap(ring_, mapsize_);
+  if(fd_>=0)
+    close(fd_);
+  Unlink();
+}
+
+void ShmSocket::Unlink(){
+  if(owner_)
+    unlink(path_.c_str());
+  owner_=false;
+}
+
+int ShmSocket::Send(Msg* msg){
+  const uint64_t capacity=ring_->capacity;
+  size_t len=msg->ByteSize();
+  size_t need=ShmAlign(sizeof(ShmRecord)+len);
+  CHECK_LE(need, capacity)<<"Message of "<<len<<" bytes exceeds the ring";
+  // reserve space, the record must be contiguous, hence the end of the ring
+  // is skipped if it is not large enough
+  uint64_t pos=ring_->head.load(std::memory_order_relaxed), skip=0;
+  int nwaits=0;
+  while(true){
+    uint64_t offset=pos%capacity;
+    skip=capacity-offset<need?capacity-offset:0;
+    if(pos+skip+need-ring_->tail.load(std::memory_order_acquire)>capacity){
+      // full, wait for the receiver to consume unless it has exited
+      if(++nwaits%kShmLivenessWaits==0&&!ReceiverAlive()){
+        LOG(ERROR)<<"Drop msg of "<<len<<" bytes, the receiver of the full "
+          <<"ring "<<path_<<" has exited";
+        delete msg;
+        return 0;
+      }
+      std::this_thread::yield();
+      pos=ring_->head.load(std::memory_order_relaxed);
+    }else if(ring_->head.compare_exchange_weak(pos, pos+skip+need)){
+      break;
+    }
+  }
+  if(skip>0){
+    ShmRecord* pad=reinterpret_cast<ShmRecord*>(data_+pos%capacity);
+    pad->len=skip;
+    pad->padding=1;
+    pad->seq.store(pos+1, std::memory_order_release);
+    pos+=skip;
+  }
+  ShmRecord* rec=reinterpret_cast<ShmRecord*>(data_+pos%capacity);
+  rec->len=len;
+  rec->padding=0;
+  msg->SerializeTo(reinterpret_cast<char*>(rec+1));
+  rec->seq.store(pos+1, std::memory_order_release);
+  delete msg;
+  Ring();
+  return 1;
+}
+
+void ShmSocket::Ring(){
+  RingBell(ring_);
+  // pairs with the fence of LinkDoorbell(): either the link is seen here, or
+  // the poller sees the committed record before sleeping
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(bell_==nullptr&&ring_->bell_linked.load(std::memory_order_acquire)){
+    bell_=MapHeader(ring_->bell_ring);
+    if(bell_==nullptr){
+      LOG(WARNING)<<"Cannot open the ring "<<ring_->bell_ring<<" linked to "
+        <<path_;
+      // not retried
+      bell_=ring_;
+    }
+  }
+  if(bell_!=nullptr&&bell_!=ring_)
+    RingBell(bell_);
+}
+
+void ShmSocket::LinkDoorbell(const ShmSocket& other){
+  CHECK_EQ(ring_->creator, getpid())<<"Ring "<<path_<<" is not created here";
+  CHECK_EQ(other.ring_->creator, getpid())<<"Ring "<<other.path_
+    <<" is not created here";
+  CHECK_LT(other.name_.size(), sizeof(ring_->bell_ring));
+  strncpy(ring_->bell_ring, other.name_.c_str(), sizeof(ring_->bell_ring));
+  ring_->bell_linked.store(1, std::memory_order_release);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+bool ShmSocket::ReceiverAlive() const{
+  return StartTime(ring_->creator)==ring_->epoch;
+}
+
+bool ShmSocket::Readable() const{
+  uint64_t pos=ring_->tail.load(std::memory_order_relaxed);
+  const ShmRecord* rec=
+    reinterpret_cast<const ShmRecord*>(data_+pos%ring_->capacity);
+  return rec->seq.load(std::memory_order_acquire)==pos+1;
+}
+
+bool ShmSocket::Wait(int timeout){
+  auto deadline=std::chrono::steady_clock::now()
+    +std::chrono::milliseconds(timeout);
+  while(true){
+    uint32_t bell=ring_->doorbell.load(std::memory_order_acquire);
+    if(Readable())
+      return true;
+    if(!Sleep(bell, timeout, deadline))
+      return false;
+  }
+}
+
+bool ShmSocket::Sleep(uint32_t bell, int timeout,
+    std::chrono::steady_clock::time_point deadline){
+  struct timespec ts, *pts=nullptr;
+  if(timeout>=0){
+    auto left=std::chrono::duration_cast<std::chrono::nanoseconds>(
+        deadline-std::chrono::steady_clock::now()).count();
+    if(left<=0)
+      return false;
+    ts.tv_sec=left/1000000000;
+    ts.tv_nsec=left%1000000000;
+    pts=&ts;
+  }
+  ring_->waiters.fetch_add(1);
+  // the doorbell changes if a message is committed after reading bell,
+  // then the futex returns immediately
+  Futex(&ring_->doorbell, FUTEX_WAIT, bell, pts);
+  ring_->waiters.fetch_sub(1);
+  return true;
+}
+
+Msg* ShmSocket::Receive(){
+  const uint64_t capacity=ring_->capacity;
+  while(true){
+    Wait(-1);
+    uint64_t pos=ring_->tail.load(std::memory_order_relaxed);
+    ShmRecord* rec=reinterpret_cast<ShmRecord*>(data_+pos%capacity);
+    Msg* msg=nullptr;
+    size_t len=rec->len;
+    if(!rec->padding){
+      msg=new Msg();
+      msg->ParseFromBytes(reinterpret_cast<char*>(rec+1), len);
+      len=ShmAlign(sizeof(ShmRecord)+len);
+    }
+    // clear the record before releasing it, otherwise payload bytes of this
+    // lap may be read as a committed seq of a later lap
+    memset(static_cast<void*>(rec), 0, len);
+    ring_->tail.store(pos+len, std::memory_order_release);
+    if(msg!=nullptr)
+      return msg;
+  }
+}
+
+void ShmPoller::Add(Socket* socket){
+  ShmSocket* shm=CHECK_NOTNULL(dynamic_cast<ShmSocket*>(socket));
+  // futex can wait on one word only
+  if(!sockets_.empty())
+    shm->LinkDoorbell(*sockets_[0]);
+  sockets_.push_back(shm);
+}
+
+Socket* ShmPoller::Wait(int timeout){
+  if(sockets_.size()==1)
+    return sockets_[0]->Wait(timeout)?sockets_[0]:nullptr;
+  ShmSocket* bell=sockets_[0];
+  auto deadline=std::chrono::steady_clock::now()
+    +std::chrono::milliseconds(timeout);
+  while(true){
+    uint32_t value=bell->ring_->doorbell.load(std::memory_order_acquire);
+    for(auto* socket: sockets_)
+      if(socket->Readable())
+        return socket;
+    if(!bell->Sleep(value, timeout, deadline))
+      return nullptr;
+  }
+}
+} /* singa */
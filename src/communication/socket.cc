@@ -1,4 +1,7 @@
+#include <chrono>
+#include <thread>
 #include "communication/socket.h"
+#include "communication/msg_stats.h"
 
 namespace singa {
 Poller::Poller(){
@@ -6,6 +9,15 @@ Poller::Poller(){
 }
 
 void Poller::Add(Socket* socket){
+  Dealer* dealer=dynamic_cast<Dealer*>(socket);
+  if(dealer!=nullptr){
+    // a dealer may have one socket per router
+    for(zsock_t* zsock: dealer->sockets()){
+      zpoller_add(poller_, zsock);
+      zsock2Socket_[zsock]=socket;
+    }
+    return;
+  }
   zsock_t* zsock=static_cast<zsock_t*>(socket->InternalID());
   zpoller_add(poller_, zsock);
   zsock2Socket_[zsock]=socket;
@@ -18,34 +30,85 @@ Socket* Poller::Wait(int timeout){
   else return nullptr;
 }
 
-Dealer::Dealer(int id):id_(id){
-  dealer_=zsock_new(ZMQ_DEALER);
-  CHECK_NOTNULL(dealer_);
-  poller_=zpoller_new(dealer_);
+Socket* Poller::WaitMicros(int64_t timeout){
+  if(timeout<0)
+    return Wait(-1);
+  auto deadline=std::chrono::steady_clock::now()
+    +std::chrono::microseconds(timeout);
+  while(true){
+    int64_t left=std::chrono::duration_cast<std::chrono::microseconds>(
+        deadline-std::chrono::steady_clock::now()).count();
+    // round down to not oversleep
+    Socket* sock=Wait(left>=1000?static_cast<int>(left/1000):0);
+    if(sock!=nullptr||left<=0||Terminated())
+      return sock;
+    if(left<1000)
+      std::this_thread::yield();
+  }
+}
+
+bool Poller::Terminated(){
+  return zpoller_terminated(poller_);
+}
+
+Dealer::Dealer(int id, int nrouters):id_(id){
+  CHECK_GE(nrouters, 1);
+  poller_=zpoller_new(NULL);
+  for(int i=0;i<nrouters;i++){
+    zsock_t* sock=zsock_new(ZMQ_DEALER);
+    CHECK_NOTNULL(sock);
+    zpoller_add(poller_, sock);
+    sockets_.push_back(sock);
+  }
+  dealer_=sockets_[0];
 }
 
 int Dealer::Connect(string endpoint){
   if(endpoint.length())
-    CHECK_EQ(zsock_connect(dealer_,endpoint.c_str()),0);
+    for(size_t i=0;i<sockets_.size();i++)
+      CHECK_EQ(zsock_connect(sockets_[i],
+            RouterEndpoint(endpoint, i).c_str()),0);
   return 1;
 }
 int Dealer::Send(Msg *msg){
-  zmsg_t* zmsg=(static_cast<Msg*>(msg))->DumpToZmsg();
-  zmsg_send(&zmsg, dealer_);
+  zsock_t* sock=dealer_;
+  if(sockets_.size()>1)
+    sock=sockets_[RouterPartition(msg->dst(), sockets_.size())];
+  MsgStats::Record(kMsgBytes, msg->type(), msg->dst_flag(), msg->ByteSize());
+  int ret=msg->SendTo(sock);
   delete msg;
-  return 1;
+  return ret;
+}
+
+int Dealer::Broadcast(Msg *msg){
+  int ret=1;
+  // the header is kept after sending, hence it can be sent again
+  for(zsock_t* sock: sockets_)
+    ret&=msg->SendTo(sock);
+  delete msg;
+  return ret;
 }
 
 Msg* Dealer::Receive(){
-  zmsg_t* zmsg=zmsg_recv(dealer_);
-  if(zmsg==NULL)
-    return nullptr;
+  zsock_t* sock=dealer_;
+  if(sockets_.size()>1){
+    sock=static_cast<zsock_t*>(zpoller_wait(poller_, -1));
+    if(sock==NULL)
+      return nullptr;
+  }
   Msg* msg=new Msg();
-  msg->ParseFromZmsg(zmsg);
+  if(!msg->ReceiveFrom(sock)){
+    delete msg;
+    return nullptr;
+  }
+  MsgStats::RecordDelay(kDealerQueue, msg->type(), msg->dst_flag(),
+      msg->timestamp());
   return msg;
 }
 Dealer::~Dealer(){
-  zsock_destroy(&dealer_);
+  zpoller_destroy(&poller_);
+  for(zsock_t* sock: sockets_)
+    zsock_destroy(&sock);
 }
 
 Router::Router(int bufsize){
@@ -62,47 +125,48 @@ int Router::Bind(string endpoint){
 }
 
 int Router::Send(Msg *msg){
-  zmsg_t* zmsg=static_cast<Msg*>(msg)->DumpToZmsg();
-  int dstid=static_cast<Msg*>(msg)->dst();
+  int dstid=msg->dst();
+  MsgStats::Record(kMsgBytes, msg->type(), msg->dst_flag(), msg->ByteSize());
   if(id2addr_.find(dstid)!=id2addr_.end()){
     // the connection has already been set up
-    zframe_t* addr=zframe_dup(id2addr_[dstid]);
-    zmsg_prepend(zmsg, &addr);
-    zmsg_send(&zmsg, router_);
+    int ret=msg->SendTo(router_, id2addr_[dstid]);
+    delete msg;
+    return ret;
   }else{
-    // the connection is not ready, buffer the message
-    if(bufmsg_.size()==0)
-      nBufmsg_=0;
-    bufmsg_[dstid].push_back(zmsg);
+    // the connection is not ready, buffer the message (and its zero-copy
+    // frames) until the dealer connects; the num of buffered messages is
+    // bounded by the flow control credits of workers
+    bufmsg_[dstid].push_back(msg);
     nBufmsg_++;
-    CHECK_LE(nBufmsg_, bufsize_);
+    if(nBufmsg_>bufsize_)
+      LOG_EVERY_N(WARNING, 1000)<<"Router buffers "<<nBufmsg_
+        <<" messages for dealers that have not connected";
   }
-  delete msg;
   return 1;
 }
 
 Msg* Router::Receive(){
-  zmsg_t* zmsg=zmsg_recv(router_);
-  if(zmsg==NULL)
-    return nullptr;
-  zframe_t* dealer=zmsg_pop(zmsg);
   Msg* msg=new Msg();
-  msg->ParseFromZmsg(zmsg);
+  if(!msg->ReceiveFrom(router_, &route_)){
+    delete msg;
+    return nullptr;
+  }
+  MsgStats::RecordDelay(kRouterQueue, msg->type(), msg->dst_flag(),
+      msg->timestamp());
   if (id2addr_.find(msg->src())==id2addr_.end()){
     // new connection, store the sender's identfier and send buffered messages
     // for it
+    zframe_t* dealer=zframe_new(route_.data(), route_.size());
     id2addr_[msg->src()]=dealer;
     if(bufmsg_.find(msg->src())!=bufmsg_.end()){
-      for(auto& it: bufmsg_.at(msg->src())){
-        zframe_t* addr=zframe_dup(dealer);
-        zmsg_prepend(it, &addr);
-        zmsg_send(&it, router_);
+      for(auto* bufmsg: bufmsg_.at(msg->src())){
+        bufmsg->SendTo(router_, dealer);
+        delete bufmsg;
+        nBufmsg_--;
       }
       bufmsg_.erase(msg->src());
     }
   }
-  else
-    zframe_destroy(&dealer);
   return msg;
 }
 
@@ -112,7 +176,7 @@ Router::~Router(){
     zframe_destroy(&it.second);
   for(auto it: bufmsg_){
     for(auto *msg: it.second)
-      zmsg_destroy(&msg);
+      delete msg;
   }
 }
 } /* singa */
@@ -16,6 +16,7 @@ void Layer::Init(const Layer& other, const vector<int>& shape){
   data_.Reshape(shape);
   grad_.Reshape(shape);
   layer_proto_=other.layer_proto_;
+  param_type_=other.param_type_;
 }
 void Layer::Setup(){
   Setup(layer_proto_, srclayers_);
@@ -45,9 +45,9 @@ void ConvolutionLayer::Setup(const LayerProto& proto,
   col_grad_.Reshape(vector<int>{col_height_, col_width_});
 
   Factory<Param>* factory=Singleton<Factory<Param>>::Instance();
-  weight_=shared_ptr<Param>(factory->Create("Param"));
+  weight_=shared_ptr<Param>(factory->Create(param_type_));
   weight_->Setup(proto.param(0), vector<int>{num_filters_, col_height_}, col_height_);
-  bias_=shared_ptr<Param>(factory->Create("Param"));
+  bias_=shared_ptr<Param>(factory->Create(param_type_));
   bias_->Setup(proto.param(1), vector<int>{num_filters_},0);
 }
 
@@ -173,8 +173,8 @@ void InnerProductLayer::Setup(const LayerProto& proto,
   data_.Reshape(vector<int>{batchsize_, hdim_});
   grad_.ReshapeLike(data_);
   Factory<Param>* factory=Singleton<Factory<Param>>::Instance();
-  weight_=shared_ptr<Param>(factory->Create("Param"));
-  bias_=shared_ptr<Param>(factory->Create("Param"));
+  weight_=shared_ptr<Param>(factory->Create(param_type_));
+  bias_=shared_ptr<Param>(factory->Create(param_type_));
   weight_->Setup(proto.param(0), vector<int>{vdim_, hdim_}, vdim_*hdim_);
   bias_->Setup(proto.param(1), vector<int>{hdim_},0);
 }
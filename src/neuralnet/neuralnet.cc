@@ -31,7 +31,8 @@ void NeuralNet::RegisterLayers(){
   factory->Register("kSplit", CreateLayer(SplitLayer));
   factory->Register("kTanh", CreateLayer(TanhLayer));
 }
-shared_ptr<NeuralNet> NeuralNet::SetupNeuralNet(const NetProto& np, Phase phase){
+shared_ptr<NeuralNet> NeuralNet::SetupNeuralNet(const NetProto& np,
+    Phase phase, const string& param_type){
   NetProto proto;
   proto.set_partition_type(np.partition_type());
   // exclude layers if necessary
@@ -47,11 +48,13 @@ shared_ptr<NeuralNet> NeuralNet::SetupNeuralNet(const NetProto& np, Phase phase)
     }
   }
   LOG(INFO)<<"NeuralNet config is "<<proto.DebugString();
-  shared_ptr<NeuralNet> net(new NeuralNet(proto));
+  shared_ptr<NeuralNet> net(new NeuralNet(proto, 1, param_type));
   return net;
 }
-NeuralNet::NeuralNet(NetProto net_proto, int group_size) {
+NeuralNet::NeuralNet(NetProto net_proto, int group_size,
+    const string& param_type) {
   group_size_=group_size;
+  param_type_=param_type;
   for(int i=0;i<net_proto.layer_size();i++){
     LayerProto * layer_proto=net_proto.mutable_layer(i);
     if(!layer_proto->has_partition_type())
@@ -98,6 +101,7 @@ void NeuralNet::ConstructNeuralNet(const NetProto& net_proto){
   for(SNode node: graph_.nodes()){
     shared_ptr<Layer> layer(factory->Create(protos[node->name()].type()));
     layer->Init(protos[node->name()]);
+    layer->set_param_type(param_type_);
     name2layer_[node->name()]=layer;
     layers_.push_back(layer);
   }
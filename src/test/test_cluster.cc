@@ -1,3 +1,4 @@
+#include <unistd.h>
 #include <fstream>
 #include "gtest/gtest.h"
 #include "proto/cluster.pb.h"
@@ -93,3 +94,48 @@ TEST(ClusterTest, MultiServerGroups){
   ASSERT_STREQ("awan-0-08-0", cluster->host_addr().c_str());
 }
 */
+
+TEST(ClusterTest, ServerPorts){
+  string hostfile="/tmp/singa-test-hostfile-"+std::to_string(getpid());
+  std::ofstream fout(hostfile);
+  // procs on the same host with consecutive ports
+  fout<<"localhost:6723"<<std::endl<<"localhost:6724"<<std::endl;
+  fout.close();
+  ClusterProto proto;
+  proto.set_workspace("/tmp");
+  proto.set_hostfile(hostfile);
+  proto.set_nworker_groups(1);
+  proto.set_nserver_groups(1);
+  proto.set_nworkers_per_group(2);
+  proto.set_nservers_per_group(2);
+  proto.set_direct_server_access(true);
+  auto cluster=Cluster::Get(proto, 0);
+  ASSERT_EQ(2, cluster->nprocs());
+  ASSERT_EQ(6725, cluster->server_port(0, 0));
+  ASSERT_EQ(6726, cluster->server_port(0, 1));
+  proto.set_server_start_port(7000);
+  cluster=Cluster::Get(proto, 1);
+  ASSERT_EQ(7001, cluster->server_port(0, 1));
+  unlink(hostfile.c_str());
+}
+
+TEST(ClusterTest, ServerTopology){
+  ClusterProto proto;
+  proto.set_workspace("/tmp");
+  proto.set_nworker_groups(1);
+  proto.set_nserver_groups(3);
+  proto.set_nservers_per_procs(3);
+  for(int group=0;group<3;group++){
+    ServerTopology* topology=proto.add_server_group();
+    topology->set_id(group);
+    topology->set_sync_interval(100);
+    for(int neighbor=0;neighbor<3;neighbor++)
+      if(neighbor!=group)
+        topology->add_neighbor(neighbor);
+  }
+  ASSERT_EQ(3, Cluster::Get(proto, 0)->nserver_groups());
+  // a chain 0-1-2, changes of group 0 would never reach group 2
+  proto.mutable_server_group(0)->clear_neighbor();
+  proto.mutable_server_group(0)->add_neighbor(1);
+  ASSERT_DEATH(Cluster::Get(proto, 0), "neighbor");
+}
@@ -0,0 +1,194 @@
+#include <string.h>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include "gtest/gtest.h"
+#include "utils/codec.h"
+using std::vector;
+using namespace singa;
+
+/**
+ * Values covering normals, subnormals, rounding ties and special values; the
+ * length is not a multiple of the SIMD width to test the tails.
+ */
+vector<float> TestValues(){
+  vector<float> v{0.f, -0.f, 1.f, -2.5f, 65504.f, 65520.f, 1e-5f, -6e-8f,
+    1.00048828125f, 1.00146484375f, 3e-8f, 1e30f,
+    std::numeric_limits<float>::infinity(),
+    -std::numeric_limits<float>::infinity()};
+  for(int i=0;i<1001;i++)
+    v.push_back(std::sin(i)*std::pow(2.f, i%40-20));
+  return v;
+}
+
+TEST(CodecTest, Half){
+  vector<float> v=TestValues();
+  vector<uint16_t> h(v.size());
+  FloatToHalf(v.data(), v.size(), h.data());
+  vector<float> back(v.size());
+  HalfToFloat(h.data(), h.size(), back.data());
+  for(size_t i=0;i<v.size();i++){
+    ASSERT_EQ(FloatToHalf(v[i]), h[i]);
+    ASSERT_EQ(HalfToFloat(h[i]), back[i]);
+    if(std::fabs(v[i])>=6.2e-5f&&std::fabs(v[i])<=65504.f){
+      ASSERT_NEAR(v[i], back[i], std::fabs(v[i])/1024);
+    }
+  }
+  ASSERT_EQ(0x3C00, FloatToHalf(1.f));
+  // ties to even
+  ASSERT_EQ(0x3C00, FloatToHalf(1.00048828125f));
+  ASSERT_EQ(0x3C02, FloatToHalf(1.00146484375f));
+  ASSERT_EQ(0x7C00, FloatToHalf(65520.f));
+  ASSERT_EQ(0x0001, FloatToHalf(6e-8f));
+  ASSERT_TRUE(std::isnan(HalfToFloat(
+          FloatToHalf(std::numeric_limits<float>::quiet_NaN()))));
+}
+
+TEST(CodecTest, BF16){
+  vector<float> v=TestValues();
+  vector<uint16_t> h(v.size());
+  FloatToBF16(v.data(), v.size(), h.data());
+  vector<float> back(v.size());
+  BF16ToFloat(h.data(), h.size(), back.data());
+  for(size_t i=0;i<v.size();i++){
+    ASSERT_EQ(FloatToBF16(v[i]), h[i]);
+    ASSERT_EQ(BF16ToFloat(h[i]), back[i]);
+    if(std::isfinite(v[i])){
+      ASSERT_NEAR(v[i], back[i], std::fabs(v[i])/128);
+    }
+  }
+  ASSERT_TRUE(std::isnan(BF16ToFloat(
+          FloatToBF16(std::numeric_limits<float>::quiet_NaN()))));
+}
+
+TEST(CodecTest, EncodeDecode){
+  vector<float> v=TestValues(), back(v.size());
+  for(auto encoding: {ParamProto::kFP32, ParamProto::kFP16,
+      ParamProto::kBF16}){
+    vector<char> buf(EncodedBytes(encoding, v.size()));
+    EncodeFloats(encoding, v.data(), v.size(), buf.data());
+    DecodeFloats(encoding, buf.data(), v.size(), back.data());
+    ASSERT_EQ(1.f, back[2]);
+    ASSERT_EQ(-2.5f, back[3]);
+  }
+  ASSERT_EQ(20, EncodedBytes(ParamProto::kBF16, 10));
+  ASSERT_EQ(40, EncodedBytes(ParamProto::kFP32, 10));
+}
+
+TEST(CodecTest, Sparse){
+  vector<float> v{0.1f, -3.f, 0.f, 2.f, -0.5f, 4.f, 0.2f, -2.f}, scratch;
+  ASSERT_EQ(2.f, TopKThreshold(v.data(), v.size(), 4, &scratch));
+  ASSERT_EQ(0.f, TopKThreshold(v.data(), v.size(), 8, &scratch));
+  vector<int> idx;
+  vector<float> val;
+  // ties may exceed k values, which are cut by max
+  ASSERT_EQ(3, ExtractSparse(v.data(), v.size(), 2.f, 3, &idx, &val));
+  ASSERT_EQ((vector<int>{1, 3, 5}), idx);
+  ASSERT_EQ((vector<float>{-3.f, 2.f, 4.f}), val);
+  // moved values are reset in src, others are kept as the residual
+  ASSERT_EQ(0.f, v[1]);
+  ASSERT_EQ(-2.f, v[7]);
+  ASSERT_EQ(0.1f, v[0]);
+  // zeros are never moved, even with threshold 0
+  idx.clear();
+  val.clear();
+  ASSERT_EQ(4, ExtractSparse(v.data(), v.size(), 0.f, v.size(), &idx, &val));
+}
+
+TEST(CodecTest, Quantize){
+  vector<float> v(1001), scratch;
+  for(size_t i=0;i<v.size();i++)
+    v[i]=std::sin(i)*(i%3);
+  for(auto codec: {ParamProto::kSign1Bit, ParamProto::kLinear8Bit}){
+    // 1 column, 4 columns (SIMD) and 5 columns (scalar)
+    for(int cols: {1, 4, 5}){
+      vector<float> src(v), back(v.size());
+      vector<char> buf(QuantizedBytes(codec, v.size(), cols));
+      Quantize(codec, src.data(), v.size(), cols, buf.data(), &scratch);
+      Dequantize(codec, buf.data(), v.size(), cols, back.data());
+      // the residual left in src is exactly the quantization error
+      for(size_t i=0;i<v.size();i++)
+        ASSERT_NEAR(v[i], back[i]+src[i], 1e-6);
+    }
+  }
+  ASSERT_EQ(8*3+2, QuantizedBytes(ParamProto::kSign1Bit, 9, 3));
+  ASSERT_EQ(8*2+300, QuantizedBytes(ParamProto::kLinear8Bit, 300, 1));
+  // one column with 1, 3 (positive) and -2 (negative)
+  vector<float> x{1.f, -2.f, 3.f}, back(3);
+  vector<char> buf(QuantizedBytes(ParamProto::kSign1Bit, 3, 1));
+  Quantize(ParamProto::kSign1Bit, x.data(), 3, 1, buf.data(), &scratch);
+  Dequantize(ParamProto::kSign1Bit, buf.data(), 3, 1, back.data());
+  ASSERT_EQ((vector<float>{2.f, -2.f, 2.f}), back);
+  ASSERT_EQ((vector<float>{-1.f, 0.f, 1.f}), x);
+}
+
+/**
+ * The sign bits are written over garbage; every bit is packed by the scalar
+ * tail if SIMD is disabled, i.e., built with -DSINGA_NO_SIMD.
+ */
+TEST(CodecTest, Sign1BitDirtyBuffer){
+  vector<float> v(37, 1.5f), scratch;
+  vector<float> src(v), back(v.size());
+  vector<char> buf(QuantizedBytes(ParamProto::kSign1Bit, v.size(), 1),
+      static_cast<char>(0xFF));
+  Quantize(ParamProto::kSign1Bit, src.data(), v.size(), 1, buf.data(),
+      &scratch);
+  Dequantize(ParamProto::kSign1Bit, buf.data(), v.size(), 1, back.data());
+  // all positive, decoded to the positive mean
+  for(size_t i=0;i<v.size();i++)
+    ASSERT_EQ(1.5f, back[i]);
+}
+
+/**
+ * XOR deltas of slightly changed values are restored exactly, and compress
+ * well after byte-shuffling.
+ */
+TEST(CodecTest, XorDelta){
+  vector<float> base=TestValues(), next(base);
+  for(size_t i=0;i<next.size();i+=3)
+    next[i]*=1.0001f;
+  size_t nbytes=sizeof(float)*base.size();
+  vector<char> delta(nbytes), shuffled(nbytes), back(nbytes);
+  XorBytes(base.data(), next.data(), nbytes, delta.data());
+  ShuffleBytes(delta.data(), base.size(), sizeof(float), shuffled.data());
+  vector<char> packed{'x'};
+  size_t len=CompressBytes(shuffled.data(), nbytes, &packed);
+  ASSERT_EQ(len+1, packed.size());
+  ASSERT_LT(len, nbytes/2);
+  DecompressBytes(packed.data()+1, len, back.data(), nbytes);
+  ASSERT_EQ(shuffled, back);
+  UnshuffleBytes(back.data(), base.size(), sizeof(float), delta.data());
+  XorBytes(base.data(), delta.data(), nbytes, base.data());
+  ASSERT_EQ(0, memcmp(next.data(), base.data(), nbytes));
+  // empty, short and incompressible inputs
+  for(size_t n: {0, 3, 1000}){
+    vector<char> src(n), out(n);
+    for(size_t i=0;i<n;i++)
+      src[i]=static_cast<char>(i*2654435761u>>13);
+    packed.clear();
+    len=CompressBytes(src.data(), n, &packed);
+    DecompressBytes(packed.data(), len, out.data(), n);
+    ASSERT_EQ(src, out);
+  }
+}
+
+/**
+ * The SIMD kernels (if supported by the CPU) and the scalar versions agree
+ * bit by bit on all 2^16 encoded values, including signalling nans.
+ */
+TEST(CodecTest, ExhaustiveDecode){
+  vector<uint16_t> h(1<<16);
+  for(size_t i=0;i<h.size();i++)
+    h[i]=i;
+  vector<float> back(h.size());
+  HalfToFloat(h.data(), h.size(), back.data());
+  for(size_t i=0;i<h.size();i++){
+    float f=HalfToFloat(h[i]);
+    ASSERT_EQ(0, memcmp(&f, &back[i], sizeof(f)))<<"half "<<i;
+  }
+  BF16ToFloat(h.data(), h.size(), back.data());
+  for(size_t i=0;i<h.size();i++){
+    float f=BF16ToFloat(h[i]);
+    ASSERT_EQ(0, memcmp(&f, &back[i], sizeof(f)))<<"bf16 "<<i;
+  }
+}
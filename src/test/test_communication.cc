@@ -1,8 +1,12 @@
 #include <thread>
 #include <vector>
+#include <chrono>
+#include <string>
 #include "gtest/gtest.h"
 #include "communication/msg.h"
 #include "communication/socket.h"
+#include "communication/coalescer.h"
+#include "utils/blob.h"
 using std::vector;
 using namespace singa;
 
@@ -12,12 +16,13 @@ const char* ping="PING",*pong="PONG";
  */
 void Connect(Dealer* dealer, int gid, int id, int flag){
   dealer->Connect("inproc://router");
-  Msg msg;
-  msg.set_src(gid, id, flag);
-  msg.set_dst(0,0,2);
-  msg.set_type(0);
-  msg.add_frame(ping, 4);
-  dealer->Send(&msg);
+  // Send() takes the ownership of the message
+  Msg* msg=new Msg();
+  msg->set_src(gid, id, flag);
+  msg->set_dst(0,0,2);
+  msg->set_type(0);
+  msg->add_frame(ping, 4);
+  dealer->Send(msg);
 }
 
 /**
@@ -44,12 +49,12 @@ void WorkerDealer(int sid, int did){
   Connect(dealer, 0, sid, 0);
   for(int i=0;i<2;i++){
     {
-      Msg msg;
-      msg.set_src(0, sid, 0);
-      msg.set_dst(0, did, 1);
-      msg.set_type(3);
-      msg.set_target(i);
-      dealer->Send(&msg);
+      Msg* msg=new Msg();
+      msg->set_src(0, sid, 0);
+      msg->set_dst(0, did, 1);
+      msg->set_type(3);
+      msg->set_target(i);
+      dealer->Send(msg);
     }
     {
       Msg *msg=dealer->Receive();
@@ -70,10 +75,10 @@ void ServerDealer(int id, int n){
   Connect(dealer, 0, id, 1);
   for(int i=0;i<n;i++){
     Msg *msg=dealer->Receive();
-    Msg reply;
-    reply.set_dst(msg->src_group_id(), msg->src_id(), msg->src_flag());
-    reply.set_src(0, id, 1);
-    dealer->Send(&reply);
+    Msg* reply=new Msg();
+    reply->set_dst(msg->src_group_id(), msg->src_id(), msg->src_flag());
+    reply->set_src(0, id, 1);
+    dealer->Send(reply);
     delete msg;
   }
   delete dealer;
@@ -92,11 +97,11 @@ TEST(CommunicationTest, DealerRouterPingPong){
     ASSERT_EQ(2, msg->dst_flag());
     ASSERT_STREQ(ping, (char*)msg->frame_data());
 
-    Msg reply;
-    reply.set_src(0,0,2);
-    reply.set_dst(msg->src_group_id(), msg->src_id(), msg->src_flag());
-    reply.add_frame(pong, 4);
-    router->Send(&reply);
+    Msg* reply=new Msg();
+    reply->set_src(0,0,2);
+    reply->set_dst(msg->src_group_id(), msg->src_id(), msg->src_flag());
+    reply->add_frame(pong, 4);
+    router->Send(reply);
     delete msg;
   }
 
@@ -122,11 +127,11 @@ TEST(CommunicationTest, nWorkers1Server){
       k++;
       if(k==nworker)
         threads.push_back(std::thread(ServerDealer, 0, 2*nworker));
+      delete msg;
     }else{
       nmsg--;
       router->Send(msg);
     }
-    delete msg;
   }
   delete router;
   for(auto& thread:threads)
@@ -146,13 +151,272 @@ TEST(CommunicationTest, 2Workers2Server){
     Msg* msg=router->Receive();
     if(2== msg->dst_flag()){
       ASSERT_STREQ(ping, (char*)msg->frame_data());
+      delete msg;
     }else{
       n--;
       router->Send(msg);
     }
-    delete msg;
   }
   delete router;
   for(auto& thread:threads)
     thread.join();
 }
+
+/**
+ * Encode the header into a zmsg and decode it back.
+ */
+Msg* HeaderRoundTrip(int i){
+  Msg* msg=new Msg();
+  msg->set_src(1, i&0xfff, 1);
+  msg->set_dst(2, 3, 2);
+  msg->set_type(3);
+  msg->set_target(i&0xffff);
+  msg->set_version(i);
+  msg->set_size(1000);
+  msg->set_base_version(i-1);
+  Msg* recv=new Msg();
+  recv->ParseFromZmsg(msg->DumpToZmsg());
+  delete msg;
+  return recv;
+}
+
+TEST(CommunicationTest, HeaderFormat){
+  for(bool text: {false, true}){
+    Msg::set_text_header(text);
+    Msg* msg=HeaderRoundTrip(7);
+    ASSERT_EQ(1, msg->src_group_id());
+    ASSERT_EQ(7, msg->src_id());
+    ASSERT_EQ(1, msg->src_flag());
+    ASSERT_EQ(2, msg->dst_group_id());
+    ASSERT_EQ(3, msg->dst_id());
+    ASSERT_EQ(2, msg->dst_flag());
+    ASSERT_EQ(3, msg->type());
+    ASSERT_EQ(7, msg->target());
+    ASSERT_EQ(7, msg->version());
+    ASSERT_EQ(1000, msg->size());
+    ASSERT_EQ(6, msg->base_version());
+    delete msg;
+  }
+  Msg::set_text_header(false);
+}
+
+/**
+ * Micro-benchmark for encoding and decoding message headers, disabled in the
+ * unit tests; run it with --gtest_also_run_disabled_tests.
+ */
+TEST(CommunicationTest, DISABLED_HeaderThroughput){
+  const int n=200000;
+  for(bool text: {true, false}){
+    Msg::set_text_header(text);
+    auto start=std::chrono::steady_clock::now();
+    for(int i=0;i<n;i++)
+      delete HeaderRoundTrip(i);
+    std::chrono::duration<double> secs=std::chrono::steady_clock::now()-start;
+    LOG(INFO)<<(text?"text":"binary")<<" header: "<<n/secs.count()
+      <<" msgs/sec";
+  }
+  Msg::set_text_header(false);
+}
+
+/**
+ * Blob content sent via zero-copy frames must not be affected by writes
+ * after sending, which go to a new buffer (copy-on-write).
+ */
+TEST(CommunicationTest, ZeroCopyFrame){
+  Router* router=new Router();
+  router->Bind("");
+  Dealer* dealer=new Dealer();
+  dealer->Connect("inproc://router");
+  Blob<float> blob(vector<int>{1000});
+  float* dptr=blob.mutable_cpu_data();
+  for(int i=0;i<blob.count();i++)
+    dptr[i]=i;
+  Msg* msg=new Msg();
+  msg->set_src(0, 1, 0);
+  msg->set_dst(0, 0, 2);
+  msg->add_frame(blob.cpu_data(), sizeof(float)*blob.count(),
+      blob.data()->pin_cpu_data());
+  int generation=blob.data()->generation();
+  // overwrite before the message is received
+  float* newptr=blob.mutable_cpu_data();
+  newptr[0]=-1.f;
+  ASSERT_EQ(generation+1, blob.data()->generation());
+  ASSERT_NE(dptr, newptr);
+  dealer->Send(msg);
+
+  Msg* recv=router->Receive();
+  ASSERT_EQ(sizeof(float)*blob.count(), recv->frame_size());
+  const float* rptr=static_cast<float*>(recv->frame_data());
+  for(int i=0;i<blob.count();i++)
+    ASSERT_EQ(i, rptr[i]);
+  // adopt the received buffer
+  Blob<float> dst(vector<int>{1000});
+  dst.data()->adopt_cpu_data(recv->frame_data(), recv->frame_size(),
+      recv->release_frame());
+  delete recv;
+  ASSERT_EQ(rptr, dst.cpu_data());
+  ASSERT_EQ(999, dst.cpu_data()[999]);
+  delete dealer;
+  delete router;
+}
+
+/**
+ * Msg objects are recycled by the thread-local pool.
+ */
+TEST(CommunicationTest, MsgPool){
+  // warm up the pool of this thread
+  delete HeaderRoundTrip(0);
+  const MsgPoolStats& stats=Msg::pool_stats();
+  uint64_t msg_allocs=stats.msg_allocs, zmsg_allocs=stats.zmsg_allocs;
+  uint64_t msg_reuses=stats.msg_reuses;
+  for(int i=0;i<100;i++){
+    Msg* msg=new Msg();
+    msg->add_frame(ping, 4);
+    delete msg;
+  }
+  ASSERT_EQ(msg_allocs, stats.msg_allocs);
+  ASSERT_EQ(zmsg_allocs, stats.zmsg_allocs);
+  ASSERT_EQ(msg_reuses+100, stats.msg_reuses);
+}
+
+/**
+ * Small msgs to one procs are batched in order; large ones are sent alone.
+ */
+TEST(CommunicationTest, Coalescer){
+  Coalescer coalescer(0, 1000, 1000000);
+  Coalescer::Outbox ready;
+  vector<float> small(10), large(1000);
+  // header, num of frames and one frame with its size
+  size_t nbytes=sizeof(MsgHeader)+2*sizeof(uint32_t)
+    +sizeof(float)*small.size();
+  // the size threshold is reached by the nbatch-th msg
+  size_t nbatch=(1000+nbytes-1)/nbytes;
+  ASSERT_LT(nbatch, 20);
+  for(int i=0;i<20;i++){
+    Msg* msg=new Msg();
+    msg->set_type(kUpdate);
+    msg->set_target(i);
+    msg->set_size(small.size());
+    msg->add_frame(small.data(), sizeof(float)*small.size());
+    ASSERT_EQ(nbytes, msg->ByteSize());
+    coalescer.Add(1, msg, &ready);
+  }
+  ASSERT_EQ(1, ready.size());
+  ASSERT_EQ(kBatch, ready[0].second->type());
+  ASSERT_EQ(nbatch, ready[0].second->size());
+  ASSERT_LT(0, coalescer.Timeout());
+  Msg* msg=new Msg();
+  msg->add_frame(large.data(), sizeof(float)*large.size());
+  coalescer.Add(1, msg, &ready);
+  // the buffered msgs are flushed before the large one
+  ASSERT_EQ(3, ready.size());
+  ASSERT_EQ(20-nbatch, ready[1].second->size());
+  ASSERT_EQ(msg, ready[2].second);
+  ASSERT_EQ(-1, coalescer.Timeout());
+
+  vector<Msg*> msgs;
+  for(int k=0;k<2;k++){
+    // envelopes are split by the receiver
+    Msg* batch=new Msg();
+    batch->ParseFromZmsg(ready[k].second->DumpToZmsg());
+    delete ready[k].second;
+    Coalescer::Split(batch, &msgs);
+  }
+  ASSERT_EQ(20, msgs.size());
+  for(int i=0;i<20;i++){
+    ASSERT_EQ(i, msgs[i]->target());
+    ASSERT_EQ(kUpdate, msgs[i]->type());
+    ASSERT_EQ(sizeof(float)*small.size(), msgs[i]->frame_size());
+    delete msgs[i];
+  }
+  delete msg;
+
+  // the delay is in useconds
+  Coalescer fast(0, 1000, 200);
+  ready.clear();
+  fast.Add(1, new Msg(), &ready);
+  ASSERT_GE(200, fast.Timeout());
+  std::this_thread::sleep_for(std::chrono::microseconds(300));
+  ASSERT_EQ(0, fast.Timeout());
+  fast.FlushExpired(&ready);
+  ASSERT_EQ(1, ready.size());
+  delete ready[0].second;
+}
+
+/**
+ * A stub thread forwarding messages among local dealers until kStop.
+ */
+void RouteLoop(const std::string& endpoint){
+  Router router;
+  router.Bind(endpoint);
+  while(true){
+    Msg* msg=router.Receive();
+    if(msg->type()==kStop){
+      delete msg;
+      break;
+    }
+    if(msg->dst_flag()==kStub)
+      delete msg;
+    else
+      router.Send(msg);
+  }
+}
+
+/**
+ * Routing throughput of worker-server pairs against the num of stub threads.
+ * Messages of every pair must arrive in order. Disabled in the unit tests as
+ * HeaderThroughput.
+ */
+TEST(CommunicationTest, DISABLED_RoutingThroughput){
+  const int npairs=8, nmsgs=20000;
+  vector<float> payload(16);
+  for(int nrouters: {1, 2, 4}){
+    std::string endpoint="inproc://bench-"+std::to_string(nrouters);
+    vector<std::thread> routers, threads;
+    for(int i=0;i<nrouters;i++)
+      routers.push_back(std::thread(RouteLoop,
+            RouterEndpoint(endpoint, i)));
+    auto start=std::chrono::steady_clock::now();
+    for(int p=0;p<npairs;p++){
+      threads.push_back(std::thread([&, p]{
+        Dealer dealer(p, nrouters);
+        dealer.Connect(endpoint);
+        Msg* hello=new Msg();
+        hello->set_src(0, p, kServer);
+        hello->set_dst(0, 0, kStub);
+        hello->set_type(kConnect);
+        dealer.Broadcast(hello);
+        for(int i=0;i<nmsgs;i++){
+          Msg* msg=dealer.Receive();
+          ASSERT_EQ(i, msg->target());
+          delete msg;
+        }
+      }));
+      threads.push_back(std::thread([&, p]{
+        Dealer dealer(npairs+p, nrouters);
+        dealer.Connect(endpoint);
+        for(int i=0;i<nmsgs;i++){
+          Msg* msg=new Msg();
+          msg->set_src(0, p, kWorkerParam);
+          msg->set_dst(0, p, kServer);
+          msg->set_type(kUpdate);
+          msg->set_target(i);
+          msg->add_frame(payload.data(), sizeof(float)*payload.size());
+          dealer.Send(msg);
+        }
+      }));
+    }
+    for(auto& thread: threads)
+      thread.join();
+    std::chrono::duration<double> secs=std::chrono::steady_clock::now()-start;
+    Dealer dealer(-1, nrouters);
+    dealer.Connect(endpoint);
+    Msg* stop=new Msg();
+    stop->set_type(kStop);
+    dealer.Broadcast(stop);
+    for(auto& router: routers)
+      router.join();
+    LOG(INFO)<<nrouters<<" stub threads: "<<npairs*nmsgs/secs.count()
+      <<" msgs/sec";
+  }
+}
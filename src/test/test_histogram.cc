@@ -0,0 +1,37 @@
+#include "gtest/gtest.h"
+#include "utils/histogram.h"
+using namespace singa;
+
+TEST(HistogramTest, Bucket){
+  ASSERT_EQ(0, Histogram::Bucket(0));
+  ASSERT_EQ(1, Histogram::Bucket(1));
+  ASSERT_EQ(2, Histogram::Bucket(2));
+  ASSERT_EQ(2, Histogram::Bucket(3));
+  ASSERT_EQ(11, Histogram::Bucket(1024));
+  ASSERT_EQ(kHistBuckets-1, Histogram::Bucket(UINT64_MAX));
+}
+
+/**
+ * Percentiles are upper bounds of buckets; snapshots are subtracted to get
+ * the values added since then.
+ */
+TEST(HistogramTest, Percentile){
+  Histogram hist;
+  for(int i=0;i<99;i++)
+    hist.Add(10);
+  hist.Add(1000);
+  HistogramData data;
+  data.Merge(hist);
+  ASSERT_EQ(100, data.count());
+  ASSERT_DOUBLE_EQ(19.9, data.mean());
+  ASSERT_EQ(15, data.Percentile(0.5));
+  ASSERT_EQ(1023, data.Percentile(0.99));
+  ASSERT_EQ(1023, data.Percentile(1.0));
+
+  hist.Add(3);
+  HistogramData delta;
+  delta.Merge(hist);
+  delta.Subtract(data);
+  ASSERT_EQ(1, delta.count());
+  ASSERT_EQ(3, delta.Percentile(0.5));
+}
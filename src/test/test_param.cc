@@ -0,0 +1,136 @@
+#include <vector>
+#include "gtest/gtest.h"
+#include "utils/param.h"
+#include "utils/codec.h"
+using std::vector;
+using namespace singa;
+
+/**
+ * Pass msg through the wire format, as between a worker and a server.
+ */
+Msg* RoundTrip(Msg* msg){
+  Msg* recv=new Msg();
+  recv->ParseFromZmsg(msg->DumpToZmsg());
+  delete msg;
+  return recv;
+}
+
+TEST(ParamTest, Sign1BitPutUpdate){
+  ParamProto proto;
+  proto.set_update_codec(ParamProto::kSign1Bit);
+  // 2 slices of 2 rows each
+  proto.set_split_threshold(10);
+  Param worker;
+  worker.Setup(proto, vector<int>{4, 5}, 5);
+  worker.Init(0);
+  ASSERT_EQ(2, worker.nslices());
+  int step=0;
+  for(int slice=0;slice<worker.nslices();slice++){
+    Param server;
+    Msg* put=RoundTrip(worker.GenPutMsg(&step, slice));
+    server.HandlePutMsg(&put);
+    ASSERT_EQ(2, server.data().shape().size());
+    ASSERT_EQ(2, server.data().shape()[0]);
+    ASSERT_EQ(5, server.data().shape()[1]);
+
+    float* grad=worker.mutable_cpu_grad();
+    for(int i=0;i<worker.size();i++)
+      grad[i]=(i%3-1)*0.5f+i*0.01f;
+    int offset=worker.slice_offset(slice), n=worker.slice_size(slice);
+    vector<float> expect(grad+offset, grad+offset+n);
+    vector<char> buf(QuantizedBytes(ParamProto::kSign1Bit, n, 5));
+    vector<float> scratch;
+    Quantize(ParamProto::kSign1Bit, expect.data(), n, 5, buf.data(),
+        &scratch);
+    Dequantize(ParamProto::kSign1Bit, buf.data(), n, 5, expect.data());
+
+    Msg* update=RoundTrip(worker.GenUpdateMsg(&step, slice));
+    server.ParseUpdateMsg(&update);
+    const float* got=server.grad().cpu_data();
+    for(int i=0;i<n;i++)
+      ASSERT_EQ(expect[i], got[i]);
+  }
+}
+
+/**
+ * Request the values of the whole param, held by the worker param.
+ */
+Msg* GetRequest(Param* worker, int version){
+  Msg* msg=worker->GenGetMsg(&version);
+  msg->set_target(SliceTarget(worker->id(), 0));
+  msg->set_base_version(worker->delta_version(0));
+  return msg;
+}
+
+TEST(ParamTest, DroppedDelta){
+  ParamProto proto;
+  proto.set_response_codec(ParamProto::kXorDelta);
+  Param worker, server;
+  worker.Setup(proto, vector<int>{4, 5}, 5);
+  server.Setup(proto, vector<int>{4, 5}, 5);
+  server.Init(3);
+  DeltaBase base;
+  Msg* msg=GetRequest(&worker, 1);
+  msg=RoundTrip(server.HandleGetMsg(&msg, 0, &base));
+  ASSERT_EQ(1, worker.ParseGetResponseMsg(&msg));
+  delete msg;
+  ASSERT_EQ(1, worker.version());
+  ASSERT_EQ(base.version, worker.delta_version(0));
+
+  // a delta against values the worker does not hold
+  DeltaBase other=base;
+  other.version++;
+  msg=GetRequest(&worker, 2);
+  msg=RoundTrip(server.HandleGetMsg(&msg, 0, &other));
+  ASSERT_EQ(0, worker.ParseGetResponseMsg(&msg));
+  delete msg;
+  ASSERT_EQ(1, worker.version());
+  ASSERT_EQ(-1, worker.delta_version(0));
+
+  // the full values requested again, the server resets the base as
+  // PMServer::GetDeltaBase() does
+  msg=GetRequest(&worker, 2);
+  ASSERT_EQ(-1, msg->base_version());
+  base.version=-1;
+  msg=RoundTrip(server.HandleGetMsg(&msg, 0, &base));
+  ASSERT_EQ(1, worker.ParseGetResponseMsg(&msg));
+  delete msg;
+  ASSERT_EQ(2, worker.version());
+  for(int i=0;i<worker.size();i++)
+    ASSERT_EQ(server.data().cpu_data()[i], worker.data().cpu_data()[i]);
+}
+
+TEST(ParamTest, SliceVersions){
+  ParamProto proto;
+  proto.set_split_threshold(10);
+  Param worker;
+  worker.Setup(proto, vector<int>{4, 5}, 5);
+  worker.Init(0);
+  ASSERT_EQ(2, worker.nslices());
+  // one server per slice
+  vector<Param> servers(2);
+  int step=0;
+  for(int k=0;k<2;k++){
+    Msg* put=RoundTrip(worker.GenPutMsg(&step, k));
+    servers[k].HandlePutMsg(&put);
+    servers[k].set_version(10);
+  }
+  auto respond=[&](int slice, int version){
+    Msg* msg=worker.GenGetMsg(&version);
+    msg->set_target(SliceTarget(worker.id(), slice));
+    msg=RoundTrip(servers[slice].HandleGetMsg(&msg, 0, nullptr));
+    ASSERT_EQ(1, worker.ParseGetResponseMsg(&msg));
+    delete msg;
+  };
+  // the slice servers are at different versions
+  respond(0, 2);
+  ASSERT_EQ(0, worker.version());
+  respond(1, 3);
+  ASSERT_EQ(2, worker.version());
+  // distinct slices are counted, not msgs
+  respond(0, 4);
+  respond(0, 5);
+  ASSERT_EQ(2, worker.version());
+  respond(1, 4);
+  ASSERT_EQ(4, worker.version());
+}
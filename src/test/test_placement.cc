@@ -0,0 +1,47 @@
+#include <vector>
+#include "gtest/gtest.h"
+#include "utils/placement.h"
+using std::vector;
+using namespace singa;
+
+/**
+ * A large FC weight and small biases, which would all go to server 0 and 1
+ * by id modulo 2.
+ */
+TEST(PlacementTest, Greedy){
+  vector<ParamLoad> loads{{0, 8e6, 8e6}, {1, 4e3, 4e3}, {2, 4e6, 4e6},
+    {3, 4e3, 4e3}, {4, 4e6, 4e6}, {5, 4e3, 4e3}};
+  ParamPlacement placement;
+  placement.Setup(loads, 2);
+  ASSERT_EQ(0, placement.Server(0, 2));
+  ASSERT_EQ(1, placement.Server(2, 2));
+  ASSERT_EQ(1, placement.Server(4, 2));
+  int nsmall[2]={0, 0};
+  for(int id: {1, 3, 5})
+    nsmall[placement.Server(id, 2)]++;
+  // ties go to the server with the smaller id
+  ASSERT_EQ(2, nsmall[0]);
+  ASSERT_EQ(1, nsmall[1]);
+  // params not placed fall back to modulo
+  ASSERT_EQ(1, placement.Server(7, 2));
+}
+
+TEST(PlacementTest, Move){
+  ParamPlacement placement;
+  placement.Move(1, 4, 3);
+  // only workers of server group 1 are routed to the new server
+  ASSERT_EQ(3, placement.Server(4, 4, 1));
+  ASSERT_EQ(0, placement.Server(4, 4, 0));
+  placement.Move(1, 4, 2);
+  ASSERT_EQ(2, placement.Server(4, 4, 1));
+}
+
+TEST(PlacementTest, Slices){
+  ParamPlacement placement;
+  // slices of a param go to consecutive servers from that of the param
+  ASSERT_EQ(1, placement.Server(SliceTarget(5, 0), 4));
+  ASSERT_EQ(2, placement.Server(SliceTarget(5, 1), 4));
+  ASSERT_EQ(0, placement.Server(SliceTarget(5, 3), 4));
+  ASSERT_EQ(5, ParamOfTarget(SliceTarget(5, 3)));
+  ASSERT_EQ(3, SliceOfTarget(SliceTarget(5, 3)));
+}
@@ -0,0 +1,418 @@
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "proto/cluster.pb.h"
+#include "trainer/pm_server.h"
+#include "utils/cluster.h"
+#include "utils/factory.h"
+#include "utils/singleton.h"
+using std::vector;
+using namespace singa;
+
+/**
+ * One server group of nservers (in one procs) serving ngroups worker groups.
+ */
+void SetupServerCluster(int ngroups, int nservers=1, int push_interval=0,
+    int snapshots=0){
+  ClusterProto proto;
+  proto.set_workspace("/tmp");
+  proto.set_nworker_groups(ngroups);
+  proto.set_nworkers_per_procs(ngroups);
+  proto.set_nserver_groups(1);
+  proto.set_nservers_per_group(nservers);
+  proto.set_nservers_per_procs(nservers);
+  proto.set_push_interval(push_interval);
+  proto.set_param_snapshots(snapshots);
+  Cluster::Get(proto, 0);
+}
+
+/**
+ * Setup the server with SGD of learning rate 1, i.e., updates subtract the
+ * gradients from the values.
+ */
+void SetupServer(PMServer* server, int server_id,
+    shared_ptr<PMServer::ParamShard> shard){
+  Singleton<Factory<Param>>::Instance()->Register("Param",
+      CreateInstance(Param, Param));
+  Singleton<Factory<Updater>>::Instance()->Register("Updater",
+      CreateInstance(SGDUpdater, Updater));
+  UpdaterProto proto;
+  proto.set_base_learning_rate(1.f);
+  server->Setup(0, server_id, shard, proto);
+}
+
+/**
+ * A param of worker group 0 with 4x5 values, all equal to value.
+ */
+shared_ptr<Param> WorkerParam(int id, float value){
+  auto param=std::make_shared<Param>();
+  param->Setup(ParamProto(), vector<int>{4, 5}, 5);
+  param->set_id(id);
+  float* dptr=param->mutable_cpu_data();
+  for(int i=0;i<param->size();i++)
+    dptr[i]=value;
+  return param;
+}
+
+/**
+ * Pass msg through the wire format, as between procs.
+ */
+Msg* Wire(Msg* msg){
+  Msg* recv=new Msg();
+  recv->ParseFromZmsg(msg->DumpToZmsg());
+  delete msg;
+  return recv;
+}
+
+/**
+ * Address msg from the worker of the group to server 0.
+ */
+Msg* FromWorker(Msg* msg, int group, int target){
+  msg->set_src(group, 0, kWorkerParam);
+  msg->set_dst(0, 0, kServer);
+  msg->set_target(target);
+  return Wire(msg);
+}
+
+/**
+ * kUpdate msg of the group for the version with all gradients equal to grad.
+ */
+Msg* UpdateMsg(shared_ptr<Param> param, int group, int version, float grad){
+  float* gptr=param->mutable_cpu_grad();
+  for(int i=0;i<param->size();i++)
+    gptr[i]=grad;
+  return FromWorker(param->GenUpdateMsg(&version), group, param->id());
+}
+
+Msg* PutMsg(shared_ptr<Param> param, int version){
+  return FromWorker(param->GenPutMsg(&version), 0, param->id());
+}
+
+/**
+ * @return the first value of the param in the kRGet or kRUpdate response
+ */
+float ResponseValue(Msg* response){
+  Msg* recv=Wire(response);
+  auto param=WorkerParam(recv->target(), 0.f);
+  param->ParseGetResponseMsg(&recv);
+  delete recv;
+  return param->data().cpu_data()[0];
+}
+
+/**
+ * An update of the next version from a faster group waits until the round
+ * of the current version is completed by the slower group.
+ */
+TEST(PMServerTest, BSPEarlyUpdate){
+  SetupServerCluster(2);
+  SyncPMServer server;
+  SetupServer(&server, 0, std::make_shared<PMServer::ParamShard>());
+  auto param=WorkerParam(0, 10.f);
+  Msg* put=PutMsg(param, 0);
+  delete server.HandlePut(&put);
+
+  vector<Msg*> responses;
+  Msg* update=UpdateMsg(param, 0, 0, 1.f);
+  server.HandleUpdate(&update, &responses);
+  ASSERT_EQ(0, responses.size());
+  // group 0 runs ahead
+  Msg* early=UpdateMsg(param, 0, 1, 2.f);
+  server.HandleUpdate(&early, &responses);
+  ASSERT_EQ(nullptr, early);
+  ASSERT_EQ(0, responses.size());
+  // completes version 0 with the average gradient 2, then adds the early one
+  update=UpdateMsg(param, 1, 0, 3.f);
+  server.HandleUpdate(&update, &responses);
+  ASSERT_EQ(2, responses.size());
+  for(int group=0;group<2;group++){
+    ASSERT_EQ(kRUpdate, responses[group]->type());
+    ASSERT_EQ(group, responses[group]->dst_group_id());
+    ASSERT_EQ(1, responses[group]->version());
+    ASSERT_EQ(8.f, ResponseValue(responses[group]));
+  }
+  responses.clear();
+  update=UpdateMsg(param, 1, 1, 4.f);
+  server.HandleUpdate(&update, &responses);
+  ASSERT_EQ(2, responses.size());
+  for(Msg* response: responses){
+    ASSERT_EQ(2, response->version());
+    ASSERT_EQ(5.f, ResponseValue(response));
+  }
+  responses.clear();
+  // an update of an old version is answered without being applied
+  update=UpdateMsg(param, 0, 0, 100.f);
+  server.HandleUpdate(&update, &responses);
+  ASSERT_EQ(1, responses.size());
+  ASSERT_EQ(2, responses[0]->version());
+  ASSERT_EQ(5.f, ResponseValue(responses[0]));
+}
+
+Msg* GetMsg(shared_ptr<Param> param, int group, int version){
+  return FromWorker(param->GenGetMsg(&version), group, param->id());
+}
+
+/**
+ * Requests of a group running ahead by more than the staleness are deferred
+ * until the slowest group catches up.
+ */
+TEST(PMServerTest, SSPDeferral){
+  SetupServerCluster(2);
+  SSPPMServer server(1);
+  SetupServer(&server, 0, std::make_shared<PMServer::ParamShard>());
+  auto param=WorkerParam(0, 10.f);
+  Msg* put=PutMsg(param, 0);
+  delete server.HandlePut(&put);
+
+  vector<Msg*> responses;
+  // group 0 reads version 1, within the staleness
+  Msg* update=UpdateMsg(param, 0, 0, 1.f);
+  server.HandleUpdate(&update, &responses);
+  ASSERT_EQ(1, responses.size());
+  ASSERT_EQ(1, responses[0]->version());
+  ASSERT_EQ(9.f, ResponseValue(responses[0]));
+  responses.clear();
+  // version 2 is beyond the staleness while group 1 is at clock 0
+  update=UpdateMsg(param, 0, 1, 1.f);
+  server.HandleUpdate(&update, &responses);
+  ASSERT_EQ(0, responses.size());
+  Msg* get=GetMsg(param, 0, 2);
+  ASSERT_EQ(nullptr, server.HandleGet(&get));
+  ASSERT_EQ(nullptr, get);
+  // group 1 advances the param to version 1, releasing both requests
+  update=UpdateMsg(param, 1, 0, 1.f);
+  server.HandleUpdate(&update, &responses);
+  ASSERT_EQ(3, responses.size());
+  ASSERT_EQ(kRUpdate, responses[0]->type());
+  ASSERT_EQ(0, responses[0]->dst_group_id());
+  ASSERT_EQ(2, responses[0]->version());
+  ASSERT_EQ(kRGet, responses[1]->type());
+  ASSERT_EQ(0, responses[1]->dst_group_id());
+  ASSERT_EQ(2, responses[1]->version());
+  ASSERT_EQ(kRUpdate, responses[2]->type());
+  ASSERT_EQ(1, responses[2]->dst_group_id());
+  ASSERT_EQ(1, responses[2]->version());
+  // all updates are applied once they arrive
+  for(Msg* response: responses)
+    ASSERT_EQ(7.f, ResponseValue(response));
+}
+
+/**
+ * Gets are answered from the snapshot of the requested version, or the
+ * latest one if it is not older than the requested version.
+ */
+TEST(PMServerTest, GetFromSnapshot){
+  SetupServerCluster(1, 1, 0, 2);
+  PMServer server;
+  SetupServer(&server, 0, std::make_shared<PMServer::ParamShard>());
+  auto param=WorkerParam(0, 10.f);
+  Msg* put=PutMsg(param, 0);
+  delete server.HandlePut(&put);
+  vector<Msg*> responses;
+  for(int version=0;version<2;version++){
+    Msg* update=UpdateMsg(param, 0, version, 1.f);
+    server.HandleUpdate(&update, &responses);
+  }
+  for(Msg* response: responses)
+    delete response;
+  // versions 1 and 2 are kept, updates do not change their values
+  for(int version: {1, 2}){
+    Msg* get=GetMsg(param, 0, version);
+    Msg* response=server.HandleGetFromSnapshot(&get);
+    ASSERT_NE(nullptr, response);
+    ASSERT_EQ(kRGet, response->type());
+    ASSERT_EQ(version, response->version());
+    ASSERT_EQ(10.f-version, ResponseValue(response));
+  }
+  // version 0 is released, the latest one is newer
+  Msg* get=GetMsg(param, 0, 0);
+  ASSERT_EQ(8.f, ResponseValue(server.HandleGetFromSnapshot(&get)));
+  // version 3 is not reached yet, left to HandleGet()
+  get=GetMsg(param, 0, 3);
+  ASSERT_EQ(nullptr, server.HandleGetFromSnapshot(&get));
+  delete get;
+}
+
+/**
+ * Requests arriving at the old server of a moved param are forwarded to the
+ * new server, which holds the data sent by the old one.
+ */
+TEST(PMServerTest, MigrateForward){
+  string hostfile="/tmp/singa-test-hostfile-"+std::to_string(getpid());
+  std::ofstream fout(hostfile);
+  fout<<"localhost:6723"<<std::endl<<"localhost:6724"<<std::endl;
+  fout.close();
+  // servers 0 and 1 in different procs
+  ClusterProto proto;
+  proto.set_workspace("/tmp");
+  proto.set_hostfile(hostfile);
+  proto.set_nserver_groups(1);
+  proto.set_nservers_per_group(2);
+  Cluster::Get(proto, 0);
+  PMServer from, to;
+  SetupServer(&from, 0, std::make_shared<PMServer::ParamShard>());
+  SetupServer(&to, 1, std::make_shared<PMServer::ParamShard>());
+  auto param=WorkerParam(0, 10.f);
+  Msg* put=PutMsg(param, 0);
+  delete from.HandlePut(&put);
+
+  Msg* migrate=new Msg();
+  migrate->set_src(0, 0, kServer);
+  migrate->set_dst(0, 0, kServer);
+  migrate->set_type(kMigrate);
+  migrate->set_target(param->id());
+  int server=1;
+  migrate->add_frame(&server, sizeof(int));
+  migrate=Wire(migrate);
+  vector<Msg*> responses;
+  from.HandleMigrate(&migrate, &responses);
+  ASSERT_EQ(1, responses.size());
+  ASSERT_EQ(kMigrateData, responses[0]->type());
+  ASSERT_EQ(1, responses[0]->dst_id());
+  Msg* data=Wire(responses[0]);
+  responses.clear();
+
+  // forwarded after the data, as both go through the stub
+  Msg* get=GetMsg(param, 0, 0);
+  ASSERT_EQ(get, from.HandleGet(&get));
+  ASSERT_EQ(kServer, get->dst_flag());
+  ASSERT_EQ(1, get->dst_id());
+  Msg* update=UpdateMsg(param, 0, 0, 1.f);
+  from.HandleUpdate(&update, &responses);
+  ASSERT_EQ(1, responses.size());
+  ASSERT_EQ(kUpdate, responses[0]->type());
+  ASSERT_EQ(1, responses[0]->dst_id());
+  update=responses[0];
+  responses.clear();
+
+  // the new server announces itself to the stubs of all procs
+  to.HandleMigrateData(&data, &responses);
+  ASSERT_EQ(2, responses.size());
+  for(Msg* route: responses){
+    ASSERT_EQ(kRoute, route->type());
+    ASSERT_EQ(kStub, route->dst_flag());
+    delete route;
+  }
+  responses.clear();
+  Msg* response=to.HandleGet(&get);
+  ASSERT_EQ(kRGet, response->type());
+  ASSERT_EQ(0, response->dst_group_id());
+  ASSERT_EQ(10.f, ResponseValue(response));
+  to.HandleUpdate(&update, &responses);
+  ASSERT_EQ(1, responses.size());
+  ASSERT_EQ(1, responses[0]->version());
+  ASSERT_EQ(9.f, ResponseValue(responses[0]));
+  unlink(hostfile.c_str());
+}
+
+/**
+ * After an update, values are pushed to the subscribers except the worker
+ * answered by the update response.
+ */
+TEST(PMServerTest, SubscriberPush){
+  SetupServerCluster(2, 1, 1);
+  PMServer server;
+  SetupServer(&server, 0, std::make_shared<PMServer::ParamShard>());
+  auto param=WorkerParam(0, 10.f);
+  Msg* put=PutMsg(param, 0);
+  delete server.HandlePut(&put);
+  for(int group=0;group<2;group++){
+    // subscribing twice does not duplicate the pushes
+    for(int k=0;k<2;k++){
+      Msg* subscribe=GetMsg(param, group, 0);
+      subscribe->set_type(kSubscribe);
+      Msg* response=server.HandleSubscribe(&subscribe);
+      ASSERT_EQ(kRGet, response->type());
+      delete response;
+    }
+  }
+  vector<Msg*> responses;
+  Msg* update=UpdateMsg(param, 0, 0, 1.f);
+  server.HandleUpdate(&update, &responses);
+  ASSERT_EQ(2, responses.size());
+  ASSERT_EQ(kRUpdate, responses[0]->type());
+  ASSERT_EQ(0, responses[0]->dst_group_id());
+  ASSERT_EQ(kPush, responses[1]->type());
+  ASSERT_EQ(1, responses[1]->dst_group_id());
+  ASSERT_EQ(kWorkerParam, responses[1]->dst_flag());
+  ASSERT_EQ(1, responses[1]->version());
+  ASSERT_EQ(9.f, ResponseValue(responses[1]));
+  delete responses[0];
+}
+
+/**
+ * Server threads put, update and get params sharing few lock stripes
+ * concurrently; every update is applied once, in order per param.
+ */
+TEST(PMServerTest, ConcurrentStripes){
+  const int nthreads=4, nparams=8, nrounds=200;
+  SetupServerCluster(1, 1, 0, 2);
+  PMServer server;
+  auto shard=std::make_shared<PMServer::ParamShard>(2);
+  SetupServer(&server, 0, shard);
+  std::atomic<int> nput(0);
+  // versions of the update responses, per thread and param
+  vector<vector<vector<int>>> versions(nthreads,
+      vector<vector<int>>(nparams));
+  std::atomic<int> nbad_gets(0);
+  vector<std::thread> threads;
+  for(int t=0;t<nthreads;t++){
+    threads.push_back(std::thread([&, t]{
+      vector<shared_ptr<Param>> params;
+      for(int id=0;id<nparams;id++)
+        params.push_back(WorkerParam(id, 10.f));
+      // inserts copy the index read by the Gets from snapshots
+      for(int id=t;id<nparams;id+=nthreads){
+        Msg* put=PutMsg(params[id], 0);
+        delete server.HandlePut(&put);
+        nput++;
+      }
+      while(nput<nparams)
+        std::this_thread::yield();
+      vector<Msg*> responses;
+      for(int i=0;i<nrounds;i++){
+        for(int id=0;id<nparams;id++){
+          Msg* update=UpdateMsg(params[id], 0, 0, 1.f);
+          server.HandleUpdate(&update, &responses);
+          for(Msg* response: responses){
+            versions[t][id].push_back(response->version());
+            delete response;
+          }
+          responses.clear();
+          Msg* get=GetMsg(params[id], 0, 0);
+          Msg* response=server.HandleGetFromSnapshot(&get);
+          if(response==nullptr)
+            response=server.HandleGet(&get);
+          float value=ResponseValue(response);
+          if(value>10.f||value<10.f-nthreads*nrounds||value!=std::floor(value))
+            nbad_gets++;
+        }
+      }
+    }));
+  }
+  for(auto& thread: threads)
+    thread.join();
+  ASSERT_EQ(0, nbad_gets);
+  for(int id=0;id<nparams;id++){
+    auto param=shard->Find(id);
+    ASSERT_EQ(nthreads*nrounds, param->version());
+    ASSERT_EQ(10.f-nthreads*nrounds, param->data().cpu_data()[0]);
+    vector<int> all;
+    for(int t=0;t<nthreads;t++){
+      ASSERT_EQ(nrounds, versions[t][id].size());
+      // responses of one thread follow its updates
+      for(int i=1;i<nrounds;i++)
+        ASSERT_LT(versions[t][id][i-1], versions[t][id][i]);
+      all.insert(all.end(), versions[t][id].begin(), versions[t][id].end());
+    }
+    std::sort(all.begin(), all.end());
+    for(int v=0;v<nthreads*nrounds;v++)
+      ASSERT_EQ(v+1, all[v]);
+  }
+}
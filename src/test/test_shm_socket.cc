@@ -0,0 +1,255 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "communication/shm_socket.h"
+using std::vector;
+using std::string;
+using namespace singa;
+
+typedef std::chrono::steady_clock Clock;
+
+Msg* NewMsg(int src, int target, const vector<float>& payload){
+  Msg* msg=new Msg();
+  msg->set_src(0, src, 0);
+  msg->set_dst(0, 0, 2);
+  msg->set_type(3);
+  msg->set_target(target);
+  msg->set_size(payload.size());
+  msg->add_frame(payload.data(), payload.size()*sizeof(float));
+  return msg;
+}
+
+string TestRingName(int i){
+  return ShmSocket::RingName(getpid(), i);
+}
+
+TEST(ShmSocketTest, MultiProducer){
+  const int nproducers=4, nmsgs=2000;
+  // small ring to exercise wrapping and back pressure
+  ShmSocket inbox(TestRingName(0), true, 1<<16);
+  vector<std::thread> threads;
+  for(int p=0;p<nproducers;p++){
+    threads.push_back(std::thread([p]{
+      ShmSocket socket(TestRingName(0), false);
+      for(int i=0;i<nmsgs;i++){
+        // variable size frames
+        vector<float> payload(1+(i*7)%500, static_cast<float>(i));
+        socket.Send(NewMsg(p, i, payload));
+      }
+    }));
+  }
+  vector<int> next(nproducers, 0);
+  for(int k=0;k<nproducers*nmsgs;k++){
+    Msg* msg=inbox.Receive();
+    int p=msg->src_id(), i=msg->target();
+    // messages from one producer arrive in order
+    ASSERT_EQ(next[p], i);
+    next[p]++;
+    ASSERT_EQ(msg->size()*sizeof(float), msg->frame_size());
+    ASSERT_EQ(1+(i*7)%500, msg->size());
+    ASSERT_EQ(i, static_cast<float*>(msg->frame_data())[msg->size()-1]);
+    delete msg;
+  }
+  for(auto& thread: threads)
+    thread.join();
+  ASSERT_FALSE(inbox.Readable());
+  ASSERT_FALSE(inbox.Wait(10));
+}
+
+TEST(ShmSocketTest, StaleRing){
+  string name=TestRingName(3);
+  // a crashed run leaves its ring, which has been ready
+  pid_t pid=fork();
+  if(pid==0){
+    new ShmSocket(name, true, 1<<12);
+    _exit(0);
+  }
+  ASSERT_EQ(pid, waitpid(pid, nullptr, 0));
+  ASSERT_EQ(0, access(("/dev/shm/"+name).c_str(), F_OK));
+  std::thread sender([name]{
+    ShmSocket socket(name, false, 0, 5000);
+    socket.Send(NewMsg(1, 7, vector<float>{1.f}));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  ShmSocket inbox(name, true, 1<<12);
+  sender.join();
+  ASSERT_TRUE(inbox.Wait(1000));
+  Msg* msg=inbox.Receive();
+  ASSERT_EQ(7, msg->target());
+  delete msg;
+  inbox.Unlink();
+  ASSERT_NE(0, access(("/dev/shm/"+name).c_str(), F_OK));
+}
+
+TEST(ShmSocketTest, ReceiverExited){
+  string name=TestRingName(4);
+  pid_t pid=fork();
+  if(pid==0){
+    new ShmSocket(name, true, 1<<12);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    _exit(0);
+  }
+  // reaped at exit, otherwise the zombie looks alive
+  std::thread reaper([pid]{waitpid(pid, nullptr, 0);});
+  ShmSocket socket(name, false, 0, 5000);
+  // the ring gets full and is never consumed
+  int nsent=0;
+  while(socket.Send(NewMsg(1, nsent, vector<float>(100, 1.f))))
+    ASSERT_LT(++nsent, 100);
+  ASSERT_GT(nsent, 0);
+  reaper.join();
+  unlink(("/dev/shm/"+name).c_str());
+}
+
+TEST(ShmSocketTest, Poller){
+  ShmSocket first(TestRingName(5), true, 1<<12),
+            second(TestRingName(6), true, 1<<12);
+  ShmPoller poller;
+  poller.Add(&first);
+  poller.Add(&second);
+  ASSERT_EQ(nullptr, poller.Wait(10));
+  for(int k=0;k<4;k++){
+    ShmSocket* inbox=k%2?&first:&second;
+    string name=TestRingName(k%2?5:6);
+    std::thread sender([name, k]{
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      ShmSocket socket(name, false);
+      socket.Send(NewMsg(1, k, vector<float>{1.f}));
+    });
+    // woken by the doorbell shared by both rings
+    auto start=Clock::now();
+    ASSERT_EQ(inbox, poller.Wait(5000));
+    ASSERT_LT(Clock::now()-start, std::chrono::seconds(2));
+    sender.join();
+    Msg* msg=inbox->Receive();
+    ASSERT_EQ(k, msg->target());
+    delete msg;
+  }
+}
+
+/**
+ * Run the ping-pong and streaming benchmarks given a pair of sockets.
+ *
+ * The peer thread echos every message to measure the round trip latency, then
+ * consumes streamed messages to measure the throughput.
+ */
+void Benchmark(const string& transport, std::function<Socket*()> local,
+    std::function<Socket*()> peer){
+  const int nrounds=1000, nstream=2000;
+  for(int nfloats: {16, 1024, 256*1024}){
+    vector<float> payload(nfloats, 1.f);
+    Socket* sock=local();
+    std::thread echo([&]{
+      Socket* psock=peer();
+      for(int i=0;i<nrounds;i++){
+        Msg* msg=psock->Receive();
+        msg->SwapAddr();
+        psock->Send(msg);
+      }
+      Msg* last=nullptr;
+      for(int i=0;i<nstream;i++){
+        delete last;
+        last=psock->Receive();
+      }
+      last->SwapAddr();
+      psock->Send(last);
+      delete psock;
+    });
+    vector<double> rtt;
+    for(int i=0;i<nrounds;i++){
+      auto start=Clock::now();
+      sock->Send(NewMsg(1, i, payload));
+      delete sock->Receive();
+      rtt.push_back(std::chrono::duration<double, std::micro>(
+            Clock::now()-start).count());
+    }
+    auto start=Clock::now();
+    for(int i=0;i<nstream;i++)
+      sock->Send(NewMsg(1, i, payload));
+    delete sock->Receive();
+    std::chrono::duration<double> secs=Clock::now()-start;
+    echo.join();
+    delete sock;
+    std::sort(rtt.begin(), rtt.end());
+    LOG(INFO)<<transport<<" "<<nfloats*sizeof(float)<<" bytes: rtt median "
+      <<rtt[rtt.size()/2]<<" us, p99 "<<rtt[rtt.size()*99/100]<<" us, "
+      <<nstream/secs.count()<<" msgs/sec, "
+      <<nstream*nfloats*sizeof(float)/secs.count()/(1<<20)<<" MB/sec";
+  }
+}
+
+/**
+ * A pair of shared memory rings, one inbox per side.
+ */
+class ShmPair: public Socket{
+ public:
+  ShmPair(int in, int out):inbox_(TestRingName(in), true),
+    outbox_(nullptr), out_(out){}
+  ~ShmPair(){
+    delete outbox_;
+  }
+  virtual int Send(Msg* msg){
+    if(outbox_==nullptr)
+      outbox_=new ShmSocket(TestRingName(out_), false);
+    return outbox_->Send(msg);
+  }
+  virtual Msg* Receive(){
+    return inbox_.Receive();
+  }
+  virtual void* InternalID() const{
+    return nullptr;
+  }
+ protected:
+  ShmSocket inbox_;
+  ShmSocket* outbox_;
+  int out_;
+};
+
+/**
+ * @return a tcp port on the loopback interface that is free now
+ */
+int FreePort(){
+  int fd=socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  // port 0, picked by the kernel
+  socklen_t len=sizeof(addr);
+  CHECK_EQ(bind(fd, reinterpret_cast<struct sockaddr*>(&addr), len), 0);
+  CHECK_EQ(getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr), &len),
+      0);
+  close(fd);
+  return ntohs(addr.sin_port);
+}
+
+/**
+ * Disabled in the unit tests, run it with --gtest_also_run_disabled_tests.
+ */
+TEST(ShmSocketTest, DISABLED_Benchmark){
+  Benchmark("shm", []{return new ShmPair(1, 2);},
+      []{return new ShmPair(2, 1);});
+  string ipc="ipc:///tmp/singa-bench-"+std::to_string(getpid());
+  string tcp="tcp://127.0.0.1:"+std::to_string(FreePort());
+  for(string endpoint: {ipc, tcp}){
+    Benchmark(endpoint, [endpoint]{
+        Dealer* dealer=new Dealer();
+        dealer->Connect(endpoint);
+        return dealer;
+      }, [endpoint]{
+        Router* router=new Router();
+        router->Bind(endpoint);
+        return router;
+      });
+  }
+}
@@ -1,50 +1,138 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include "trainer/pm_server.h"
+#include "trainer/trainer.h"
 #include "utils/singleton.h"
 #include "utils/factory.h"
+#include "utils/cluster.h"
+#include "mshadow/tensor.h"
+#include "utils/placement.h"
+#include "communication/msg_stats.h"
+#include "utils/codec.h"
+#include <math.h>
+#include <algorithm>
 #include <vector>
 
 using std::vector;
 
 namespace singa{
+PMServer::ParamShard::ParamShard(int nstripes):
+  nstripes_(nstripes), stripes_(new Stripe[nstripes]){
+}
+
+shared_ptr<Param> PMServer::ParamShard::Find(int id) const{
+  const auto& params=stripes_[id%nstripes_].params;
+  auto it=params.find(id);
+  return it==params.end()?nullptr:it->second.param;
+}
+
+shared_ptr<Param> PMServer::ParamShard::Lookup(int id) const{
+  auto index=std::atomic_load(&index_);
+  if(index==nullptr)
+    return nullptr;
+  auto it=index->find(id);
+  return it==index->end()?nullptr:it->second;
+}
+
+void PMServer::ParamShard::Insert(int id, shared_ptr<Param> param){
+  stripes_[id%nstripes_].params[id].param=param;
+  std::lock_guard<std::mutex> lock(index_mutex_);
+  auto index=std::make_shared<std::map<int, shared_ptr<Param>>>();
+  if(index_!=nullptr)
+    *index=*index_;
+  (*index)[id]=param;
+  std::atomic_store(&index_,
+      shared_ptr<const std::map<int, shared_ptr<Param>>>(index));
+}
+
+void PMServer::ParamShard::Erase(int id){
+  stripes_[id%nstripes_].params[id].param.reset();
+  std::lock_guard<std::mutex> lock(index_mutex_);
+  if(index_==nullptr)
+    return;
+  auto index=std::make_shared<std::map<int, shared_ptr<Param>>>(*index_);
+  index->erase(id);
+  std::atomic_store(&index_,
+      shared_ptr<const std::map<int, shared_ptr<Param>>>(index));
+}
+
+int PMServer::ParamShard::Owner(int id) const{
+  const auto& params=stripes_[id%nstripes_].params;
+  auto it=params.find(id);
+  return it==params.end()?-1:it->second.owner;
+}
+
+void PMServer::ParamShard::SetOwner(int id, int server_id){
+  stripes_[id%nstripes_].params[id].owner=server_id;
+}
+
+uint64_t PMServer::ParamShard::TakeRequests(int id){
+  auto& params=stripes_[id%nstripes_].params;
+  auto it=params.find(id);
+  if(it==params.end())
+    return 0;
+  uint64_t n=it->second.nrequests;
+  it->second.nrequests=0;
+  return n;
+}
+
+
 void PMServer::Setup(int group_id, int server_id, shared_ptr<ParamShard> shard,
       const UpdaterProto& proto){
   group_id_=group_id;
   server_id_=server_id;
   shard_=shard;
+  param_type_=proto.param_type();
   updater_=shared_ptr<Updater>(Singleton<Factory<Updater>>::Instance()
       ->Create("Updater"));
   updater_->Init(proto);
 }
 
 PMServer::~PMServer(){
+  for(auto& entry: subscribers_)
+    for(Msg* addr: entry.second)
+      delete addr;
 }
 
-bool PMServer::SyncNow(){
-  return false;
-}
 Msg* PMServer::HandlePut(Msg **msg){
   int id=(*msg)->target();
-  shared_ptr<Param> param=nullptr;
-  if(shard_->find(id)!=shard_->end()){
+  auto lock=shard_->Lock(id);
+  shared_ptr<Param> param=shard_->Find(id);
+  if(param!=nullptr){
     LOG(ERROR)<<"Param ("<<id<<") is put more than once";
-    param=shard_->at(id);
   }else{
     param=shared_ptr<Param>(Singleton<Factory<Param>>::Instance()
-        ->Create("Param"));
+        ->Create(param_type_));
     param->set_id(id);
-    (*shard_)[id]=param;
+    shard_->Insert(id, param);
+    shard_->SetOwner(id, server_id_);
+    // params put to this server are synced with neighbor groups
+    std::lock_guard<std::mutex> base_lock(sync_base_mutex_);
+    sync_base_[id];
   }
-  return param->HandlePutMsg(msg);
+  Msg* response=param->HandlePutMsg(msg);
+  Snapshot(param);
+  return response;
+}
+
+bool PMServer::Forward(Msg* msg){
+  int owner=shard_->Owner(msg->target());
+  if(owner<0||owner==server_id_)
+    return false;
+  // the owner responds to the worker directly
+  msg->set_dst(group_id_, owner, kServer);
+  return true;
 }
 
 Msg* PMServer::HandleGet(Msg **msg){
   int id=(*msg)->target();
-  shared_ptr<Param> param=nullptr;
-  if(shard_->find(id)!=shard_->end()){
-    param=shard_->at(id);
-    return param->HandleGetMsg(msg);
+  auto lock=shard_->Lock(id);
+  if(Forward(*msg))
+    return *msg;
+  shard_->CountRequest(id);
+  shared_ptr<Param> param=shard_->Find(id);
+  if(param!=nullptr){
+    return param->HandleGetMsg(msg, 0, GetDeltaBase(param, *msg).get());
 	} else {
 		//re-construct msg to be re-queued.
 		//the calling function will send this message off
@@ -52,37 +140,200 @@ Msg* PMServer::HandleGet(Msg **msg){
 	}
 }
 
-Msg* PMServer::HandleUpdate(Msg **msg) {
+Msg* PMServer::HandleGetFromSnapshot(Msg **msg){
+  // Gets answered here are not counted in the loads for rebalancing
+  shared_ptr<Param> param=shard_->Lookup((*msg)->target());
+  if(param==nullptr)
+    return nullptr;
+  int version=(*msg)->version();
+  auto snapshot=param->GetSnapshot(version);
+  if(snapshot==nullptr)
+    snapshot=param->GetSnapshot();
+  if(snapshot==nullptr||snapshot->encoding!=(*msg)->encoding()
+      ||snapshot->version<version-staleness())
+    return nullptr;
+  MsgStats::Record(kStaleness, kGet, kServer,
+      std::max(0, version-snapshot->version));
+  return Param::HandleGetMsg(msg, snapshot);
+}
+
+void PMServer::Snapshot(shared_ptr<Param> param){
+  int capacity=Cluster::Get()->param_snapshots();
+  if(capacity>0)
+    param->TakeSnapshot(capacity);
+}
+
+shared_ptr<DeltaBase> PMServer::GetDeltaBase(shared_ptr<Param> param,
+    const Msg* request){
+  if(param->proto().response_codec()==ParamProto::kFullValues)
+    return nullptr;
+  DeltaKey key(request->src_group_id(), param->id());
+  std::lock_guard<std::mutex> lock(delta_mutex_);
+  auto it=delta_bases_.find(key);
+  shared_ptr<DeltaBase> base;
+  if(it!=delta_bases_.end()){
+    base=it->second.first;
+    delta_lru_.splice(delta_lru_.begin(), delta_lru_, it->second.second);
+  }else{
+    base=std::make_shared<DeltaBase>();
+    // allocated now to account for its memory
+    base->bytes.resize(EncodedBytes(param->delta_encoding(), param->size()));
+    delta_lru_.push_front(key);
+    delta_bases_[key]=std::make_pair(base, delta_lru_.begin());
+    delta_bytes_+=base->bytes.size();
+    size_t limit=static_cast<size_t>(Cluster::Get()->delta_base_mbytes())<<20;
+    while(delta_bytes_>limit&&delta_lru_.size()>1){
+      // the evicted base may still be used by the thread holding its param
+      auto& victim=delta_bases_.at(delta_lru_.back());
+      delta_bytes_-=victim.first->bytes.size();
+      delta_bases_.erase(delta_lru_.back());
+      delta_lru_.pop_back();
+    }
+  }
+  if(base->version!=request->base_version())
+    base->version=-1;
+  return base;
+}
+
+void PMServer::EraseDeltaBases(int id){
+  std::lock_guard<std::mutex> lock(delta_mutex_);
+  for(auto it=delta_bases_.begin();it!=delta_bases_.end();){
+    if(it->first.second==id){
+      delta_bytes_-=it->second.first->bytes.size();
+      delta_lru_.erase(it->second.second);
+      it=delta_bases_.erase(it);
+    }else{
+      ++it;
+    }
+  }
+}
+
+Msg* PMServer::HandleSubscribe(Msg **msg){
+  int id=(*msg)->target();
+  auto lock=shard_->Lock(id);
+  if(Forward(*msg))
+    return *msg;
+  shared_ptr<Param> param=shard_->Find(id);
+  if(param==nullptr)
+    return *msg;
+  std::unique_lock<std::mutex> sub_lock(subscribers_mutex_);
+  vector<Msg*>* subscribers=&subscribers_[id];
+  sub_lock.unlock();
+  bool found=false;
+  for(Msg* addr: *subscribers)
+    found|=addr->dst_group_id()==(*msg)->src_group_id()
+      &&addr->dst_id()==(*msg)->src_id()
+      &&addr->dst_flag()==(*msg)->src_flag();
+  if(!found){
+    Msg* addr=new Msg();
+    addr->SetAddr(*msg);
+    addr->SwapAddr();
+    subscribers->push_back(addr);
+  }
+  return param->HandleGetMsg(msg, 0, GetDeltaBase(param, *msg).get());
+}
+
+void PMServer::Publish(shared_ptr<Param> param, vector<Msg*>* responses){
+  int interval=Cluster::Get()->push_interval();
+  if(interval<=0||param->version()%interval)
+    return;
+  std::unique_lock<std::mutex> sub_lock(subscribers_mutex_);
+  auto it=subscribers_.find(param->id());
+  if(it==subscribers_.end())
+    return;
+  vector<Msg*>* subscribers=&it->second;
+  sub_lock.unlock();
+  size_t nresponses=responses->size();
+  for(Msg* addr: *subscribers){
+    bool answered=false;
+    for(size_t i=0;i<nresponses;i++)
+      answered|=(*responses)[i]->dst()==addr->dst()
+        &&(*responses)[i]->target()==param->id();
+    if(answered)
+      continue;
+    // the pushes share the (pinned) param data as their frames
+    Msg* push=param->GenUpdateResponseMsg();
+    push->set_type(kPush);
+    push->SetAddr(addr);
+    responses->push_back(push);
+  }
+}
+
+void PMServer::HandleUpdate(Msg **msg, vector<Msg*>* responses) {
   int id=(*msg)->target();
-  shared_ptr<Param> param=nullptr;
-  if(shard_->find(id)!=shard_->end()){
+  auto lock=shard_->Lock(id);
+  if(Forward(*msg)){
+    responses->push_back(*msg);
+    return;
+  }
+  shard_->CountRequest(id);
+  shared_ptr<Param> param=shard_->Find(id);
+  if(param!=nullptr){
 		//repsonse of the format: <identity><type: kData><paramId><param content>
-    param=shard_->at(id);
-    Msg* tmp=static_cast<Msg*>((*msg)->CopyAddr());
+    // only the addresses are kept, no need to allocate it from heap
+    Msg addr;
+    addr.SetAddr(*msg);
+    addr.set_base_version((*msg)->base_version());
     param->ParseUpdateMsg(msg);
     updater_->Update(param->version(), param);
     param->set_version(param->version()+1);
-    auto response=param->GenUpdateResponseMsg();
-    tmp->SwapAddr();
-    response->SetAddr(tmp);
-    delete tmp;
-    return response;
+    Snapshot(param);
+    auto response=param->GenUpdateResponseMsg(
+        GetDeltaBase(param, &addr).get());
+    addr.SwapAddr();
+    response->SetAddr(&addr);
+    responses->push_back(response);
+    Publish(param, responses);
 	} else {
     LOG(ERROR)<<"Param ("<<id<<") is not maintained by server ("<<group_id_
       <<", "<<server_id_<<")";
 		//re-construct msg to be re-queued.
-		return *msg;
+		responses->push_back(*msg);
 	}
 }
 
 Msg* PMServer::HandleSyncRequest(Msg **msg){
   int id=(*msg)->target();
-  shared_ptr<Param> param=nullptr;
-  if(shard_->find(id)!=shard_->end()){
+  auto lock=shard_->Lock(id);
+  if(Forward(*msg))
+    return *msg;
+  shared_ptr<Param> param=shard_->Find(id);
+  if(param!=nullptr&&(*msg)->src_flag()==kServer){
+    // changes from a neighbor group are also added to the base, hence they
+    // are not included in the changes sent by this server
+    CHECK_EQ((*msg)->frame_size(), sizeof(float)*param->size());
+    auto shape=mshadow::Shape1(param->size());
+    mshadow::Tensor<mshadow::cpu,1> delta(
+        static_cast<float*>((*msg)->frame_data()), shape);
+    mshadow::Tensor<mshadow::cpu,1> data(param->mutable_cpu_data(), shape);
+    data+=delta;
+    std::unique_lock<std::mutex> base_lock(sync_base_mutex_);
+    auto it=sync_base_.find(id);
+    base_lock.unlock();
+    if(it!=sync_base_.end()){
+      mshadow::Tensor<mshadow::cpu,1> base(it->second.data(), shape);
+      base+=delta;
+    }
+    Snapshot(param);
+    delete *msg;
+    *msg=nullptr;
+    return nullptr;
+  }
+  if(param!=nullptr){
 		//repsonse of the format: <identity><type: kData><paramId><param content>
-    param=shard_->at(id);
-    return param->HandleSyncMsg(msg);
-	} else {
+    Msg* response=param->HandleSyncMsg(msg);
+    Snapshot(param);
+    return response;
+	} else if((*msg)->src_flag()==kServer){
+    // the param is not placed in this group as in the sender's, returning
+    // the msg would bounce it through the stub
+    LOG(ERROR)<<"Drop sync of param ("<<id<<") from server group "
+      <<(*msg)->src_group_id()<<", not held by server ("<<group_id_<<", "
+      <<server_id_<<")";
+    delete *msg;
+    *msg=nullptr;
+    return nullptr;
+  } else {
 		//re-construct msg to be re-queued.
     return *msg;
 	}
@@ -90,10 +341,425 @@ Msg* PMServer::HandleSyncRequest(Msg **msg){
 
 int PMServer::HandleSyncResponse(Msg **msg){
   int id=(*msg)->target();
-  CHECK(shard_->find(id)!=shard_->end());
-  return shard_->at(id)->ParseSyncResponseMsg(msg);
+  auto lock=shard_->Lock(id);
+  shared_ptr<Param> param=shard_->Find(id);
+  CHECK(param!=nullptr);
+  return param->ParseSyncResponseMsg(msg);
 }
 
+void PMServer::GenSyncMsgs(const vector<int>& neighbors,
+    vector<Msg*>* msgs){
+  vector<int> ids;
+  {
+    std::lock_guard<std::mutex> base_lock(sync_base_mutex_);
+    for(auto& entry: sync_base_)
+      ids.push_back(entry.first);
+  }
+  for(int id: ids){
+    auto lock=shard_->Lock(id);
+    shared_ptr<Param> param=shard_->Find(id);
+    // moved to another server after the ids are copied
+    if(param==nullptr||shard_->Owner(id)!=server_id_)
+      continue;
+    int n=param->size();
+    std::unique_lock<std::mutex> base_lock(sync_base_mutex_);
+    vector<float>* base=&sync_base_[id];
+    base_lock.unlock();
+    const float* dptr=param->data().cpu_data();
+    if(base->empty()){
+      // changes are counted from the first call
+      base->assign(dptr, dptr+n);
+      continue;
+    }
+    sync_buf_.resize(n);
+    auto shape=mshadow::Shape1(n);
+    mshadow::Tensor<mshadow::cpu,1> delta(sync_buf_.data(), shape);
+    mshadow::Tensor<mshadow::cpu,1> base_t(base->data(), shape);
+    mshadow::Tensor<mshadow::cpu,1> data(const_cast<float*>(dptr), shape);
+    delta=data-base_t;
+    memcpy(base->data(), dptr, sizeof(float)*n);
+    auto cluster=Cluster::Get();
+    auto placement=Singleton<ParamPlacement>::Instance();
+    for(int group: neighbors){
+      Msg* msg=new Msg();
+      msg->set_src(group_id_, server_id_, kServer);
+      // params may be owned by different servers in the neighbor group,
+      // e.g., after migrations; a stale owner forwards the msg
+      msg->set_dst(group, placement->Server(id, cluster->nservers_per_group(),
+            group), kServer);
+      msg->set_type(kSyncRequest);
+      msg->set_target(id);
+      msg->set_version(param->version());
+      msg->set_size(n);
+      msg->add_frame(sync_buf_.data(), sizeof(float)*n);
+      msgs->push_back(msg);
+    }
+  }
+}
+
+Msg* PMServer::GenLoadMsg(double secs){
+  vector<int> ids;
+  {
+    std::lock_guard<std::mutex> base_lock(sync_base_mutex_);
+    for(auto& entry: sync_base_)
+      ids.push_back(entry.first);
+  }
+  vector<int> owned;
+  vector<float> loads;
+  for(int id: ids){
+    auto lock=shard_->Lock(id);
+    shared_ptr<Param> param=shard_->Find(id);
+    if(param==nullptr||shard_->Owner(id)!=server_id_)
+      continue;
+    // bytes of one Get and one Update
+    double bytes=ParamPlacement::Load(param).bytes/2;
+    owned.push_back(id);
+    loads.push_back(shard_->TakeRequests(id)*bytes/std::max(secs, 1e-3));
+  }
+  Msg* msg=new Msg();
+  msg->set_src(group_id_, server_id_, kServer);
+  msg->set_dst(group_id_, 0, kServer);
+  msg->set_type(kLoad);
+  msg->set_size(owned.size());
+  if(owned.size()){
+    msg->add_frame(owned.data(), sizeof(int)*owned.size());
+    msg->add_frame(loads.data(), sizeof(float)*loads.size());
+  }
+  return msg;
+}
+
+void PMServer::HandleLoad(Msg** msg, vector<Msg*>* responses){
+  auto& report=loads_[(*msg)->src_id()];
+  report.clear();
+  int n=(*msg)->size();
+  if(n>0){
+    CHECK_EQ((*msg)->frame_size(), sizeof(int)*n);
+    const int* ids=static_cast<int*>((*msg)->frame_data());
+    CHECK((*msg)->next_frame());
+    CHECK_EQ((*msg)->frame_size(), sizeof(float)*n);
+    const float* loads=static_cast<float*>((*msg)->frame_data());
+    for(int i=0;i<n;i++)
+      report.push_back(std::make_pair(ids[i], loads[i]));
+  }
+  delete *msg;
+  *msg=nullptr;
+  if(static_cast<int>(loads_.size())<Cluster::Get()->nservers_per_group())
+    return;
+  Msg* migrate=Rebalance();
+  if(migrate!=nullptr)
+    responses->push_back(migrate);
+  loads_.clear();
+}
+
+Msg* PMServer::Rebalance(){
+  std::map<int, double> totals;
+  double sum=0;
+  for(auto& report: loads_){
+    double& total=totals[report.first];
+    for(auto& load: report.second)
+      total+=load.second;
+    sum+=total;
+  }
+  auto cmp=[](const std::pair<const int, double>& a,
+      const std::pair<const int, double>& b){return a.second<b.second;};
+  auto hot=std::max_element(totals.begin(), totals.end(), cmp);
+  auto cold=std::min_element(totals.begin(), totals.end(), cmp);
+  double mean=sum/totals.size();
+  if(hot->first==cold->first
+      ||hot->second<=Cluster::Get()->rebalance_threshold()*mean)
+    return nullptr;
+  // the param closest to half of the gap reduces the max load the most
+  // without making the cold server the hottest one
+  double gap=hot->second-cold->second;
+  int id=-1;
+  double best=gap;
+  for(auto& load: loads_[hot->first]){
+    if(load.second>0&&load.second<gap&&fabs(load.second-gap/2)<best){
+      id=load.first;
+      best=fabs(load.second-gap/2);
+    }
+  }
+  if(id<0)
+    return nullptr;
+  LOG(ERROR)<<"Move param ("<<id<<") of group "<<group_id_<<" from server "
+    <<hot->first<<" ("<<hot->second<<" bytes/sec) to server "<<cold->first
+    <<" ("<<cold->second<<" bytes/sec)";
+  int to=cold->first;
+  Msg* msg=new Msg();
+  msg->set_src(group_id_, server_id_, kServer);
+  msg->set_dst(group_id_, hot->first, kServer);
+  msg->set_type(kMigrate);
+  msg->set_target(id);
+  msg->add_frame(&to, sizeof(int));
+  return msg;
+}
+
+void PMServer::HandleMigrate(Msg** msg, vector<Msg*>* responses){
+  int id=(*msg)->target();
+  CHECK_EQ((*msg)->frame_size(), sizeof(int));
+  int to=*static_cast<int*>((*msg)->frame_data());
+  delete *msg;
+  *msg=nullptr;
+  auto lock=shard_->Lock(id);
+  shared_ptr<Param> param=shard_->Find(id);
+  if(param==nullptr||shard_->Owner(id)!=server_id_||to==server_id_){
+    LOG(WARNING)<<"Param ("<<id<<") cannot be moved from server ("
+      <<group_id_<<", "<<server_id_<<") to server "<<to;
+    return;
+  }
+  auto cluster=Cluster::Get();
+  Msg* data=nullptr;
+  if(ProcsIDOf(group_id_, to, kServer)==cluster->procs_id()){
+    // the new server shares the ParamShard, only the ownership moves
+    data=new Msg();
+    data->set_type(kMigrateData);
+  }else{
+    data=param->GenMigrateMsg();
+    shard_->Erase(id);
+  }
+  shard_->SetOwner(id, to);
+  {
+    std::lock_guard<std::mutex> base_lock(sync_base_mutex_);
+    sync_base_.erase(id);
+  }
+  EraseDeltaBases(id);
+  data->set_src(group_id_, server_id_, kServer);
+  data->set_dst(group_id_, to, kServer);
+  data->set_target(id);
+  responses->push_back(data);
+  // subscriptions are renewed at the new server on behalf of the workers,
+  // which arrive after the data
+  std::lock_guard<std::mutex> sub_lock(subscribers_mutex_);
+  auto it=subscribers_.find(id);
+  if(it==subscribers_.end())
+    return;
+  for(Msg* addr: it->second){
+    Msg* subscribe=new Msg();
+    subscribe->SetAddr(addr);
+    subscribe->SwapAddr();
+    subscribe->set_dst(group_id_, to, kServer);
+    subscribe->set_type(kSubscribe);
+    subscribe->set_target(id);
+    subscribe->set_version(param->version());
+    subscribe->set_encoding(param->proto().wire_encoding());
+    responses->push_back(subscribe);
+    delete addr;
+  }
+  subscribers_.erase(it);
+}
+
+void PMServer::HandleMigrateData(Msg** msg, vector<Msg*>* responses){
+  int id=(*msg)->target();
+  auto lock=shard_->Lock(id);
+  if((*msg)->size()>0){
+    auto param=shared_ptr<Param>(Singleton<Factory<Param>>::Instance()
+        ->Create(param_type_));
+    param->set_id(id);
+    param->HandleMigrateMsg(msg);
+    Snapshot(param);
+    shard_->Insert(id, param);
+  }else{
+    CHECK(shard_->Find(id)!=nullptr);
+    delete *msg;
+    *msg=nullptr;
+  }
+  shard_->SetOwner(id, server_id_);
+  {
+    // changes are synced with neighbor groups from now on
+    std::lock_guard<std::mutex> base_lock(sync_base_mutex_);
+    sync_base_[id].clear();
+  }
+  auto cluster=Cluster::Get();
+  // servers of neighbor groups route syncs by the placement as well
+  for(int procs_id=0;procs_id<cluster->nprocs();procs_id++){
+    Msg* route=new Msg();
+    route->set_src(group_id_, server_id_, kServer);
+    route->set_dst(procs_id, kStub);
+    route->set_type(kRoute);
+    route->set_target(id);
+    responses->push_back(route);
+  }
+}
+
+/***************************SyncPMServer*************************************/
+SyncPMServer::Round* SyncPMServer::GetRound(int id){
+  // std::map does not move its elements on insertion
+  std::lock_guard<std::mutex> lock(rounds_mutex_);
+  return &rounds_[id];
+}
+
+void SyncPMServer::HandleUpdate(Msg **msg, vector<Msg*>* responses) {
+  int id=(*msg)->target();
+  auto lock=shard_->Lock(id);
+  shared_ptr<Param> param=shard_->Find(id);
+  if(param==nullptr){
+    LOG(ERROR)<<"Param ("<<id<<") is not maintained by server ("<<group_id_
+      <<", "<<server_id_<<")";
+    responses->push_back(*msg);
+    return;
+  }
+  Round* round=GetRound(id);
+  int version=(*msg)->version();
+  if(version>param->version()){
+    // e.g., the update of a faster group arrives before that of the last
+    // round from a slower one is applied
+    round->early.push_back(*msg);
+    *msg=nullptr;
+    return;
+  }
+  if(version<param->version()){
+    LOG(WARNING)<<"Reject the update of param "<<id<<" for version "<<version
+      <<" from group "<<(*msg)->src_group_id()<<", the param is of version "
+      <<param->version();
+    Msg* addr=new Msg();
+    addr->SetAddr(*msg);
+    addr->set_base_version((*msg)->base_version());
+    delete *msg;
+    *msg=nullptr;
+    auto response=param->GenUpdateResponseMsg(
+        GetDeltaBase(param, addr).get());
+    addr->SwapAddr();
+    response->SetAddr(addr);
+    responses->push_back(response);
+    delete addr;
+    return;
+  }
+  Apply(param, round, msg, responses);
+  // the round is completed if the version advances
+  while(!round->early.empty()&&round->nupdates==0){
+    auto it=std::find_if(round->early.begin(), round->early.end(),
+        [&param](Msg* early){return early->version()==param->version();});
+    if(it==round->early.end())
+      break;
+    Msg* early=*it;
+    round->early.erase(it);
+    Apply(param, round, &early, responses);
+  }
+}
+
+void SyncPMServer::Apply(shared_ptr<Param> param, Round* round, Msg** msg,
+    vector<Msg*>* responses){
+  Msg* addr=new Msg();
+  addr->SetAddr(*msg);
+  addr->set_base_version((*msg)->base_version());
+  round->requests.push_back(addr);
+  param->ParseUpdateMsg(msg);
+  auto shape=mshadow::Shape1(param->size());
+  mshadow::Tensor<mshadow::cpu,1> grad(param->mutable_cpu_grad(), shape);
+  if(round->nupdates==0){
+    round->grad.resize(param->size());
+    memcpy(round->grad.data(), grad.dptr, sizeof(float)*param->size());
+  }else{
+    mshadow::Tensor<mshadow::cpu,1> sum(round->grad.data(), shape);
+    sum+=grad;
+  }
+  int ngroups=Cluster::Get()->nworker_groups_per_server_group();
+  if(++round->nupdates<ngroups)
+    return;
+  mshadow::Tensor<mshadow::cpu,1> sum(round->grad.data(), shape);
+  grad=sum*(1.0f/ngroups);
+  updater_->Update(param->version(), param);
+  param->set_version(param->version()+1);
+  Snapshot(param);
+  // the responses share the (pinned) param data as their frames
+  for(Msg* addr: round->requests){
+    auto response=param->GenUpdateResponseMsg(
+        GetDeltaBase(param, addr).get());
+    addr->SwapAddr();
+    response->SetAddr(addr);
+    responses->push_back(response);
+    delete addr;
+  }
+  round->requests.clear();
+  round->nupdates=0;
+  Publish(param, responses);
+}
+
+/***************************SSPPMServer**************************************/
+SSPPMServer::Clocks* SSPPMServer::GetClocks(shared_ptr<Param> param){
+  std::lock_guard<std::mutex> lock(clocks_mutex_);
+  Clocks* clocks=&clocks_[param->id()];
+  if(clocks->clocks.empty())
+    clocks->clocks.resize(Cluster::Get()->nworker_groups_per_server_group(),
+        param->version());
+  return clocks;
+}
+
+Msg* SSPPMServer::Respond(shared_ptr<Param> param, Msg* msg){
+  int version=msg->version();
+  MsgStats::Record(kStaleness, msg->type(), kServer,
+      std::max(0, version-param->version()));
+  auto base=GetDeltaBase(param, msg);
+  if(msg->type()==kGet)
+    return param->HandleGetMsg(&msg, staleness_, base.get());
+  // the worker reads the current data as the requested version
+  auto response=param->GenUpdateResponseMsg(base.get());
+  response->set_version(version);
+  msg->SwapAddr();
+  response->SetAddr(msg);
+  delete msg;
+  return response;
+}
+
+Msg* SSPPMServer::HandleGet(Msg **msg){
+  int id=(*msg)->target();
+  auto lock=shard_->Lock(id);
+  shared_ptr<Param> param=shard_->Find(id);
+  if(param==nullptr)
+    return *msg;
+  if(Ready(param, (*msg)->version()))
+    return Respond(param, *msg);
+  GetClocks(param)->deferred.push_back(*msg);
+  *msg=nullptr;
+  return nullptr;
+}
+
+void SSPPMServer::HandleUpdate(Msg **msg, vector<Msg*>* responses) {
+  int id=(*msg)->target();
+  auto lock=shard_->Lock(id);
+  shared_ptr<Param> param=shard_->Find(id);
+  if(param==nullptr){
+    LOG(ERROR)<<"Param ("<<id<<") is not maintained by server ("<<group_id_
+      <<", "<<server_id_<<")";
+    responses->push_back(*msg);
+    return;
+  }
+  Clocks* clocks=GetClocks(param);
+  int ngroups=clocks->clocks.size();
+  int next=(*msg)->version()+1;
+  clocks->clocks[(*msg)->src_group_id()%ngroups]=next;
+  // only the addresses are kept for the response
+  Msg* addr=new Msg();
+  addr->SetAddr(*msg);
+  addr->set_type(kUpdate);
+  addr->set_version(next);
+  addr->set_base_version((*msg)->base_version());
+  int step=(*msg)->version();
+  param->ParseUpdateMsg(msg, staleness_);
+  updater_->Update(step, param);
+  int version=*std::min_element(clocks->clocks.begin(), clocks->clocks.end());
+  bool advanced=version>param->version();
+  if(advanced){
+    param->set_version(version);
+    Snapshot(param);
+    // release the deferred requests of the new version
+    auto& deferred=clocks->deferred;
+    size_t k=0;
+    for(Msg* request: deferred){
+      if(Ready(param, request->version()))
+        responses->push_back(Respond(param, request));
+      else
+        deferred[k++]=request;
+    }
+    deferred.resize(k);
+  }
+  if(Ready(param, next))
+    responses->push_back(Respond(param, addr));
+  else
+    clocks->deferred.push_back(addr);
+  if(advanced)
+    Publish(param, responses);
+}
 } // namespace singa
 
 
@@ -7,6 +7,8 @@
 #include "trainer/pm_worker.h"
 #include "mshadow/tensor.h"
 #include "utils/cluster.h"
+#include "utils/placement.h"
+#include "utils/singleton.h"
 
 
 namespace singa{
@@ -17,8 +19,11 @@ void PMWorker::Setup(int group_id, int worker_id,
   worker_id_=worker_id;
   shard_=shard;
 }
-int PMWorker::Sharding(int param_id){
-  return param_id%Cluster::Get()->nservers_per_group();
+int PMWorker::Sharding(int target){
+  auto cluster=Cluster::Get();
+  return Singleton<ParamPlacement>::Instance()->Server(target,
+      cluster->nservers_per_group(),
+      group_id_/cluster->nworker_groups_per_server_group());
 }
 /*
 int PMWorker::Sharding(int param_id){
@@ -42,26 +47,28 @@ Msg* PMWorker::Put(Msg** msg){
   return *msg;
 }
 
-Msg* PMWorker::Put(shared_ptr<Param> param, int step){
+void PMWorker::Put(shared_ptr<Param> param, int step, vector<Msg*>* msgs){
   param->set_version(step);
   // only owner can put shared parameter
   if(param->owner()<0||param->owner()==param->id()){
-    Msg* msg= param->GenPutMsg(&step);
-    msg->set_src(group_id_, worker_id_, kWorkerParam);
-    msg->set_dst(group_id_/Cluster::Get()->nworker_groups_per_server_group(),
-        Sharding(param->id()), kServer);
-    msg->set_type(kPut);
-    msg->set_target(param->id());
-    return msg;
-  }else
-    return nullptr;
+    for(int k=0;k<param->nslices();k++){
+      int target=SliceTarget(param->id(), k);
+      Msg* msg= param->GenPutMsg(&step, k);
+      msg->set_src(group_id_, worker_id_, kWorkerParam);
+      msg->set_dst(group_id_/Cluster::Get()->nworker_groups_per_server_group(),
+          Sharding(target), kServer);
+      msg->set_type(kPut);
+      msg->set_target(target);
+      msgs->push_back(msg);
+    }
+  }
 }
 
 Msg* PMWorker::Get(Msg** msg){
   return *msg;
 }
 
-Msg* PMWorker::Get(shared_ptr<Param> param, int step){
+void PMWorker::Get(shared_ptr<Param> param, int step, vector<Msg*>* msgs){
   param->set_version(step);
   bool send=false;
   int id=param->id();
@@ -72,27 +79,52 @@ Msg* PMWorker::Get(shared_ptr<Param> param, int step){
     send=entry->nGet/entry->nLocal==step;
   }
   if(param->owner()<0||send){
-    Msg* msg=nullptr;
-    if(param->owner()<0){
-      msg=param->GenGetMsg(&step);
-      msg->set_dst(group_id_/Cluster::Get()->nworker_groups_per_server_group(),
-          Sharding(id), kServer);
-    } else {
-      msg=entry->param->GenGetMsg(&step);
-      msg->set_dst(entry->owner_procs,kStub);
+    // one request per slice, answered by the servers in parallel
+    for(int k=0;k<param->nslices();k++){
+      int target=SliceTarget(id, k);
+      Msg* msg=nullptr;
+      if(param->owner()<0){
+        msg=param->GenGetMsg(&step);
+        msg->set_dst(group_id_
+            /Cluster::Get()->nworker_groups_per_server_group(),
+            Sharding(target), kServer);
+      } else {
+        msg=entry->param->GenGetMsg(&step);
+        msg->set_dst(entry->owner_procs,kStub);
+      }
+      msg->set_src(group_id_, worker_id_, kWorkerParam);
+      msg->set_type(kGet);
+      msg->set_target(target);
+      // the response is delta encoded against the values held by the
+      // param receiving it, see ParamProto response_codec
+      msg->set_base_version(shard_->at(id)->param->delta_version(k));
+      msgs->push_back(msg);
     }
+  }
+}
+
+void PMWorker::Subscribe(shared_ptr<Param> param, int step,
+    vector<Msg*>* msgs){
+  param->set_version(step);
+  int id=param->id();
+  for(int k=0;k<param->nslices();k++){
+    int target=SliceTarget(id, k);
+    Msg* msg=param->GenGetMsg(&step);
+    msg->set_dst(group_id_/Cluster::Get()->nworker_groups_per_server_group(),
+        Sharding(target), kServer);
     msg->set_src(group_id_, worker_id_, kWorkerParam);
-    msg->set_type(kGet);
-    msg->set_target(id);
-    return msg;
-  }else
-    return nullptr;
+    msg->set_type(kSubscribe);
+    msg->set_target(target);
+    msg->set_base_version(shard_->at(id)->param->delta_version(k));
+    msgs->push_back(msg);
+  }
 }
 
 Msg* PMWorker::Update(Msg** msg){
   return *msg;
 }
-Msg* PMWorker::Update(shared_ptr<Param> param, int step){
+void PMWorker::Update(shared_ptr<Param> param, int step,
+    vector<Msg*>* msgs){
   param->set_version(step);
   bool send=false;
   int id=param->id();
@@ -107,39 +139,77 @@ Msg* PMWorker::Update(shared_ptr<Param> param, int step){
     agg+=grad;
   }
   if(param->owner()<0||send){
-    Msg* msg=nullptr;
-    if(param->owner()<0){
-      msg=param->GenUpdateMsg(&step);
-      msg->set_dst(group_id_/Cluster::Get()->nworker_groups_per_server_group(),
-          Sharding(id), kServer);
-    } else {
-      entry->param->GenUpdateMsg(&step);
-      msg->set_dst(entry->owner_procs,kStub);
-      memset(param->mutable_cpu_data(), 0, sizeof(float)*param->size());
+    for(int k=0;k<param->nslices();k++){
+      int target=SliceTarget(id, k);
+      Msg* msg=nullptr;
+      if(param->owner()<0){
+        msg=param->GenUpdateMsg(&step, k);
+        msg->set_dst(group_id_
+            /Cluster::Get()->nworker_groups_per_server_group(),
+            Sharding(target), kServer);
+      } else {
+        msg=entry->param->GenUpdateMsg(&step, k);
+        msg->set_dst(entry->owner_procs,kStub);
+      }
+      msg->set_type(kUpdate);
+      msg->set_target(target);
+      msg->set_src(group_id_, worker_id_, kWorkerParam);
+      msg->set_base_version(shard_->at(id)->param->delta_version(k));
+      msgs->push_back(msg);
     }
-    msg->set_type(kUpdate);
-    msg->set_target(id);
-    msg->set_src(group_id_, worker_id_, kWorkerParam);
-    return msg;
-  }else
+    if(param->owner()>=0)
+      memset(param->mutable_cpu_data(), 0, sizeof(float)*param->size());
+  }
+}
+
+Msg* PMWorker::Sync(shared_ptr<Param> param, int step, void* arg){
+  // params sharing the data of others are synced by their owners
+  if(param->owner()>=0&&param->owner()!=param->id())
     return nullptr;
+  param->set_version(step);
+  Msg* msg=param->GenSyncMsg(arg);
+  msg->set_src(group_id_, worker_id_, kWorkerParam);
+  msg->set_dst(group_id_/Cluster::Get()->nworker_groups_per_server_group(),
+      Sharding(param->id()), kServer);
+  return msg;
 }
 
 Msg* PMWorker::Collect(Msg** msg){
-  int id=(*msg)->target();
+  int id=ParamOfTarget((*msg)->target());
   int type=(*msg)->type();
   auto pp=shard_->at(id)->param;
+  int parsed=1;
   if(type==kRGet){
-    pp->ParseGetResponseMsg(msg);
+    parsed=pp->ParseGetResponseMsg(msg);
+  }else if(type==kPush){
+    // pushes may be overtaken by the response to an update of this worker
+    if((*msg)->version()>=pp->version())
+      parsed=pp->ParseGetResponseMsg(msg);
   }else if(type==kRUpdate){
-    pp->ParseUpdateResponseMsg(msg);
+    parsed=pp->ParseUpdateResponseMsg(msg);
+  }else if(type==kSyncResponse){
+    pp->ParseSyncResponseMsg(msg);
   }
   if(pp->owner()>=0){
     // forwarding to workers on other procs
   }
+  Msg* request=nullptr;
+  if(!parsed){
+    // the delta was dropped, hence get the full values of the same version,
+    // the version of the param advances once they arrive
+    int target=(*msg)->target(), version=(*msg)->version();
+    request=pp->GenGetMsg(&version);
+    request->set_src(group_id_, worker_id_, kWorkerParam);
+    request->set_dst(group_id_
+        /Cluster::Get()->nworker_groups_per_server_group(),
+        Sharding(target), kServer);
+    request->set_type(kGet);
+    request->set_target(target);
+    request->set_base_version(-1);
+  }
   delete (*msg);
   *msg=nullptr;
-  return nullptr;
+  return request;
 }
 
 /*
@@ -1,16 +1,21 @@
+#include <algorithm>
 #include <list>
 #include <tuple>
 #include <queue>
+#include <string>
+#include <thread>
 #include "trainer/server.h"
 #include "utils/param.h"
 #include "utils/singleton.h"
 #include "utils/factory.h"
 #include "utils/cluster.h"
+#include "communication/msg_stats.h"
 
 
 namespace singa {
 Server::Server(int group_id, int server_id):
-  group_id_(group_id), server_id_(server_id){}
+  group_id_(group_id), server_id_(server_id), nthreads_(1), stop_(false),
+  nupdates_(0), last_nupdates_(0){}
 
 void Server::Setup(const UpdaterProto& proto,
     shared_ptr<PMServer::ParamShard> shard,
@@ -27,42 +32,265 @@ void Server::Run(){
   ping->set_src(group_id_, server_id_, kServer);
   ping->set_dst(0,0,kStub);
   ping->set_type(kConnect);
-  dealer_->Send(ping);
-  int timeout=Cluster::Get()->server_timeout();
+  // register at every stub thread, which may forward requests to this server
+  dealer_->Broadcast(ping);
+  auto cluster=Cluster::Get();
+  int timeout=cluster->server_timeout();
   Poller poller;
   poller.Add(dealer_.get());
+  if(cluster->direct_server_access()){
+    router_=std::make_shared<Router>(cluster->router_bufsize());
+    router_->Bind(cluster->server_endpoint(group_id_, server_id_,
+          cluster->procs_id()));
+    if(cluster->nprocs()>1)
+      router_->Bind("tcp://*:"
+          +std::to_string(cluster->server_port(group_id_, server_id_)));
+    poller.Add(router_.get());
+  }
+  nthreads_=std::max(1, cluster->server_threads());
+  vector<std::thread> threads;
+  const ServerTopology* topology=cluster->server_topology(group_id_);
+  bool gossip=topology!=nullptr&&topology->sync_interval()>0
+    &&topology->neighbor_size()>0;
+  if(nthreads_>1||gossip){
+    // bound before the server threads connect to it
+    notifier_=std::make_shared<Router>();
+    notifier_->Bind("inproc://server-notifier-"+std::to_string(group_id_)
+        +"-"+std::to_string(server_id_));
+    poller.Add(notifier_.get());
+  }
+  if(nthreads_>1){
+    for(int i=0;i<nthreads_;i++){
+      queues_.push_back(std::unique_ptr<RequestQueue>(new RequestQueue()));
+      threads.push_back(std::thread(&Server::HandleRequests, this, i));
+    }
+  }
+  stop_=false;
+  std::thread gossip_thread;
+  if(gossip)
+    gossip_thread=std::thread(&Server::Gossip, this, *topology);
+  last_report_=std::chrono::steady_clock::now();
+  last_load_report_=last_report_;
+  // wake up to report loads even if there are no requests
+  int rebalance=cluster->rebalance_interval();
+  bool snapshots=cluster->param_snapshots()>0;
+  vector<Msg*> responses;
 	//start recv loop and process requests
   while (true){
-    Msg* msg=dealer_->Receive();
-    if (msg==nullptr)
-      break;
-    Msg* response=nullptr;
-    int type=msg->type();
-    switch (type){
-      case kPut:
-        response = pmserver_->HandlePut(&msg);
-        break;
-      case kGet:
-        response = pmserver_->HandleGet(&msg);
+    // requests from the stub and direct connections are answered through
+    // the socket they came from
+    Socket* sock=dealer_.get();
+    if(router_!=nullptr||notifier_!=nullptr||rebalance>0){
+      sock=poller.Wait(rebalance>0?rebalance*1000:-1);
+      if(sock==nullptr&&(rebalance==0||poller.Terminated()))
         break;
-      case kUpdate:
-        response = pmserver_->HandleUpdate(&msg);
-        break;
-      case kSyncRequest:
-        VLOG(3)<<"Handle SYNC-REQUEST";
-        response = pmserver_->HandleSyncRequest(&msg);
-        break;
-      case kSyncResponse:
-        VLOG(3) << "Handle SYNC response";
-        pmserver_->HandleSyncResponse(&msg);
+    }
+    if(sock!=nullptr){
+      Msg* msg=sock->Receive();
+      if (msg==nullptr)
         break;
+      if(sock!=notifier_.get()&&msg->src_flag()==kWorkerParam)
+        reply_socks_[msg->src()]=sock;
+      Msg* response=nullptr;
+      if(snapshots&&sock!=notifier_.get()&&msg->type()==kGet){
+        // answered without waiting for updates of the param
+        int64_t start=NowMicros();
+        response=pmserver_->HandleGetFromSnapshot(&msg);
+        if(response!=nullptr)
+          MsgStats::Record(kServiceTime, kGet, kServer, NowMicros()-start);
+      }
+      if(response!=nullptr){
+        SocketFor(response, sock)->Send(response);
+      }else if(sock==notifier_.get()){
+        delete msg;
+        SendResponses();
+      }else if(nthreads_>1){
+        Dispatch(msg, sock);
+      }else{
+        HandleRequest(msg, &responses);
+        for(Msg* response: responses)
+          SocketFor(response, sock)->Send(response);
+        responses.clear();
+      }
+    }
+    ReportThroughput();
+    if(rebalance>0)
+      ReportLoad();
+  }
+  for(auto& queue: queues_){
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    queue->requests.push(Request(nullptr, nullptr));
+    queue->cv.notify_one();
+  }
+  for(auto& thread: threads)
+    thread.join();
+  if(gossip_thread.joinable()){
+    {
+      std::lock_guard<std::mutex> lock(stop_mutex_);
+      stop_=true;
     }
+    stop_cv_.notify_one();
+    gossip_thread.join();
+  }
+  for(auto& response: outbox_)
+    delete response.first;
+}
 
-    if (response!=nullptr)
-      dealer_->Send(response);
+void Server::HandleRequest(Msg* msg, vector<Msg*>* responses){
+  Msg* response=nullptr;
+  int type=msg->type();
+  int64_t start=NowMicros();
+  switch (type){
+    case kPut:
+      response = pmserver_->HandlePut(&msg);
+      break;
+    case kGet:
+      response = pmserver_->HandleGet(&msg);
+      break;
+    case kSubscribe:
+      response = pmserver_->HandleSubscribe(&msg);
+      break;
+    case kUpdate:
+      pmserver_->HandleUpdate(&msg, responses);
+      nupdates_.fetch_add(1, std::memory_order_relaxed);
+      break;
+    case kSyncRequest:
+      VLOG(3)<<"Handle SYNC-REQUEST";
+      response = pmserver_->HandleSyncRequest(&msg);
+      break;
+    case kSyncResponse:
+      VLOG(3) << "Handle SYNC response";
+      pmserver_->HandleSyncResponse(&msg);
+      break;
+    case kLoad:
+      pmserver_->HandleLoad(&msg, responses);
+      break;
+    case kMigrate:
+      pmserver_->HandleMigrate(&msg, responses);
+      break;
+    case kMigrateData:
+      pmserver_->HandleMigrateData(&msg, responses);
+      break;
   }
+  MsgStats::Record(kServiceTime, type, kServer, NowMicros()-start);
+  if(response!=nullptr)
+    responses->push_back(response);
 }
 
+void Server::Dispatch(Msg* msg, Socket* sock){
+  // requests of one param go to the same thread to keep their order
+  RequestQueue* queue=queues_[msg->target()%nthreads_].get();
+  {
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    queue->requests.push(std::make_pair(msg, sock));
+  }
+  queue->cv.notify_one();
+}
+
+void Server::HandleRequests(int i){
+  // notifies the receiving thread, which only reads the outbox on wakeup
+  Dealer notifier;
+  notifier.Connect("inproc://server-notifier-"+std::to_string(group_id_)
+      +"-"+std::to_string(server_id_));
+  RequestQueue* queue=queues_[i].get();
+  vector<Msg*> responses;
+  while(true){
+    Request request;
+    {
+      std::unique_lock<std::mutex> lock(queue->mutex);
+      queue->cv.wait(lock, [queue]{return !queue->requests.empty();});
+      request=queue->requests.front();
+      queue->requests.pop();
+    }
+    if(request.first==nullptr)
+      break;
+    HandleRequest(request.first, &responses);
+    Enqueue(&responses, request.second, &notifier);
+  }
+}
+
+void Server::Enqueue(vector<Msg*>* msgs, Socket* sock, Dealer* notifier){
+  if(msgs->empty())
+    return;
+  bool notify=false;
+  {
+    std::lock_guard<std::mutex> lock(outbox_mutex_);
+    notify=outbox_.empty();
+    for(Msg* msg: *msgs)
+      outbox_.push_back(std::make_pair(msg, sock));
+  }
+  msgs->clear();
+  if(notify){
+    Msg* msg=new Msg();
+    msg->set_src(group_id_, server_id_, kServer);
+    msg->set_dst(group_id_, server_id_, kServer);
+    msg->set_type(kFlush);
+    notifier->Send(msg);
+  }
+}
 
+void Server::Gossip(ServerTopology topology){
+  Dealer notifier;
+  notifier.Connect("inproc://server-notifier-"+std::to_string(group_id_)
+      +"-"+std::to_string(server_id_));
+  vector<int> neighbors(topology.neighbor().begin(),
+      topology.neighbor().end());
+  auto interval=std::chrono::milliseconds(topology.sync_interval());
+  vector<Msg*> msgs;
+  while(true){
+    {
+      std::unique_lock<std::mutex> lock(stop_mutex_);
+      if(stop_cv_.wait_for(lock, interval, [this]{return stop_;}))
+        break;
+    }
+    pmserver_->GenSyncMsgs(neighbors, &msgs);
+    // sent by the receiving thread through the stub
+    Enqueue(&msgs, dealer_.get(), &notifier);
+  }
+}
 
+void Server::SendResponses(){
+  vector<Request> responses;
+  {
+    std::lock_guard<std::mutex> lock(outbox_mutex_);
+    responses.swap(outbox_);
+  }
+  for(auto& response: responses)
+    SocketFor(response.first, response.second)->Send(response.first);
+  // keep the capacity to avoid allocations
+  std::lock_guard<std::mutex> lock(outbox_mutex_);
+  if(outbox_.empty())
+    outbox_.swap(responses);
+}
+
+void Server::ReportThroughput(){
+  auto now=std::chrono::steady_clock::now();
+  double secs=std::chrono::duration<double>(now-last_report_).count();
+  if(secs<kServerStatsInterval)
+    return;
+  uint64_t nupdates=nupdates_.load(std::memory_order_relaxed);
+  if(nupdates>last_nupdates_)
+    LOG(ERROR)<<"Server ("<<group_id_<<", "<<server_id_<<") handles "
+      <<(nupdates-last_nupdates_)/secs<<" updates/sec with "<<nthreads_
+      <<" threads";
+  // workers dump the statistics in procs having them
+  if(!Cluster::Get()->has_worker()){
+    std::string msg_stats=MsgStats::Dump();
+    if(msg_stats.size())
+      LOG(ERROR)<<"\tMessage statistics:\n"<<msg_stats;
+  }
+  last_nupdates_=nupdates;
+  last_report_=now;
+}
+
+void Server::ReportLoad(){
+  auto now=std::chrono::steady_clock::now();
+  double secs=std::chrono::duration<double>(now-last_load_report_).count();
+  if(secs<Cluster::Get()->rebalance_interval())
+    return;
+  // counters are read under the locks of params, hence it is safe with
+  // server threads
+  dealer_->Send(pmserver_->GenLoadMsg(secs));
+  last_load_report_=now;
+}
 } /* singa */
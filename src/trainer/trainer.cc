@@ -1,8 +1,15 @@
 #include <thread>
 #include <vector>
 #include <map>
+#include <set>
+#include <deque>
+#include <chrono>
+#include <string>
 #include <glog/logging.h>
 #include "trainer/trainer.h"
+#include "communication/shm_socket.h"
+#include "communication/coalescer.h"
+#include "utils/placement.h"
 using std::vector;
 using std::map;
 
@@ -29,16 +36,28 @@ int ProcsIDOf(int group_id, int id, int flag){
 void Trainer::RegisterDefaultClasses(const singa::ModelProto& proto){
   // register all layers appearing in the neural net
   singa::NeuralNet::RegisterLayers();
+  // params are created by UpdaterProto param_type
   Singleton<Factory<singa::Param>>::Instance()->Register(
       "Param", CreateInstance(singa::Param, singa::Param));
+  Singleton<Factory<singa::Param>>::Instance()->Register(
+      "RandomSyncParam", CreateInstance(singa::RandomSyncParam, singa::Param));
+  Singleton<Factory<singa::Param>>::Instance()->Register(
+      "ElasticParam", CreateInstance(singa::ElasticParam, singa::Param));
   Singleton<Factory<singa::Updater>>::Instance() ->Register(
       "Updater", CreateInstance(singa::SGDUpdater, singa::Updater));
   Singleton<Factory<singa::PMWorker>>::Instance() ->Register(
       "PMWorker", CreateInstance(singa::PMWorker, singa::PMWorker));
-  Singleton<Factory<singa::PMServer>>::Instance() ->Register(
-      "PMServer", CreateInstance(singa::PMServer, singa::PMServer));
-  Singleton<Factory<singa::PMServer>>::Instance() ->Register(
-      "PMServer", CreateInstance(singa::PMServer, singa::PMServer));
+  int staleness=proto.staleness();
+  if(proto.consistency()==ModelProto::kBSP)
+    Singleton<Factory<singa::PMServer>>::Instance() ->Register(
+        "PMServer", CreateInstance(singa::SyncPMServer, singa::PMServer));
+  else if(proto.consistency()==ModelProto::kSSP)
+    Singleton<Factory<singa::PMServer>>::Instance() ->Register(
+        "PMServer", [staleness](void)->singa::PMServer*{
+          return new singa::SSPPMServer(staleness);});
+  else
+    Singleton<Factory<singa::PMServer>>::Instance() ->Register(
+        "PMServer", CreateInstance(singa::PMServer, singa::PMServer));
 }
 
 void Trainer::Start(const ModelProto& mproto, const ClusterProto& cproto,
@@ -46,6 +65,11 @@ void Trainer::Start(const ModelProto& mproto, const ClusterProto& cproto,
   RegisterDefaultClasses(mproto);
 
   auto cluster=Cluster::Get(cproto, procs_id);
+  // synchronous servers keep per-param state that is not moved
+  CHECK(cluster->rebalance_interval()==0
+      ||mproto.consistency()==ModelProto::kAsync)
+    <<"Params are only moved among servers in async training";
+  Msg::set_text_header(cproto.text_msg_header());
   // create servers
   vector<shared_ptr<Server>> servers;
   int nSocket=1; // the first socket is the router
@@ -60,7 +84,7 @@ void Trainer::Start(const ModelProto& mproto, const ClusterProto& cproto,
     auto shard=make_shared<PMServer::ParamShard>();
     for(int sid=start;sid<end;sid++){
       auto server=make_shared<Server>(gid, sid);
-      auto dealer=make_shared<Dealer>(nSocket++);
+      auto dealer=make_shared<Dealer>(nSocket++, cluster->stub_threads());
       dealer->Connect(kInprocRouterEndpoint);
       server->Setup(mproto.updater(), shard, dealer);
       servers.push_back(server);
@@ -70,7 +94,18 @@ void Trainer::Start(const ModelProto& mproto, const ClusterProto& cproto,
   // create workers
   vector<shared_ptr<Worker>> workers;
   if(cluster->has_worker()){
-    auto net=NeuralNet::SetupNeuralNet(mproto.neuralnet(), kTrain);
+    auto net=NeuralNet::SetupNeuralNet(mproto.neuralnet(), kTrain,
+        mproto.updater().param_type());
+    // created before the worker threads, which share it
+    auto placement=Singleton<ParamPlacement>::Instance();
+    if(cluster->param_placement()==ClusterProto::kGreedy){
+      vector<ParamLoad> loads;
+      for(auto param: net->params())
+        for(int k=0;k<param->nslices();k++)
+          loads.push_back(ParamPlacement::Load(param, k));
+      placement->Setup(loads, cluster->nservers_per_group());
+      LOG(ERROR)<<"Load of servers in a group:\n"<<placement->ToString();
+    }
     int pid=cluster->procs_id();
     int gstart, gend, wstart, wend;
     if(cluster->nworkers_per_group()>=cluster->nworkers_per_procs()){
@@ -94,7 +129,8 @@ void Trainer::Start(const ModelProto& mproto, const ClusterProto& cproto,
       if(gid==gstart)
         train_net=net;
       else{
-        train_net=NeuralNet::SetupNeuralNet(mproto.neuralnet(), kTrain);
+        train_net=NeuralNet::SetupNeuralNet(mproto.neuralnet(), kTrain,
+            mproto.updater().param_type());
         // the train net for other groups may share parameter values from the
         // first group
         if(mproto.hogwild())
@@ -103,12 +139,14 @@ void Trainer::Start(const ModelProto& mproto, const ClusterProto& cproto,
       if(gid==0){
         // validation and test are performed only by the first group
         if(mproto.test_steps()){
-          test_net=NeuralNet::SetupNeuralNet(mproto.neuralnet(), kTest);
+          test_net=NeuralNet::SetupNeuralNet(mproto.neuralnet(), kTest,
+              mproto.updater().param_type());
           if(test_net!=nullptr)
             test_net->ShareParams(train_net, kValueOnly);
         }
         if(mproto.validation_steps()){
-          validation_net=NeuralNet::SetupNeuralNet(mproto.neuralnet(), kValidation);
+          validation_net=NeuralNet::SetupNeuralNet(mproto.neuralnet(),
+              kValidation, mproto.updater().param_type());
           if(validation_net!=nullptr)
             validation_net->ShareParams(train_net, kValueOnly);
         }
@@ -133,8 +171,10 @@ void Trainer::Start(const ModelProto& mproto, const ClusterProto& cproto,
         else{
         // TODO add CDWorker
         }
-        auto layer_dealer=make_shared<Dealer>(nSocket++);
-        auto param_dealer=make_shared<Dealer>(nSocket++);
+        auto layer_dealer=make_shared<Dealer>(nSocket++,
+            cluster->stub_threads());
+        auto param_dealer=make_shared<Dealer>(nSocket++,
+            cluster->stub_threads());
         layer_dealer->Connect(kInprocRouterEndpoint);
         param_dealer->Connect(kInprocRouterEndpoint);
         worker->Setup(mproto, train_net, shard, layer_dealer, param_dealer);
@@ -150,6 +190,8 @@ void Trainer::Start(const ModelProto& mproto, const ClusterProto& cproto,
     MPIQueues.push_back(make_shared<SafeQueue>());
   }
 #endif
+  // connect to all other procs before servers and workers start
+  SetupStub();
   vector<std::thread> threads;
   for(auto server: servers)
     threads.push_back(std::thread(&Server::Run,server));
@@ -158,21 +200,182 @@ void Trainer::Start(const ModelProto& mproto, const ClusterProto& cproto,
   Run();
   for(auto& thread: threads)
     thread.join();
+  // the forwarding thread never exits, hence the ring is not destroyed
+  if(shm_inbox_!=nullptr)
+    shm_inbox_->Unlink();
 }
 
-void Trainer::Run(){
+/**
+ * Forward messages from the shared memory inbox to the router.
+ */
+void ForwardShmInbox(shared_ptr<ShmSocket> inbox){
+  Dealer dealer(-1);
+  dealer.Connect(kInprocRouterEndpoint);
+  while(true){
+    Msg* msg=inbox->Receive();
+    dealer.Send(msg);
+  }
+}
+
+void Trainer::SetupStub(){
+  auto cluster=Cluster::Get();
+  // procs on the same host exchange messages through shared memory
+  shm_=false;
+  if(cluster->nprocs()>1&&cluster->shm_transport()){
+    for(int i=0;i<cluster->nprocs();i++)
+      shm_|=i!=cluster->procs_id()&&cluster->colocated(i);
+  }
+  if(shm_){
+    shm_inbox_=make_shared<ShmSocket>(
+        ShmSocket::RingName(cluster->start_port(), cluster->procs_id()),
+        true, cluster->shm_ring_size());
+    std::thread(ForwardShmInbox, shm_inbox_).detach();
+  }
+  router_=make_shared<Router>(cluster->router_bufsize());
+  router_->Bind(kInprocRouterEndpoint);
+  if(cluster->nprocs()>1){
+    // messages from other procs arrive at the first router
+    int port=cluster->port(cluster->procs_id());
+    router_->Bind("tcp://*:"+std::to_string(port));
+    ConnectProcs();
+  }
+}
+
+shared_ptr<Socket> Trainer::ConnectTo(int procs_id){
+  auto cluster=Cluster::Get();
+  if(shm_&&cluster->colocated(procs_id))
+    return make_shared<ShmSocket>(
+        ShmSocket::RingName(cluster->start_port(), procs_id), false,
+        0, cluster->stub_timeout());
+  auto dealer=make_shared<Dealer>(procs_id);
+  dealer->Connect(cluster->endpoint(procs_id));
+  return dealer;
+}
+
+/**
+ * Send a control message from this stub to the stub of another procs.
+ */
+static void SendToStub(Socket* socket, int procs_id, int type){
+  Msg* msg=new Msg();
+  msg->set_src(Cluster::Get()->procs_id(), kStub);
+  msg->set_dst(procs_id, kStub);
+  msg->set_type(type);
+  socket->Send(msg);
+}
+
+void Trainer::ConnectProcs(){
   auto cluster=Cluster::Get();
-  auto router=make_shared<Router>();
-  router->Bind(kInprocRouterEndpoint);
-  if(cluster->nprocs()>1)
-    router->Bind(cluster->endpoint());
+  int nprocs=cluster->nprocs(), self=cluster->procs_id();
+  auto start=std::chrono::steady_clock::now();
+  auto deadline=start+std::chrono::milliseconds(cluster->stub_timeout());
+  for(int i=0;i<nprocs;i++){
+    if(i!=self){
+      peers_[i]=ConnectTo(i);
+      SendToStub(peers_[i].get(), i, kConnect);
+    }
+  }
+  // wait for the handshakes of all procs, then for the barrier at procs 0,
+  // i.e., procs 0 collects kReady from all others and then replies kReady
+  std::set<int> connected;
+  int nready=0;
+  bool ready=false;
+  Poller poller;
+  poller.Add(router_.get());
+  while(!ready){
+    auto wait=std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline-std::chrono::steady_clock::now()).count();
+    if(wait<=0||poller.Wait(wait)==nullptr){
+      string missing;
+      for(int i=0;i<nprocs;i++)
+        if(i!=self&&connected.find(i)==connected.end())
+          missing+=" "+std::to_string(i);
+      LOG(FATAL)<<"Timeout after "<<cluster->stub_timeout()
+        <<" ms when connecting to procs:"<<missing<<" ("<<nready
+        <<" procs ready); check the hostfile and stub_timeout";
+    }
+    Msg* msg=router_->Receive();
+    CHECK(msg!=nullptr);
+    int type=msg->type();
+    if(msg->dst_flag()!=kStub||msg->src_flag()!=kStub
+        ||(type!=kConnect&&type!=kReady)){
+      // e.g., requests from procs that have finished the startup
+      early_msgs_.push_back(msg);
+      continue;
+    }
+    bool handshaked=connected.size()==static_cast<size_t>(nprocs-1);
+    if(type==kConnect)
+      connected.insert(msg->src_group_id());
+    else if(self==0)
+      nready++;
+    else
+      ready=true;
+    delete msg;
+    if(!handshaked&&connected.size()==static_cast<size_t>(nprocs-1)
+        &&self!=0)
+      SendToStub(peers_[0].get(), 0, kReady);
+    if(self==0&&nready==nprocs-1
+        &&connected.size()==static_cast<size_t>(nprocs-1)){
+      for(auto& peer: peers_)
+        SendToStub(peer.second.get(), peer.first, kReady);
+      ready=true;
+    }
+  }
+  std::chrono::duration<double, std::milli> ms=
+    std::chrono::steady_clock::now()-start;
+  LOG(ERROR)<<"Connected to "<<nprocs-1<<" procs in "<<ms.count()<<" ms";
+}
+
+void Trainer::Run(){
+  for(int i=1;i<Cluster::Get()->stub_threads();i++)
+    std::thread(&Trainer::Route, this, i).detach();
+  Route(0);
+}
 
-  map<int, shared_ptr<Dealer>> interprocs_dealers;
+void Trainer::Route(int partition){
+  auto cluster=Cluster::Get();
+  shared_ptr<Router> router=router_;
+  // connections to other procs, created on the first message except those
+  // of the first router, which are connected at startup
+  map<int, shared_ptr<Socket>> interprocs_dealers;
+  if(partition==0){
+    interprocs_dealers=peers_;
+  }else{
+    router=make_shared<Router>(cluster->router_bufsize());
+    router->Bind(RouterEndpoint(kInprocRouterEndpoint, partition));
+  }
   Poller poller;
   poller.Add(router.get());
-  int timeout=cluster->stub_timeout();
+  auto send=[&](int procs_id, Msg* msg){
+    if (interprocs_dealers.find(procs_id)==interprocs_dealers.end())
+      interprocs_dealers[procs_id]=ConnectTo(procs_id);
+    interprocs_dealers[procs_id]->Send(msg);
+  };
+  shared_ptr<Coalescer> coalescer;
+  if(cluster->nprocs()>1&&cluster->coalesce())
+    coalescer=make_shared<Coalescer>(cluster->procs_id(),
+        cluster->coalesce_bytes(), cluster->coalesce_delay());
+  Coalescer::Outbox ready;
+  vector<Msg*> batched;
   while(true){
-    Msg* msg=router->Receive();
+    if(coalescer!=nullptr){
+      for(auto& entry: ready)
+        send(entry.first, entry.second);
+      ready.clear();
+      // wake up for the earliest deadline of buffered messages
+      if((partition!=0||early_msgs_.empty())
+          &&poller.WaitMicros(coalescer->Timeout())==nullptr){
+        coalescer->FlushExpired(&ready);
+        continue;
+      }
+    }
+    Msg* msg=nullptr;
+    if(partition==0&&!early_msgs_.empty()){
+      // messages received during startup go first to keep their order
+      msg=early_msgs_.front();
+      early_msgs_.pop_front();
+    }else{
+      msg=router->Receive();
+    }
     if(msg==nullptr){
       LOG(ERROR)<<"Connection broken!";
       exit(0);
@@ -182,7 +385,24 @@ void Trainer::Run(){
     int group_id, id, procs_id;
     switch (dst_flag){ // TODO process other requests, e.g. RESTful
       case kStub:
-        if(type==kConnect){
+        if(type==kConnect||type==kReady){
+          delete msg;
+        }else if(type==kFlush){
+          if(coalescer!=nullptr)
+            coalescer->FlushAll(&ready);
+          delete msg;
+        }else if(type==kBatch){
+          Coalescer::Split(msg, &batched);
+          for(Msg* m: batched)
+            router->Send(m);
+          batched.clear();
+        }else if(type==kRoute&&msg->dst_group_id()!=cluster->procs_id()){
+          send(msg->dst_group_id(), msg);
+        }else if(type==kRoute){
+          // workers of the server group send later requests of the param
+          // to the new server
+          Singleton<ParamPlacement>::Instance()->Move(msg->src_group_id(),
+              msg->target(), msg->src_id());
           delete msg;
         }else{
           // TODO processing requests for worker group spanning multiple procs.
@@ -194,9 +414,12 @@ void Trainer::Run(){
         id=msg->dst_id();
         procs_id=ProcsIDOf(group_id, id, dst_flag);
         if(procs_id!=cluster->procs_id()){
-          if (interprocs_dealers.find(procs_id)==interprocs_dealers.end())
-            interprocs_dealers[procs_id]=make_shared<Dealer>(procs_id);
-          interprocs_dealers[procs_id]->Send(msg);
+          if(coalescer!=nullptr){
+            coalescer->Add(procs_id, msg, &ready);
+            coalescer->FlushExpired(&ready);
+          }else{
+            send(procs_id, msg);
+          }
         } else
           router->Send(msg);
         break;
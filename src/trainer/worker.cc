@@ -2,14 +2,21 @@
 #include <thread>
 #include <memory>
 #include <iostream>
+#include <chrono>
 #include "utils/singleton.h"
 #include "utils/factory.h"
+#include <algorithm>
+#include "utils/cluster.h"
 #include "trainer/worker.h"
+#include "trainer/trainer.h"
+#include "communication/coalescer.h"
+#include "communication/msg_stats.h"
 #include "proto/model.pb.h"
 using std::thread;
 namespace singa {
 Worker::Worker( int group_id, int worker_id):
-   group_id_(group_id), worker_id_(worker_id){
+   group_id_(group_id), worker_id_(worker_id), last_allocs_(0),
+   last_reuses_(0), update_bytes_(0), dense_bytes_(0){
 }
 
 void Worker::Setup(const ModelProto& model,
@@ -21,24 +28,43 @@ void Worker::Setup(const ModelProto& model,
   modelproto_=model;
   layer_dealer_=layer_dealer;
   param_dealer_=param_dealer;
-  if(layer_dealer_!=nullptr)
+  if(layer_dealer_!=nullptr){
     layer_poller_.Add(layer_dealer_.get());
-  if(param_dealer_!=nullptr)
+    Connect(layer_dealer_.get(), kWorkerLayer);
+  }
+  if(param_dealer_!=nullptr){
     param_poller_.Add(param_dealer_.get());
+    Connect(param_dealer_.get(), kWorkerParam);
+  }
   pmworker_=shared_ptr<PMWorker>(Singleton<Factory<PMWorker>>::Instance()
       ->Create("PMWorker"));
   pmworker_->Setup(group_id_, worker_id_, shard);
+  if(modelproto_.updater().param_type()!="Param"){
+    CHECK_GT(modelproto_.updater().sync_frequency(), 0);
+    updater_=shared_ptr<Updater>(Singleton<Factory<Updater>>::Instance()
+        ->Create("Updater"));
+    updater_->Init(modelproto_.updater());
+  }
   step_=modelproto_.step();
   // init params
-  for(auto layer: train_net->layers())
-    if(group_id_==0&&layer->locationid()==worker_id_)
-      for(auto param: layer->GetParams()){
-        if(param->owner()<0||param->owner()==param->id()){
-          param->Init();
-          Put(param, step_);
-        }
-        Get(param, step_);
+  bool push=Cluster::Get()->push_interval()>0;
+  for(auto layer: train_net->layers()){
+    if(layer->locationid()!=worker_id_)
+      continue;
+    for(auto param: layer->GetParams()){
+      if(group_id_==0&&(param->owner()<0||param->owner()==param->id())){
+        param->Init();
+        Put(param, step_);
       }
+      // every group subscribes, including group 0 whose Put sets the
+      // version, hence Get() would skip it; subscriptions arriving before
+      // the Put are re-queued by the servers
+      if(push)
+        Subscribe(param, step_);
+      else if(group_id_==0)
+        Get(param, step_);
+    }
+  }
 }
 
 void Worker::Run(){
@@ -53,36 +79,189 @@ void Worker::Run(){
     LOG(ERROR)<<e.what();
   }
 }
+void Worker::Connect(Dealer* dealer, int flag){
+  // every stub thread should know the address of this worker for forwarding
+  // responses to it
+  Msg* msg=new Msg();
+  msg->set_src(group_id_, worker_id_, flag);
+  msg->set_dst(0, 0, kStub);
+  msg->set_type(kConnect);
+  dealer->Broadcast(msg);
+}
+
+int Worker::SendParamMsgs(vector<Msg*>* msgs){
+  int ret=1;
+  for(Msg* msg: *msgs){
+    if(ret)
+      ret=SendParamMsg(msg);
+    else
+      delete msg;
+  }
+  msgs->clear();
+  return ret;
+}
+
 int Worker::Put(shared_ptr<Param> param, int step){
-  auto msg=pmworker_->Put(param, step);
-  if(msg!=nullptr)
-    param_dealer_->Send(msg);
-  return 1;
+  vector<Msg*> msgs;
+  pmworker_->Put(param, step, &msgs);
+  return SendParamMsgs(&msgs);
 }
 int Worker::Get(shared_ptr<Param> param, int step){
   if(param->version()<step){
-    auto msg=pmworker_->Get(param, step);
-    if(msg!=nullptr)
-      param_dealer_->Send(msg);
+    vector<Msg*> msgs;
+    // later values are pushed by the servers
+    if(Cluster::Get()->push_interval()>0)
+      pmworker_->Subscribe(param, step, &msgs);
+    else
+      pmworker_->Get(param, step, &msgs);
+    return SendParamMsgs(&msgs);
   }
   return 1;
 }
+int Worker::Subscribe(shared_ptr<Param> param, int step){
+  vector<Msg*> msgs;
+  pmworker_->Subscribe(param, step, &msgs);
+  return SendParamMsgs(&msgs);
+}
 int Worker::Update(shared_ptr<Param> param, int step){
-  auto msg=pmworker_->Update(param, step);
-  if(msg!=nullptr)
-    param_dealer_->Send(msg);
-  return 1;
+  if(updater_!=nullptr){
+    // the ratio to dense shows the saving of syncing periodically
+    dense_bytes_+=param->size()*sizeof(float);
+    updater_->Update(step, param);
+    param->set_version(step+1);
+    if((step+1)%modelproto_.updater().sync_frequency())
+      return 1;
+    // Collect() waits for the response of the next version
+    float alpha=modelproto_.updater().moving_rate();
+    auto msg=pmworker_->Sync(param, step+1, &alpha);
+    if(msg==nullptr)
+      return 1;
+    param->set_version(step);
+    update_bytes_+=msg->ByteSize();
+    return SendParamMsg(msg);
+  }
+  vector<Msg*> msgs;
+  pmworker_->Update(param, step, &msgs);
+  if(msgs.size())
+    dense_bytes_+=param->size()*sizeof(float);
+  for(Msg* msg: msgs)
+    update_bytes_+=msg->ByteSize();
+  return SendParamMsgs(&msgs);
 }
 int Worker::Collect(shared_ptr<Param> param, int step){
+  if(Cluster::Get()->push_interval()>0){
+    // apply the values pushed so far without waiting
+    Msg* msg=nullptr;
+    while((msg=ReceiveParamMsg(false))!=nullptr)
+      if(CollectParamMsg(msg)==0)
+        return 0;
+  }
   while(param->version()<step){
-    Msg* msg=param_dealer_->Receive();
-    if(msg==nullptr)
+    Msg* msg=ReceiveParamMsg();
+    if(msg==nullptr||CollectParamMsg(msg)==0)
       return 0;
-    pmworker_->Collect(&msg);
   }
   return 1;
 }
 
+int Worker::CollectParamMsg(Msg* msg){
+  Msg* request=pmworker_->Collect(&msg);
+  if(request!=nullptr)
+    return SendParamMsg(request);
+  return 1;
+}
+
+Msg* Worker::ReceiveParamMsg(bool block){
+  Msg* msg=nullptr;
+  if(block&&server_dealers_.empty()){
+    msg=param_dealer_->Receive();
+  }else{
+    Socket* sock=param_poller_.Wait(block?-1:0);
+    if(sock!=nullptr)
+      msg=sock->Receive();
+  }
+  if(msg!=nullptr){
+    ReleaseCredit(msg);
+    if(msg->type()==kRGet){
+      auto it=get_start_.find(msg->target());
+      if(it!=get_start_.end()){
+        get_rtt_.push_back(std::chrono::duration<double, std::micro>(
+              std::chrono::steady_clock::now()-it->second).count());
+        get_start_.erase(it);
+      }
+    }
+  }
+  return msg;
+}
+
+Dealer* Worker::ServerDealer(int group_id, int server_id){
+  auto addr=std::make_pair(group_id, server_id);
+  auto it=server_dealers_.find(addr);
+  if(it!=server_dealers_.end())
+    return it->second.get();
+  auto cluster=Cluster::Get();
+  auto dealer=std::make_shared<Dealer>();
+  dealer->Connect(cluster->server_endpoint(group_id, server_id,
+        ProcsIDOf(group_id, server_id, kServer)));
+  param_poller_.Add(dealer.get());
+  server_dealers_[addr]=dealer;
+  return dealer.get();
+}
+
+int Worker::HighWaterMark(int type) const{
+  auto cluster=Cluster::Get();
+  if(type==kGet)
+    return cluster->get_hwm();
+  else if(type==kUpdate)
+    return cluster->update_hwm();
+  // other msgs, e.g., kPut, have no response
+  return 0;
+}
+
+int Worker::SendParamMsg(Msg* msg){
+  int hwm=HighWaterMark(msg->type());
+  int type=msg->type();
+  // only servers respond to requests, not stubs of other procs
+  if(hwm>0&&msg->dst_flag()==kServer){
+    int& inflight=inflight_[std::make_pair(msg->type(), msg->dst())];
+    if(inflight>=hwm){
+      auto start=std::chrono::steady_clock::now();
+      while(inflight>=hwm){
+        Msg* response=ReceiveParamMsg();
+        if(response==nullptr||CollectParamMsg(response)==0){
+          delete msg;
+          return 0;
+        }
+      }
+      std::chrono::duration<double> secs=
+        std::chrono::steady_clock::now()-start;
+      stall_time_[msg->type()]+=secs.count();
+    }
+    inflight++;
+    request_dst_[std::make_pair(type, msg->target())]=msg->dst();
+  }
+  if(type==kGet)
+    get_start_[msg->target()]=std::chrono::steady_clock::now();
+  if(msg->dst_flag()==kServer&&Cluster::Get()->direct_server_access())
+    ServerDealer(msg->dst_group_id(), msg->dst_id())->Send(msg);
+  else
+    param_dealer_->Send(msg);
+  return 1;
+}
+
+void Worker::ReleaseCredit(Msg* msg){
+  int type=msg->type()==kRGet?kGet:(msg->type()==kRUpdate?kUpdate:-1);
+  if(type<0||HighWaterMark(type)==0)
+    return;
+  auto dst=request_dst_.find(std::make_pair(type, msg->target()));
+  if(dst==request_dst_.end())
+    return;
+  auto it=inflight_.find(std::make_pair(type, dst->second));
+  if(it!=inflight_.end()&&it->second>0)
+    it->second--;
+  request_dst_.erase(dst);
+}
+
 void Worker::RunOneBatch(int step, Performance* perf){
   //DLOG(ERROR)<<"Step "<<step;
   // Test will call Pull which updates the sync time
@@ -99,12 +278,63 @@ void Worker::RunOneBatch(int step, Performance* perf){
   //tSyncData_=tSyncData; tSyncParam_=tSyncParam;
 
   TrainOneBatch(step);
+  auto cluster=Cluster::Get();
+  if(cluster->nprocs()>1&&cluster->coalesce()&&param_dealer_!=nullptr){
+    // the stub sends out the updates of this step buffered for coalescing
+    Msg* msg=new Msg();
+    msg->set_src(group_id_, worker_id_, kWorkerParam);
+    msg->set_dst(0, 0, kStub);
+    msg->set_type(kFlush);
+    param_dealer_->Broadcast(msg);
+  }
   if(perf!=nullptr){
     perf->Update();
     if(DisplayNow(step)){
       LOG(ERROR)<<"Training at step "<<step;
       LOG(ERROR)<<"\t"<<perf->ToString();
       perf->Reset();
+      // message allocations of all threads in this procs since last display,
+      // which should be 0 in steady state
+      const MsgPoolStats& stats=Msg::pool_stats();
+      uint64_t allocs=stats.msg_allocs+stats.zmsg_allocs+stats.frame_allocs;
+      uint64_t reuses=stats.msg_reuses+stats.zmsg_reuses+stats.frame_reuses;
+      LOG(ERROR)<<"\tMsg allocations "<<allocs-last_allocs_<<", reuses "
+        <<reuses-last_reuses_;
+      last_allocs_=allocs;
+      last_reuses_=reuses;
+      if(dense_bytes_>0){
+        // gradient traffic after the update codec, vs. sending dense fp32
+        LOG(ERROR)<<"\tUpdate bytes per step "
+          <<update_bytes_/modelproto_.display_frequency()<<", ratio to dense "
+          <<static_cast<double>(update_bytes_)/dense_bytes_;
+        update_bytes_=dense_bytes_=0;
+      }
+      if(stall_time_.size()){
+        // time blocked on flow control credits, i.e., servers are overloaded
+        LOG(ERROR)<<"\tStalled for credits: get "<<stall_time_[kGet]*1000
+          <<" ms, update "<<stall_time_[kUpdate]*1000<<" ms";
+        stall_time_.clear();
+      }
+      if(get_rtt_.size()){
+        std::sort(get_rtt_.begin(), get_rtt_.end());
+        LOG(ERROR)<<"\tGet round trip time: median "
+          <<get_rtt_[get_rtt_.size()/2]<<" us, p99 "
+          <<get_rtt_[get_rtt_.size()*99/100]<<" us";
+        get_rtt_.clear();
+      }
+      const CoalescerStats& cstats=Coalescer::stats();
+      if(cstats.batches>0){
+        LOG(ERROR)<<"\tCoalesced "<<cstats.batched_msgs<<" msgs into "
+          <<cstats.batches<<" batches ("<<cstats.single_msgs
+          <<" sent alone), flushes by size "<<cstats.size_flushes
+          <<", deadline "<<cstats.deadline_flushes<<", step "
+          <<cstats.step_flushes;
+      }
+      // latency and size histograms of all threads in this procs since the
+      // last dump by any worker
+      std::string msg_stats=MsgStats::Dump();
+      if(msg_stats.size())
+        LOG(ERROR)<<"\tMessage statistics:\n"<<msg_stats;
       //LOG(ERROR)<<"\t"<<TimerInfo();
     }
   }
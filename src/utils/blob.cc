@@ -81,10 +81,7 @@ private:\
 
 
 SyncedMemory::~SyncedMemory() {
-  if (cpu_ptr_ && own_cpu_data_) {
-    FreeHost(cpu_ptr_);
-  }
-
+  // the cpu memory is released by cpu_holder_
 #ifndef CPU_ONLY
   if (gpu_ptr_) {
     CUDA_CHECK(cudaFree(gpu_ptr_));
@@ -97,6 +94,7 @@ inline void SyncedMemory::to_cpu() {
   case UNINITIALIZED:
     MallocHost(&cpu_ptr_, size_);
     memset(cpu_ptr_,0, size_);
+    cpu_holder_.reset(cpu_ptr_, FreeHost);
     head_ = HEAD_AT_CPU;
     own_cpu_data_ = true;
     break;
@@ -104,6 +102,7 @@ inline void SyncedMemory::to_cpu() {
 #ifndef CPU_ONLY
     if (cpu_ptr_ == NULL) {
       MallocHost(&cpu_ptr_, size_);
+      cpu_holder_.reset(cpu_ptr_, FreeHost);
       own_cpu_data_ = true;
     }
     CUDA_CHECK(cudaMemcpy(cpu_ptr_, gpu_ptr_, size_, cudaMemcpyDefault));
@@ -149,14 +148,38 @@ const void* SyncedMemory::cpu_data() {
 
 void SyncedMemory::set_cpu_data(void* data) {
   CHECK(data);
-  if (own_cpu_data_) {
-    FreeHost(cpu_ptr_);
-  }
   cpu_ptr_ = data;
+  // not owned, the no-op deleter only makes pins countable
+  cpu_holder_.reset(data, [](void*){});
+  head_ = HEAD_AT_CPU;
+  own_cpu_data_ = false;
+}
+
+shared_ptr<void> SyncedMemory::pin_cpu_data() {
+  to_cpu();
+  return cpu_holder_;
+}
+
+void SyncedMemory::adopt_cpu_data(void* data, size_t size,
+    shared_ptr<void> holder) {
+  CHECK(data);
+  CHECK_EQ(size, size_);
+  cpu_ptr_ = data;
+  cpu_holder_ = holder;
   head_ = HEAD_AT_CPU;
   own_cpu_data_ = false;
 }
 
+void SyncedMemory::copy_on_write() {
+  void* ptr=nullptr;
+  MallocHost(&ptr, size_);
+  memcpy(ptr, cpu_ptr_, size_);
+  cpu_ptr_ = ptr;
+  cpu_holder_.reset(ptr, FreeHost);
+  own_cpu_data_ = true;
+  generation_++;
+}
+
 const void* SyncedMemory::gpu_data() {
 #ifndef CPU_ONLY
   to_gpu();
@@ -169,6 +192,9 @@ const void* SyncedMemory::gpu_data() {
 
 void* SyncedMemory::mutable_cpu_data() {
   to_cpu();
+  // the buffer is pinned by others, e.g., an in-flight message
+  if (cpu_holder_.use_count() > 1)
+    copy_on_write();
   head_ = HEAD_AT_CPU;
   return cpu_ptr_;
 }
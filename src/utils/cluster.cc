@@ -1,10 +1,16 @@
 #include <glog/logging.h>
 #include <fcntl.h>
 #include <fstream>
+#include <map>
+#include <set>
+#include <cstring>
 #include "utils/cluster.h"
 #include "proto/cluster.pb.h"
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
 namespace singa {
 
 std::shared_ptr<Cluster> Cluster::instance_;
@@ -26,9 +32,104 @@ Cluster::Cluster(const ClusterProto &cluster, int procs_id) {
     std::ifstream ifs(cluster.hostfile(), std::ifstream::in);
     std::string line;
     while(std::getline(ifs, line)&&endpoints_.size()<nprocs){
+      if(line.empty())
+        continue;
+      if(line.find("://")==string::npos)
+        line="tcp://"+line;
+      // procs on the same host must have different ports in the hostfile
+      if(line.find(':', line.find("://")+3)==string::npos)
+        line+=":"+std::to_string(start_port());
       endpoints_.push_back(line);
     }
     CHECK_EQ(endpoints_.size(), nprocs);
+    ResolveHosts();
+  }
+  SetupServerPorts();
+  CheckServerTopology();
+}
+
+void Cluster::SetupServerPorts(){
+  int nservers=nserver_groups()*nservers_per_group();
+  std::set<int> ports{start_port()};
+  for(size_t i=0;i<endpoints_.size();i++)
+    ports.insert(port(i));
+  if(cluster_.has_server_start_port())
+    server_start_port_=cluster_.server_start_port();
+  else
+    server_start_port_=*ports.rbegin()+1;
+  if(cluster_.direct_server_access()&&nprocs()>1){
+    // ports of servers and procs on the same host must differ, hosts are
+    // not distinguished for simplicity
+    auto it=ports.lower_bound(server_start_port_);
+    CHECK(it==ports.end()||*it>=server_start_port_+nservers)
+      <<"Server ports ["<<server_start_port_<<", "
+      <<server_start_port_+nservers<<") overlap port "<<*it
+      <<" of the hostfile, change server_start_port";
+  }
+}
+
+void Cluster::CheckServerTopology() const{
+  for(const auto& topology: cluster_.server_group()){
+    if(topology.sync_interval()<=0||topology.neighbor_size()==0)
+      continue;
+    std::set<int> neighbors(topology.neighbor().begin(),
+        topology.neighbor().end());
+    for(int group=0;group<nserver_groups();group++)
+      CHECK(group==topology.id()||neighbors.count(group))
+        <<"Server group "<<topology.id()<<" does not list group "<<group
+        <<" as neighbor; syncs are not forwarded, list all other groups";
+  }
+}
+
+const string Cluster::host(int procs_id) const {
+  string host=endpoint(procs_id);
+  size_t pos=host.find("://");
+  if(pos!=string::npos)
+    host=host.substr(pos+3);
+  pos=host.rfind(':');
+  if(pos!=string::npos)
+    host=host.substr(0, pos);
+  return host;
+}
+
+const string Cluster::server_endpoint(int group_id, int server_id,
+    int procs_id) const {
+  if(procs_id==procs_id_)
+    return "inproc://server-"+std::to_string(group_id)+"-"
+      +std::to_string(server_id);
+  return "tcp://"+host(procs_id)+":"
+    +std::to_string(server_port(group_id, server_id));
+}
+
+int Cluster::port(int procs_id) const {
+  string addr=endpoint(procs_id);
+  return std::stoi(addr.substr(addr.rfind(':')+1));
+}
+
+void Cluster::ResolveHosts(){
+  std::map<string, string> resolved;
+  for(int i=0;i<nprocs();i++){
+    string name=host(i);
+    if(resolved.find(name)==resolved.end()){
+      string addr=name;
+      struct addrinfo hints, *res=nullptr;
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family=AF_INET;
+      if(getaddrinfo(name.c_str(), nullptr, &hints, &res)==0&&res!=nullptr){
+        char buf[INET_ADDRSTRLEN];
+        auto sin=reinterpret_cast<struct sockaddr_in*>(res->ai_addr);
+        if(inet_ntop(AF_INET, &sin->sin_addr, buf, sizeof(buf))!=nullptr)
+          addr=buf;
+        freeaddrinfo(res);
+      }else{
+        LOG(WARNING)<<"Cannot resolve host "<<name;
+      }
+      // all loopback addresses refer to this host
+      if(addr.compare(0, 4, "127.")==0)
+        addr="127.0.0.1";
+      resolved[name]=addr;
+    }
+    addrs_.push_back(resolved[name]);
   }
 }
 
@@ -49,4 +150,11 @@ shared_ptr<Cluster> Cluster::Get() {
   }
   return instance_;
 }
+
+const ServerTopology* Cluster::server_topology(int group_id) const{
+  for(const auto& topology: cluster_.server_group())
+    if(topology.id()==group_id)
+      return &topology;
+  return nullptr;
+}
 }  // namespace singa
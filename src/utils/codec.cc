@@ -0,0 +1,648 @@
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <cmath>
+#include <glog/logging.h>
+#include "utils/codec.h"
+// build with -DSINGA_NO_SIMD to test the scalar kernels
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(SINGA_NO_SIMD)
+#include <cpuid.h>
+#include <immintrin.h>
+#define USE_X86_SIMD
+#endif
+
+namespace singa {
+/*****************************Scalar kernels********************************/
+inline uint32_t FloatBits(float f){
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  return x;
+}
+
+inline float BitsFloat(uint32_t x){
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+uint16_t FloatToHalf(float f){
+  uint32_t x=FloatBits(f);
+  uint16_t sign=(x>>16)&0x8000;
+  uint32_t absx=x&0x7FFFFFFF;
+  if(absx>=0x7F800000){
+    // inf, or nan with the quiet bit set
+    return sign|0x7C00|(absx>0x7F800000?0x200|((absx>>13)&0x3FF):0);
+  }
+  if(absx>=0x477FF000) // >= 65520, rounds to inf
+    return sign|0x7C00;
+  if(absx<0x38800000){
+    // subnormal half, i.e., < 2^-14
+    if(absx<=0x33000000) // <= 2^-25, rounds to 0
+      return sign;
+    uint32_t exp=absx>>23;
+    uint32_t mant=(absx&0x7FFFFF)|0x800000;
+    uint32_t shift=126-exp;
+    uint32_t r=mant>>shift, rem=mant&((1u<<shift)-1), half=1u<<(shift-1);
+    if(rem>half||(rem==half&&(r&1)))
+      r++;
+    return sign|r;
+  }
+  uint32_t r=(absx-0x38000000)>>13, rem=absx&0x1FFF;
+  if(rem>0x1000||(rem==0x1000&&(r&1)))
+    r++;
+  return sign|r;
+}
+
+float HalfToFloat(uint16_t h){
+  uint32_t sign=static_cast<uint32_t>(h&0x8000)<<16;
+  uint32_t exp=(h>>10)&0x1F, mant=h&0x3FF;
+  if(exp==0){
+    if(mant==0)
+      return BitsFloat(sign);
+    // subnormal, normalize it
+    exp=113;
+    while(!(mant&0x400)){
+      mant<<=1;
+      exp--;
+    }
+    return BitsFloat(sign|(exp<<23)|((mant&0x3FF)<<13));
+  }
+  if(exp==31){
+    // nan is quieted as by the F16C instructions
+    return BitsFloat(sign|0x7F800000|(mant<<13)|(mant?0x400000:0));
+  }
+  return BitsFloat(sign|((exp+112)<<23)|(mant<<13));
+}
+
+uint16_t FloatToBF16(float f){
+  uint32_t x=FloatBits(f);
+  if((x&0x7FFFFFFF)>0x7F800000) // keep nan as (quiet) nan
+    return (x>>16)|0x40;
+  return (x+0x7FFF+((x>>16)&1))>>16;
+}
+
+float BF16ToFloat(uint16_t h){
+  return BitsFloat(static_cast<uint32_t>(h)<<16);
+}
+
+/******************************SIMD kernels*********************************/
+#ifdef USE_X86_SIMD
+/**
+ * F16C instructions are VEX encoded, which also requires the OS to save the
+ * AVX states.
+ */
+static bool CPUHasF16C(){
+  unsigned int eax, ebx, ecx, edx;
+  if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return false;
+  if(!(ecx&bit_F16C)||!(ecx&bit_AVX)||!(ecx&bit_OSXSAVE))
+    return false;
+  unsigned int xcr0, xcr0_hi;
+  __asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0_hi) : "c"(0));
+  return (xcr0&6)==6;
+}
+static const bool kHasF16C=CPUHasF16C();
+
+__attribute__((target("avx,f16c")))
+static int FloatToHalfF16C(const float* src, int n, uint16_t* dst){
+  int i=0;
+  for(;i+8<=n;i+=8){
+    __m128i h=_mm256_cvtps_ph(_mm256_loadu_ps(src+i), 0);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst+i), h);
+  }
+  return i;
+}
+
+__attribute__((target("avx,f16c")))
+static int HalfToFloatF16C(const uint16_t* src, int n, float* dst){
+  int i=0;
+  for(;i+8<=n;i+=8){
+    __m128i h=_mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i));
+    _mm256_storeu_ps(dst+i, _mm256_cvtph_ps(h));
+  }
+  return i;
+}
+
+/**
+ * Round 4 floats to bf16 (in the lower half of each 32-bit lane).
+ */
+static inline __m128i RoundToBF16(__m128i x){
+  const __m128i one=_mm_set1_epi32(1), bias=_mm_set1_epi32(0x7FFF);
+  const __m128i absmask=_mm_set1_epi32(0x7FFFFFFF);
+  const __m128i inf=_mm_set1_epi32(0x7F800000), quiet=_mm_set1_epi32(0x40);
+  __m128i lsb=_mm_and_si128(_mm_srli_epi32(x, 16), one);
+  __m128i r=_mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(x, bias), lsb), 16);
+  __m128i nan=_mm_cmpgt_epi32(_mm_and_si128(x, absmask), inf);
+  __m128i q=_mm_or_si128(_mm_srli_epi32(x, 16), quiet);
+  return _mm_or_si128(_mm_and_si128(nan, q), _mm_andnot_si128(nan, r));
+}
+
+static int FloatToBF16SSE2(const float* src, int n, uint16_t* dst){
+  // _mm_packs_epi32 saturates signed values, hence shift to signed range
+  const __m128i offset32=_mm_set1_epi32(0x8000);
+  const __m128i offset16=_mm_set1_epi16(static_cast<short>(0x8000));
+  int i=0;
+  for(;i+8<=n;i+=8){
+    __m128i lo=RoundToBF16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i)));
+    __m128i hi=RoundToBF16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i+4)));
+    __m128i packed=_mm_packs_epi32(_mm_sub_epi32(lo, offset32),
+        _mm_sub_epi32(hi, offset32));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst+i),
+        _mm_xor_si128(packed, offset16));
+  }
+  return i;
+}
+
+static int BF16ToFloatSSE2(const uint16_t* src, int n, float* dst){
+  const __m128i zero=_mm_setzero_si128();
+  int i=0;
+  for(;i+8<=n;i+=8){
+    __m128i h=_mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst+i),
+        _mm_unpacklo_epi16(zero, h));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst+i+4),
+        _mm_unpackhi_epi16(zero, h));
+  }
+  return i;
+}
+
+/**
+ * Pack the sign bits of 8 floats into one byte, the lowest bit for the first.
+ */
+static int PackSignsSSE(const float* src, int n, uint8_t* bits){
+  int i=0;
+  for(;i+8<=n;i+=8)
+    bits[i/8]=_mm_movemask_ps(_mm_loadu_ps(src+i))
+      |(_mm_movemask_ps(_mm_loadu_ps(src+i+4))<<4);
+  return i;
+}
+
+/**
+ * Select the positive or negative means of 4 consecutive columns by 4 bits.
+ */
+static inline __m128 SelectBySigns(int nibble, __m128 pos, __m128 neg){
+  const __m128i lanes=_mm_setr_epi32(1, 2, 4, 8);
+  __m128i mask=_mm_cmpeq_epi32(
+      _mm_and_si128(_mm_set1_epi32(nibble), lanes), lanes);
+  __m128 m=_mm_castsi128_ps(mask);
+  return _mm_or_ps(_mm_and_ps(m, neg), _mm_andnot_ps(m, pos));
+}
+
+static int UnpackSignsSSE(const uint8_t* bits, const float* pos,
+    const float* neg, int n, int cols, float* dst){
+  if(cols!=1&&cols%4!=0)
+    return 0;
+  float pos0, neg0;
+  memcpy(&pos0, pos, sizeof(float));
+  memcpy(&neg0, neg, sizeof(float));
+  int i=0;
+  for(int j=0;i+4<=n;i+=4){
+    int nibble=(bits[i/8]>>(i&4))&0xF;
+    if(cols==1){
+      _mm_storeu_ps(dst+i, SelectBySigns(nibble, _mm_set1_ps(pos0),
+            _mm_set1_ps(neg0)));
+    }else{
+      _mm_storeu_ps(dst+i, SelectBySigns(nibble, _mm_loadu_ps(pos+j),
+            _mm_loadu_ps(neg+j)));
+      j+=4;
+      if(j==cols)
+        j=0;
+    }
+  }
+  return i;
+}
+
+/**
+ * Reconstruct 16 floats from 16 bytes of kLinear8Bit.
+ */
+static inline void Dequantize16(__m128i q, __m128 lo, __m128 scale,
+    float* dst){
+  const __m128i zero=_mm_setzero_si128();
+  __m128i q16[2]={_mm_unpacklo_epi8(q, zero), _mm_unpackhi_epi8(q, zero)};
+  for(int k=0;k<2;k++){
+    __m128 a=_mm_cvtepi32_ps(_mm_unpacklo_epi16(q16[k], zero));
+    __m128 b=_mm_cvtepi32_ps(_mm_unpackhi_epi16(q16[k], zero));
+    _mm_storeu_ps(dst+8*k, _mm_add_ps(lo, _mm_mul_ps(a, scale)));
+    _mm_storeu_ps(dst+8*k+4, _mm_add_ps(lo, _mm_mul_ps(b, scale)));
+  }
+}
+
+static int QuantizeChunkSSE2(float* src, int n, float lo, float inv,
+    float scale, uint8_t* dst){
+  __m128 vlo=_mm_set1_ps(lo), vinv=_mm_set1_ps(inv);
+  __m128 vscale=_mm_set1_ps(scale);
+  float recon[16];
+  int i=0;
+  for(;i+16<=n;i+=16){
+    __m128i v[4];
+    for(int k=0;k<4;k++)
+      v[k]=_mm_cvtps_epi32(
+          _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(src+i+4*k), vlo), vinv));
+    // saturating packs clamp the codes into [0, 255]
+    __m128i q=_mm_packus_epi16(_mm_packs_epi32(v[0], v[1]),
+        _mm_packs_epi32(v[2], v[3]));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst+i), q);
+    Dequantize16(q, vlo, vscale, recon);
+    for(int k=0;k<16;k+=4)
+      _mm_storeu_ps(src+i+k,
+          _mm_sub_ps(_mm_loadu_ps(src+i+k), _mm_loadu_ps(recon+k)));
+  }
+  return i;
+}
+
+static int DequantizeChunkSSE2(const uint8_t* src, int n, float lo,
+    float scale, float* dst){
+  __m128 vlo=_mm_set1_ps(lo), vscale=_mm_set1_ps(scale);
+  int i=0;
+  for(;i+16<=n;i+=16)
+    Dequantize16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i)),
+        vlo, vscale, dst+i);
+  return i;
+}
+#endif
+
+/*************************Array conversions*********************************/
+void FloatToHalf(const float* src, int n, uint16_t* dst){
+  int i=0;
+#ifdef USE_X86_SIMD
+  if(kHasF16C)
+    i=FloatToHalfF16C(src, n, dst);
+#endif
+  for(;i<n;i++)
+    dst[i]=FloatToHalf(src[i]);
+}
+
+void HalfToFloat(const uint16_t* src, int n, float* dst){
+  int i=0;
+#ifdef USE_X86_SIMD
+  if(kHasF16C)
+    i=HalfToFloatF16C(src, n, dst);
+#endif
+  for(;i<n;i++)
+    dst[i]=HalfToFloat(src[i]);
+}
+
+void FloatToBF16(const float* src, int n, uint16_t* dst){
+  int i=0;
+#ifdef USE_X86_SIMD
+  i=FloatToBF16SSE2(src, n, dst);
+#endif
+  for(;i<n;i++)
+    dst[i]=FloatToBF16(src[i]);
+}
+
+void BF16ToFloat(const uint16_t* src, int n, float* dst){
+  int i=0;
+#ifdef USE_X86_SIMD
+  i=BF16ToFloatSSE2(src, n, dst);
+#endif
+  for(;i<n;i++)
+    dst[i]=BF16ToFloat(src[i]);
+}
+
+/****************************Sparsification*********************************/
+float TopKThreshold(const float* src, int n, int k,
+    std::vector<float>* scratch){
+  if(k>=n)
+    return 0.f;
+  CHECK_GT(k, 0);
+  scratch->resize(n);
+  float* mag=scratch->data();
+  for(int i=0;i<n;i++)
+    mag[i]=std::fabs(src[i]);
+  std::nth_element(mag, mag+k-1, mag+n, std::greater<float>());
+  return mag[k-1];
+}
+
+int ExtractSparse(float* src, int n, float threshold, int max,
+    std::vector<int>* idx, std::vector<float>* val){
+  int count=0;
+  for(int i=0;i<n&&count<max;i++){
+    float x=src[i];
+    if(x!=0.f&&std::fabs(x)>=threshold){
+      idx->push_back(i);
+      val->push_back(x);
+      src[i]=0.f;
+      count++;
+    }
+  }
+  return count;
+}
+
+/*****************************Quantization**********************************/
+/**
+ * Frames are not aligned, hence scales are read via memcpy.
+ */
+inline float LoadFloat(const void* src, int i){
+  float f;
+  memcpy(&f, static_cast<const char*>(src)+sizeof(float)*i, sizeof(f));
+  return f;
+}
+
+/**
+ * dst has the positive means of all columns, the negative means of all
+ * columns and the sign bits of src.
+ */
+static void QuantizeSign1Bit(float* src, int n, int cols, void* dst,
+    std::vector<float>* scratch){
+  scratch->assign(4*cols, 0.f);
+  float* sum=scratch->data(), *count=sum+2*cols;
+  for(int i=0,j=0;i<n;i++){
+    int k=std::signbit(src[i])*cols+j;
+    sum[k]+=src[i];
+    count[k]+=1.f;
+    if(++j==cols)
+      j=0;
+  }
+  for(int k=0;k<2*cols;k++)
+    if(count[k]>0)
+      sum[k]/=count[k];
+  memcpy(dst, sum, sizeof(float)*2*cols);
+  uint8_t* bits=static_cast<uint8_t*>(dst)+sizeof(float)*2*cols;
+  int i=0;
+#ifdef USE_X86_SIMD
+  i=PackSignsSSE(src, n, bits);
+#endif
+  if(i<n){
+    // dst is not cleared, the tail may span many bytes without SIMD
+    memset(bits+i/8, 0, (n+7)/8-i/8);
+    for(;i<n;i++)
+      bits[i/8]|=std::signbit(src[i])<<(i%8);
+  }
+  // the quantization error is carried over to the next step
+  for(int i=0,j=0;i<n;i++){
+    src[i]-=sum[std::signbit(src[i])*cols+j];
+    if(++j==cols)
+      j=0;
+  }
+}
+
+static void DequantizeSign1Bit(const void* src, int n, int cols, float* dst){
+  const uint8_t* bits=static_cast<const uint8_t*>(src)+sizeof(float)*2*cols;
+  int i=0;
+#ifdef USE_X86_SIMD
+  i=UnpackSignsSSE(bits, static_cast<const float*>(src),
+      static_cast<const float*>(src)+cols, n, cols, dst);
+#endif
+  for(int j=i%cols;i<n;i++){
+    dst[i]=LoadFloat(src, ((bits[i/8]>>(i%8))&1)*cols+j);
+    if(++j==cols)
+      j=0;
+  }
+}
+
+/**
+ * dst has the (min, max) of every chunk followed by the codes of src.
+ */
+static void QuantizeLinear8Bit(float* src, int n, void* dst){
+  int nchunks=(n+kQuantChunk-1)/kQuantChunk;
+  float* range=static_cast<float*>(dst);
+  uint8_t* codes=static_cast<uint8_t*>(dst)+sizeof(float)*2*nchunks;
+  for(int c=0;c<nchunks;c++){
+    float* x=src+c*kQuantChunk;
+    uint8_t* q=codes+c*kQuantChunk;
+    int len=std::min(kQuantChunk, n-c*kQuantChunk);
+    float lo=x[0], hi=x[0];
+    for(int i=1;i<len;i++){
+      lo=std::min(lo, x[i]);
+      hi=std::max(hi, x[i]);
+    }
+    range[2*c]=lo;
+    range[2*c+1]=hi;
+    float scale=(hi-lo)/255, inv=scale>0?1.f/scale:0.f;
+    int i=0;
+#ifdef USE_X86_SIMD
+    i=QuantizeChunkSSE2(x, len, lo, inv, scale, q);
+#endif
+    for(;i<len;i++){
+      // round to nearest even, as _mm_cvtps_epi32
+      int v=static_cast<int>(std::nearbyint((x[i]-lo)*inv));
+      v=std::min(255, std::max(0, v));
+      q[i]=v;
+      x[i]-=lo+v*scale;
+    }
+  }
+}
+
+static void DequantizeLinear8Bit(const void* src, int n, float* dst){
+  int nchunks=(n+kQuantChunk-1)/kQuantChunk;
+  const uint8_t* codes=static_cast<const uint8_t*>(src)
+    +sizeof(float)*2*nchunks;
+  for(int c=0;c<nchunks;c++){
+    const uint8_t* q=codes+c*kQuantChunk;
+    float* x=dst+c*kQuantChunk;
+    int len=std::min(kQuantChunk, n-c*kQuantChunk);
+    float lo=LoadFloat(src, 2*c), scale=(LoadFloat(src, 2*c+1)-lo)/255;
+    int i=0;
+#ifdef USE_X86_SIMD
+    i=DequantizeChunkSSE2(q, len, lo, scale, x);
+#endif
+    for(;i<len;i++)
+      x[i]=lo+q[i]*scale;
+  }
+}
+
+size_t QuantizedBytes(ParamProto::UpdateCodec codec, int n, int cols){
+  switch(codec){
+    case ParamProto::kSign1Bit:
+      return sizeof(float)*2*cols+(n+7)/8;
+    case ParamProto::kLinear8Bit:
+      return sizeof(float)*2*((n+kQuantChunk-1)/kQuantChunk)+n;
+    default:
+      LOG(FATAL)<<"Not a quantization codec "<<codec;
+  }
+  return 0;
+}
+
+void Quantize(ParamProto::UpdateCodec codec, float* src, int n, int cols,
+    void* dst, std::vector<float>* scratch){
+  switch(codec){
+    case ParamProto::kSign1Bit:
+      QuantizeSign1Bit(src, n, cols, dst, scratch);
+      break;
+    case ParamProto::kLinear8Bit:
+      QuantizeLinear8Bit(src, n, dst);
+      break;
+    default:
+      LOG(FATAL)<<"Not a quantization codec "<<codec;
+  }
+}
+
+void Dequantize(ParamProto::UpdateCodec codec, const void* src, int n,
+    int cols, float* dst){
+  switch(codec){
+    case ParamProto::kSign1Bit:
+      DequantizeSign1Bit(src, n, cols, dst);
+      break;
+    case ParamProto::kLinear8Bit:
+      DequantizeLinear8Bit(src, n, dst);
+      break;
+    default:
+      LOG(FATAL)<<"Not a quantization codec "<<codec;
+  }
+}
+
+void XorBytes(const void* a, const void* b, size_t nbytes, void* dst){
+  const char* x=static_cast<const char*>(a);
+  const char* y=static_cast<const char*>(b);
+  char* z=static_cast<char*>(dst);
+  size_t i=0;
+  // memcpy of words is compiled into (unaligned) loads, and vectorized
+  for(;i+sizeof(uint64_t)<=nbytes;i+=sizeof(uint64_t)){
+    uint64_t u, v;
+    memcpy(&u, x+i, sizeof(u));
+    memcpy(&v, y+i, sizeof(v));
+    u^=v;
+    memcpy(z+i, &u, sizeof(u));
+  }
+  for(;i<nbytes;i++)
+    z[i]=x[i]^y[i];
+}
+
+void ShuffleBytes(const void* src, size_t n, int elem_size, void* dst){
+  const char* x=static_cast<const char*>(src);
+  char* y=static_cast<char*>(dst);
+  for(int k=0;k<elem_size;k++)
+    for(size_t i=0;i<n;i++)
+      y[k*n+i]=x[i*elem_size+k];
+}
+
+void UnshuffleBytes(const void* src, size_t n, int elem_size, void* dst){
+  const char* x=static_cast<const char*>(src);
+  char* y=static_cast<char*>(dst);
+  for(int k=0;k<elem_size;k++)
+    for(size_t i=0;i<n;i++)
+      y[i*elem_size+k]=x[k*n+i];
+}
+
+static void PutVarint(uint64_t v, std::vector<char>* dst){
+  while(v>=0x80){
+    dst->push_back(static_cast<char>(v|0x80));
+    v>>=7;
+  }
+  dst->push_back(static_cast<char>(v));
+}
+
+static uint64_t GetVarint(const uint8_t** src, const uint8_t* end){
+  uint64_t v=0;
+  for(int shift=0;;shift+=7){
+    CHECK(*src<end&&shift<64)<<"Corrupted compressed bytes";
+    uint8_t b=*(*src)++;
+    v|=static_cast<uint64_t>(b&0x7F)<<shift;
+    if(!(b&0x80))
+      return v;
+  }
+}
+
+//!< log2 of the num of hash table entries for finding matches
+const int kLZHashBits=12;
+//!< shorter matches are sent as literals
+const size_t kLZMinMatch=4;
+
+size_t CompressBytes(const void* src, size_t n, std::vector<char>* dst){
+  const char* x=static_cast<const char*>(src);
+  size_t start=dst->size();
+  // last position of every hashed 4-byte sequence
+  int64_t table[1<<kLZHashBits];
+  std::fill(table, table+(1<<kLZHashBits), -1);
+  size_t anchor=0, i=0;
+  while(i+kLZMinMatch<=n){
+    uint32_t word;
+    memcpy(&word, x+i, sizeof(word));
+    uint32_t h=(word*2654435761u)>>(32-kLZHashBits);
+    int64_t cand=table[h];
+    table[h]=i;
+    if(cand<0||memcmp(x+cand, x+i, kLZMinMatch)){
+      i++;
+      continue;
+    }
+    size_t len=kLZMinMatch;
+    while(i+len<n&&x[cand+len]==x[i+len])
+      len++;
+    PutVarint(i-anchor, dst);
+    dst->insert(dst->end(), x+anchor, x+i);
+    PutVarint(len, dst);
+    PutVarint(i-cand, dst);
+    i+=len;
+    anchor=i;
+  }
+  // the last sequence has no match, i.e., length 0
+  PutVarint(n-anchor, dst);
+  dst->insert(dst->end(), x+anchor, x+n);
+  PutVarint(0, dst);
+  return dst->size()-start;
+}
+
+void DecompressBytes(const void* src, size_t nbytes, void* dst, size_t n){
+  const uint8_t* x=static_cast<const uint8_t*>(src);
+  const uint8_t* end=x+nbytes;
+  char* y=static_cast<char*>(dst);
+  size_t pos=0;
+  while(true){
+    uint64_t nliterals=GetVarint(&x, end);
+    CHECK(nliterals<=static_cast<uint64_t>(end-x)&&pos+nliterals<=n)
+      <<"Corrupted compressed bytes";
+    memcpy(y+pos, x, nliterals);
+    x+=nliterals;
+    pos+=nliterals;
+    uint64_t len=GetVarint(&x, end);
+    if(len==0)
+      break;
+    uint64_t offset=GetVarint(&x, end);
+    CHECK(offset>0&&offset<=pos&&pos+len<=n)<<"Corrupted compressed bytes";
+    // byte by byte as the match may overlap with itself, e.g., runs
+    for(uint64_t k=0;k<len;k++,pos++)
+      y[pos]=y[pos-offset];
+  }
+  CHECK_EQ(pos, n);
+}
+
+size_t EncodedBytes(ParamProto::WireEncoding encoding, int n){
+  switch(encoding){
+    case ParamProto::kFP32:
+      return sizeof(float)*n;
+    case ParamProto::kFP16:
+    case ParamProto::kBF16:
+      return sizeof(uint16_t)*n;
+    default:
+      LOG(FATAL)<<"Unknown wire encoding "<<encoding;
+  }
+  return 0;
+}
+
+void EncodeFloats(ParamProto::WireEncoding encoding, const float* src, int n,
+    void* dst){
+  switch(encoding){
+    case ParamProto::kFP32:
+      memcpy(dst, src, sizeof(float)*n);
+      break;
+    case ParamProto::kFP16:
+      FloatToHalf(src, n, static_cast<uint16_t*>(dst));
+      break;
+    case ParamProto::kBF16:
+      FloatToBF16(src, n, static_cast<uint16_t*>(dst));
+      break;
+    default:
+      LOG(FATAL)<<"Unknown wire encoding "<<encoding;
+  }
+}
+
+void DecodeFloats(ParamProto::WireEncoding encoding, const void* src, int n,
+    float* dst){
+  switch(encoding){
+    case ParamProto::kFP32:
+      memcpy(dst, src, sizeof(float)*n);
+      break;
+    case ParamProto::kFP16:
+      HalfToFloat(static_cast<const uint16_t*>(src), n, dst);
+      break;
+    case ParamProto::kBF16:
+      BF16ToFloat(static_cast<const uint16_t*>(src), n, dst);
+      break;
+    default:
+      LOG(FATAL)<<"Unknown wire encoding "<<encoding;
+  }
+}
+}  // namespace singa
@@ -0,0 +1,45 @@
+#include <algorithm>
+#include "utils/histogram.h"
+#include "utils/common.h"
+
+namespace singa {
+Histogram::Histogram(){
+  for(int i=0;i<kHistBuckets;i++)
+    buckets_[i]=0;
+  count_=sum_=0;
+}
+
+HistogramData::HistogramData(){
+  std::fill(buckets_, buckets_+kHistBuckets, 0);
+  count_=sum_=0;
+}
+
+void HistogramData::Merge(const Histogram& hist){
+  for(int i=0;i<kHistBuckets;i++)
+    buckets_[i]+=hist.buckets_[i].load(std::memory_order_relaxed);
+  count_+=hist.count_.load(std::memory_order_relaxed);
+  sum_+=hist.sum_.load(std::memory_order_relaxed);
+}
+
+void HistogramData::Subtract(const HistogramData& other){
+  for(int i=0;i<kHistBuckets;i++)
+    buckets_[i]-=other.buckets_[i];
+  count_-=other.count_;
+  sum_-=other.sum_;
+}
+
+uint64_t HistogramData::Percentile(double q) const{
+  uint64_t rank=static_cast<uint64_t>(q*count_), seen=0;
+  for(int i=0;i<kHistBuckets;i++){
+    seen+=buckets_[i];
+    if(seen>rank||(seen==count_&&buckets_[i]>0))
+      return i==0?0:(i==kHistBuckets-1?UINT64_MAX:(1ull<<i)-1);
+  }
+  return 0;
+}
+
+std::string HistogramData::ToString() const{
+  return StringPrintf("count %lu, mean %.1f, p50 %lu, p99 %lu, max %lu",
+      count_, mean(), Percentile(0.5), Percentile(0.99), Percentile(1.0));
+}
+}  // namespace singa
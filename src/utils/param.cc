@@ -1,10 +1,13 @@
 #include <glog/logging.h>
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <chrono>
 #include <random>
 #include "utils/param.h"
 #include "mshadow/tensor.h"
 #include "utils/singleton.h"
+#include "utils/codec.h"
 using namespace mshadow;
 using std::vector;
 using std::string;
@@ -13,42 +16,54 @@ namespace singa {
 Param::Param(){
   owner_=-1;
   fan_in_=0;
+  wire_bytes_=0;
+  nslices_received_=0;
   set_version(-1);
 }
 
 Param::~Param(){}
 
-Msg* Param::GenPutMsg(void* arg){
-  char buf[256];
+Msg* Param::GenPutMsg(void* arg, int slice){
   int v=*(int*)arg;
-  sprintf(buf, "%d %d %f %f", v, size(),
-      learning_rate_multiplier(), weight_decay_multiplier());
+  float hyper[2]={learning_rate_multiplier(), weight_decay_multiplier()};
   Msg* msg=new Msg();
   msg->set_type(kPut);
-  msg->add_frame(buf, strlen(buf));
-  msg->add_frame(mutable_cpu_data(), size()*sizeof(float));
+  msg->set_version(v);
+  msg->set_size(slice_size(slice));
+  // the codec of the responses from the server
+  msg->set_codec(proto_.response_codec());
+  msg->add_frame(hyper, sizeof(hyper));
+  AddShapeFrame(msg, slice_size(slice));
+  AddBlobFrame(msg, &data_, slice);
 	return msg;
 }
 
 Msg* Param::GenGetMsg(void* arg){
-  char buf[10];
   int v=*(int*)arg;
-  sprintf(buf, "%d", v);
   Msg* msg=new Msg();
   msg->set_type(kGet);
-  msg->add_frame(buf, strlen(buf));
+  msg->set_version(v);
+  msg->set_encoding(proto_.wire_encoding());
   return msg;
 }
 
-Msg* Param::GenUpdateMsg(void* arg){
-  char buf[10];
+Msg* Param::GenUpdateMsg(void* arg, int slice){
   int v=*(int*)arg;
-  sprintf(buf, "%d", v);
   Msg* msg=new Msg();
   msg->set_type(kUpdate);
-  msg->add_frame(buf, strlen(buf));
-
-  msg->add_frame(mutable_cpu_grad(), size()*sizeof(float));
+  msg->set_version(v);
+  msg->set_size(slice_size(slice));
+  switch(proto_.update_codec()){
+    case ParamProto::kDense:
+      AddBlobFrame(msg, &grad_, slice);
+      break;
+    case ParamProto::kTopK:
+    case ParamProto::kThreshold:
+      AddSparseGradFrames(msg, slice);
+      break;
+    default:
+      AddQuantizedGradFrames(msg, slice);
+  }
   return msg;
 }
 
@@ -57,42 +72,144 @@ Msg* Param::GenSyncMsg(void* arg){
 }
 
 Msg* Param::HandlePutMsg(Msg** msg){
-  int v, size;
-  float lr, wc;
-  sscanf(static_cast<char*>((*msg)->frame_data()), "%d %d %f %f",
-      &v, &size, &lr, &wc);
-  set_version(v);
-  proto_.set_learning_rate_multiplier(lr);
-  proto_.set_weight_decay_multiplier(wc);
+  int size=(*msg)->size();
+  CHECK_EQ((*msg)->frame_size(), 2*sizeof(float));
+  const float* hyper=static_cast<float*>((*msg)->frame_data());
+  set_version((*msg)->version());
+  proto_.set_learning_rate_multiplier(hyper[0]);
+  proto_.set_weight_decay_multiplier(hyper[1]);
+  // the encoding of the first Put is used for all messages of this Param
+  proto_.set_wire_encoding(
+      static_cast<ParamProto::WireEncoding>((*msg)->encoding()));
+  proto_.set_response_codec(
+      static_cast<ParamProto::ResponseCodec>((*msg)->codec()));
   CHECK((*msg)->next_frame());
-  vector<int> shape{size};
-  data_.Reshape(shape);
-  grad_.Reshape(shape);
-  history_.Reshape(shape);
-  CHECK_EQ(size* sizeof(float), (*msg)->frame_size());
-  memcpy(data_.mutable_cpu_data(), (*msg)->frame_data(), size*sizeof(float));
+  ReadShapeFrame(*msg, size);
+  CHECK((*msg)->next_frame());
+  ReadBlobFrame(*msg, &data_, false);
+  delete (*msg);
+  *msg=nullptr;
+  return nullptr;
+}
+
+Msg* Param::GenMigrateMsg(){
+  float hyper[2]={learning_rate_multiplier(), weight_decay_multiplier()};
+  Msg* msg=new Msg();
+  msg->set_type(kMigrateData);
+  msg->set_version(version());
+  msg->set_size(size());
+  // raw fp32 for exact updates at the new server; the encoding field keeps
+  // the wire encoding of this param
+  msg->set_encoding(proto_.wire_encoding());
+  msg->set_codec(proto_.response_codec());
+  msg->add_frame(hyper, sizeof(hyper));
+  AddShapeFrame(msg, size());
+  msg->add_frame(data_.cpu_data(), sizeof(float)*size());
+  msg->add_frame(history_.cpu_data(), sizeof(float)*size());
+  return msg;
+}
+
+void Param::HandleMigrateMsg(Msg** msg){
+  int size=(*msg)->size();
+  CHECK_EQ((*msg)->frame_size(), 2*sizeof(float));
+  const float* hyper=static_cast<float*>((*msg)->frame_data());
+  set_version((*msg)->version());
+  proto_.set_learning_rate_multiplier(hyper[0]);
+  proto_.set_weight_decay_multiplier(hyper[1]);
+  proto_.set_wire_encoding(
+      static_cast<ParamProto::WireEncoding>((*msg)->encoding()));
+  proto_.set_response_codec(
+      static_cast<ParamProto::ResponseCodec>((*msg)->codec()));
+  CHECK((*msg)->next_frame());
+  ReadShapeFrame(*msg, size);
+  CHECK((*msg)->next_frame());
+  CHECK_EQ((*msg)->frame_size(), sizeof(float)*size);
+  memcpy(data_.mutable_cpu_data(), (*msg)->frame_data(), sizeof(float)*size);
+  CHECK((*msg)->next_frame());
+  CHECK_EQ((*msg)->frame_size(), sizeof(float)*size);
+  memcpy(history_.mutable_cpu_data(), (*msg)->frame_data(),
+      sizeof(float)*size);
   delete (*msg);
   *msg=nullptr;
+}
+
+void Param::TakeSnapshot(int capacity){
+  auto snapshot=std::make_shared<ParamSnapshot>();
+  auto encoding=proto_.wire_encoding();
+  int n=size();
+  snapshot->version=version();
+  snapshot->size=n;
+  snapshot->encoding=encoding;
+  if(encoding==ParamProto::kFP32){
+    // pin before reading the address, as for zero-copy frames
+    snapshot->holder=data_.data()->pin_cpu_data();
+    snapshot->bytes=data_.cpu_data();
+    snapshot->nbytes=sizeof(float)*n;
+  }else{
+    snapshot->nbytes=EncodedBytes(encoding, n);
+    snapshot->holder=shared_ptr<void>(malloc(snapshot->nbytes), free);
+    EncodeFloats(encoding, data_.cpu_data(), n, snapshot->holder.get());
+    snapshot->bytes=snapshot->holder.get();
+  }
+  auto ring=std::make_shared<ParamSnapshots>();
+  ring->push_back(snapshot);
+  auto old=std::atomic_load(&snapshots_);
+  for(size_t i=0;old!=nullptr&&i<old->size()
+      &&static_cast<int>(ring->size())<capacity;i++)
+    ring->push_back((*old)[i]);
+  std::atomic_store(&snapshots_, shared_ptr<const ParamSnapshots>(ring));
+}
+
+shared_ptr<const ParamSnapshot> Param::GetSnapshot(int version) const{
+  auto ring=std::atomic_load(&snapshots_);
+  if(ring==nullptr||ring->empty())
+    return nullptr;
+  if(version<0)
+    return ring->front();
+  for(auto& snapshot: *ring)
+    if(snapshot->version==version)
+      return snapshot;
   return nullptr;
 }
 
-Msg* Param::HandleGetMsg(Msg** msg){
-  int v;
-  sscanf(static_cast<char*>((*msg)->frame_data()), "%d", &v);
-  CHECK_LE(v, version());
-  CHECK(!(*msg)->next_frame());
-  (*msg)->add_frame(data_.mutable_cpu_data(), sizeof(float)*size());
+Msg* Param::HandleGetMsg(Msg** msg, shared_ptr<const ParamSnapshot> snapshot){
+  CHECK_EQ((*msg)->frame_size(), 0);
+  CHECK_EQ((*msg)->encoding(), snapshot->encoding);
+  (*msg)->set_size(snapshot->size);
+  // snapshots are not kept as delta bases
+  (*msg)->set_codec(ParamProto::kFullValues);
+  (*msg)->set_base_version(-1);
+  (*msg)->add_frame(snapshot->bytes, snapshot->nbytes, snapshot->holder);
   (*msg)->SwapAddr();
   (*msg)->set_type(kRGet);
   return *msg;
 }
 
-int Param::ParseUpdateMsg(Msg** msg){
-  int v;
-  sscanf(static_cast<char*>((*msg)->frame_data()), "%d", &v);
-  CHECK_LE(v, version());
-  CHECK((*msg)->next_frame());
-  memcpy(mutable_cpu_grad(), (*msg)->frame_data(),(*msg)->frame_size());
+Msg* Param::HandleGetMsg(Msg** msg, int staleness, DeltaBase* base){
+  CHECK_LE((*msg)->version(), version()+staleness);
+  CHECK_EQ((*msg)->frame_size(), 0);
+  CheckEncoding(*msg);
+  (*msg)->set_size(size());
+  AddValueFrames(*msg, base);
+  (*msg)->SwapAddr();
+  (*msg)->set_type(kRGet);
+  return *msg;
+}
+
+int Param::ParseUpdateMsg(Msg** msg, int staleness){
+  CHECK_LE((*msg)->version(), version()+staleness);
+  CHECK_EQ((*msg)->size(), size());
+  switch((*msg)->codec()){
+    case ParamProto::kDense:
+      ReadBlobFrame(*msg, &grad_, true);
+      break;
+    case ParamProto::kTopK:
+    case ParamProto::kThreshold:
+      ReadSparseGradFrames(*msg);
+      break;
+    default:
+      ReadQuantizedGradFrames(*msg);
+  }
   delete (*msg);
   *msg=nullptr;
   return 1;
@@ -100,12 +217,11 @@ int Param::ParseUpdateMsg(Msg** msg){
 
 Msg* Param::GenUpdateResponseMsg(void* arg){
   Msg* msg=new Msg();
-  char buf[10];
-  sprintf(buf, "%d", version());
   msg->set_type(kRUpdate);
   msg->set_target(id());
-  msg->add_frame(buf, strlen(buf));
-  msg->add_frame(mutable_cpu_data(), size()*sizeof(float));
+  msg->set_version(version());
+  msg->set_size(size());
+  AddValueFrames(msg, static_cast<DeltaBase*>(arg));
   return msg;
 }
 
@@ -125,17 +241,313 @@ int Param::ParsePutResponseMsg(Msg **msg){
   return ParseSyncResponseMsg(msg);
 }
 int Param::ParseGetResponseMsg(Msg **msg){
-  int v;
-  sscanf(static_cast<char*>((*msg)->frame_data()), "%d", &v);
-  set_version(v);
-  CHECK((*msg)->next_frame());
-  memcpy(mutable_cpu_data(), (*msg)->frame_data(), (*msg)->frame_size());
+  int slice=SliceOfTarget((*msg)->target());
+  int version=(*msg)->version();
+  CHECK_EQ((*msg)->size(), slice_size(slice));
+  if((*msg)->codec()==ParamProto::kFullValues){
+    ReadBlobFrame(*msg, &data_, true, slice);
+    // pushes and snapshots are not kept as bases by the server
+    if((*msg)->base_version()>=0)
+      KeepDeltaBase(slice, (*msg)->base_version());
+  }else if(!ReadDeltaFrames(*msg, slice)){
+    // not counted, the full values are requested by PMWorker::Collect
+    return 0;
+  }
+  // slices are on different servers, whose versions may differ, e.g., in
+  // async training with many worker groups
+  if(slice_versions_.size()!=static_cast<size_t>(nslices())){
+    slice_versions_.assign(nslices(), -1);
+    slice_received_.assign(nslices(), false);
+    nslices_received_=0;
+  }
+  slice_versions_[slice]=version;
+  if(!slice_received_[slice]){
+    slice_received_[slice]=true;
+    nslices_received_++;
+  }
+  if(nslices_received_==nslices()){
+    slice_received_.assign(nslices(), false);
+    nslices_received_=0;
+    set_version(*std::min_element(slice_versions_.begin(),
+          slice_versions_.end()));
+  }
   return 1;
 }
 int Param::ParseUpdateResponseMsg(Msg **msg){
   return ParseGetResponseMsg(msg);
 }
 
+void Param::AddBlobFrame(Msg* msg, Blob<float>* blob, int slice){
+  auto encoding=proto_.wire_encoding();
+  int offset=slice_offset(slice), count=slice_size(slice);
+  msg->set_encoding(encoding);
+  if(encoding==ParamProto::kFP32){
+    // pin before reading the address, the pin makes later writes
+    // copy-on-write
+    auto holder=blob->data()->pin_cpu_data();
+    msg->add_frame(blob->cpu_data()+offset, sizeof(float)*count, holder);
+  }else{
+    size_t nbytes=EncodedBytes(encoding, count);
+    // reuse the buffer unless it is still referenced by an in-flight message
+    if(wire_buf_==nullptr||wire_buf_.use_count()>1||wire_bytes_<nbytes){
+      wire_buf_=shared_ptr<void>(malloc(nbytes), free);
+      wire_bytes_=nbytes;
+    }
+    EncodeFloats(encoding, blob->cpu_data()+offset, count, wire_buf_.get());
+    msg->add_frame(wire_buf_.get(), nbytes, wire_buf_);
+  }
+}
+
+void Param::ReadBlobFrame(Msg* msg, Blob<float>* blob, bool adopt,
+    int slice){
+  CheckEncoding(msg);
+  auto encoding=proto_.wire_encoding();
+  int offset=slice_offset(slice), count=slice_size(slice);
+  size_t nbytes=EncodedBytes(encoding, count);
+  CHECK_EQ(msg->frame_size(), nbytes);
+  void* addr=msg->frame_data();
+  if(encoding!=ParamProto::kFP32){
+    DecodeFloats(encoding, addr, count, blob->mutable_cpu_data()+offset);
+  }else if(adopt&&count==blob->count()
+      &&(reinterpret_cast<uintptr_t>(addr)&0xF)==0){
+    // adopt only 16-byte aligned buffers to keep vectorized kernels happy
+    blob->data()->adopt_cpu_data(addr, nbytes, msg->release_frame());
+  }else{
+    memcpy(blob->mutable_cpu_data()+offset, addr, nbytes);
+  }
+}
+
+//!< ids of delta bases, unique in the procs
+static std::atomic<int> next_delta_version(0);
+
+void Param::AddValueFrames(Msg* msg, DeltaBase* base){
+  auto codec=proto_.response_codec();
+  msg->set_codec(ParamProto::kFullValues);
+  msg->set_base_version(-1);
+  if(base==nullptr||codec==ParamProto::kFullValues){
+    AddBlobFrame(msg, &data_);
+    return;
+  }
+  auto wire=proto_.wire_encoding(), encoding=delta_encoding();
+  int n=size();
+  size_t nbytes=EncodedBytes(encoding, n);
+  const float* dptr=data_.cpu_data();
+  if(base->version<0||base->bytes.size()!=nbytes){
+    AddBlobFrame(msg, &data_);
+    // the base is the values decoded by the worker
+    base->bytes.resize(nbytes);
+    if(encoding==wire){
+      EncodeFloats(encoding, dptr, n, base->bytes.data());
+    }else{
+      delta_buf_.resize(EncodedBytes(wire, n));
+      EncodeFloats(wire, dptr, n, delta_buf_.data());
+      DecodeFloats(wire, delta_buf_.data(), n,
+          reinterpret_cast<float*>(base->bytes.data()));
+    }
+  }else{
+    msg->set_encoding(wire);
+    msg->set_codec(codec);
+    msg->add_frame(&base->version, sizeof(base->version));
+    if(codec==ParamProto::kLinear8BitDelta){
+      float* values=reinterpret_cast<float*>(base->bytes.data());
+      delta_diff_.resize(n);
+      for(int i=0;i<n;i++)
+        delta_diff_[i]=dptr[i]-values[i];
+      delta_buf_.resize(QuantizedBytes(ParamProto::kLinear8Bit, n, 1));
+      Quantize(ParamProto::kLinear8Bit, delta_diff_.data(), n, 1,
+          delta_buf_.data(), &sparse_buf_);
+      // update the base the same way as the worker to keep them identical
+      Dequantize(ParamProto::kLinear8Bit, delta_buf_.data(), n, 1,
+          delta_diff_.data());
+      for(int i=0;i<n;i++)
+        values[i]+=delta_diff_[i];
+    }else{
+      delta_buf_.resize(nbytes);
+      EncodeFloats(encoding, dptr, n, delta_buf_.data());
+      // the base becomes the delta and is swapped with the encoded values
+      XorBytes(base->bytes.data(), delta_buf_.data(), nbytes,
+          base->bytes.data());
+      base->bytes.swap(delta_buf_);
+      if(codec==ParamProto::kXorDeltaLZ){
+        delta_scratch_.resize(nbytes);
+        ShuffleBytes(delta_buf_.data(), n, EncodedBytes(encoding, 1),
+            delta_scratch_.data());
+        delta_buf_.clear();
+        CompressBytes(delta_scratch_.data(), nbytes, &delta_buf_);
+      }
+    }
+    msg->add_frame(delta_buf_.data(), delta_buf_.size());
+  }
+  base->version=next_delta_version.fetch_add(1)&0x7FFFFFFF;
+  msg->set_base_version(base->version);
+}
+
+bool Param::ReadDeltaFrames(Msg* msg, int slice){
+  auto codec=msg->codec();
+  auto encoding=delta_encoding();
+  int offset=slice_offset(slice), count=slice_size(slice);
+  CHECK_EQ(msg->frame_size(), sizeof(int));
+  int from=*static_cast<int*>(msg->frame_data());
+  CHECK(msg->next_frame());
+  if(delta_version(slice)!=from){
+    // e.g., the response to an earlier request was overtaken
+    LOG(WARNING)<<"Drop the delta of param "<<id()<<" slice "<<slice
+      <<" against base "<<from<<" which is not held";
+    if(!delta_versions_.empty())
+      delta_versions_[slice]=-1;
+    return false;
+  }
+  char* base=delta_base_.data()+EncodedBytes(encoding, offset);
+  size_t nbytes=EncodedBytes(encoding, count);
+  const void* delta=msg->frame_data();
+  if(codec==ParamProto::kLinear8BitDelta){
+    CHECK_EQ(msg->frame_size(),
+        QuantizedBytes(ParamProto::kLinear8Bit, count, 1));
+    delta_diff_.resize(count);
+    Dequantize(ParamProto::kLinear8Bit, delta, count, 1, delta_diff_.data());
+    float* values=reinterpret_cast<float*>(base);
+    for(int i=0;i<count;i++)
+      values[i]+=delta_diff_[i];
+  }else{
+    if(codec==ParamProto::kXorDeltaLZ){
+      delta_scratch_.resize(nbytes);
+      delta_buf_.resize(nbytes);
+      DecompressBytes(delta, msg->frame_size(), delta_scratch_.data(),
+          nbytes);
+      UnshuffleBytes(delta_scratch_.data(), count, EncodedBytes(encoding, 1),
+          delta_buf_.data());
+      delta=delta_buf_.data();
+    }else{
+      CHECK_EQ(codec, ParamProto::kXorDelta);
+      CHECK_EQ(msg->frame_size(), nbytes);
+    }
+    XorBytes(base, delta, nbytes, base);
+  }
+  DecodeFloats(encoding, base, count, data_.mutable_cpu_data()+offset);
+  delta_versions_[slice]=msg->base_version();
+  return true;
+}
+
+void Param::KeepDeltaBase(int slice, int version){
+  auto encoding=delta_encoding();
+  if(delta_versions_.size()!=static_cast<size_t>(nslices())){
+    delta_base_.resize(EncodedBytes(encoding, size()));
+    delta_versions_.assign(nslices(), -1);
+  }
+  int offset=slice_offset(slice);
+  EncodeFloats(encoding, data_.cpu_data()+offset, slice_size(slice),
+      delta_base_.data()+EncodedBytes(encoding, offset));
+  delta_versions_[slice]=version;
+}
+
+float* Param::AccumulateResidual(int slice){
+  if(residual_.count()!=size())
+    residual_.Reshape(grad_.shape());
+  int offset=slice_offset(slice), n=slice_size(slice);
+  // error feedback, the part not sent previously is added to this gradient
+  Tensor<cpu, 1> acc(residual_.mutable_cpu_data()+offset, Shape1(n));
+  Tensor<cpu, 1> grad(grad_.mutable_cpu_data()+offset, Shape1(n));
+  acc+=grad;
+  return acc.dptr;
+}
+
+void Param::AddShapeFrame(Msg* msg, int size){
+  // slices are whole rows
+  int cols=QuantizeColumns();
+  int shape[2]={size/cols, cols};
+  msg->add_frame(shape, sizeof(shape));
+}
+
+void Param::ReadShapeFrame(Msg* msg, int size){
+  CHECK_EQ(msg->frame_size(), 2*sizeof(int));
+  const int* dims=static_cast<int*>(msg->frame_data());
+  CHECK_EQ(dims[0]*dims[1], size);
+  vector<int> shape{size};
+  if(dims[1]>1)
+    shape=vector<int>{dims[0], dims[1]};
+  data_.Reshape(shape);
+  grad_.Reshape(shape);
+  history_.Reshape(shape);
+}
+
+int Param::QuantizeColumns() const{
+  const vector<int>& shape=data_.shape();
+  return shape.size()>1?shape.back():1;
+}
+
+void Param::AddSparseGradFrames(Msg* msg, int slice){
+  int n=slice_size(slice);
+  Tensor<cpu, 1> acc(AccumulateResidual(slice), Shape1(n));
+  float threshold;
+  int max=n;
+  if(proto_.update_codec()==ParamProto::kTopK){
+    max=std::max(1, static_cast<int>(n*proto_.update_ratio()));
+    threshold=TopKThreshold(acc.dptr, n, max, &sparse_buf_);
+  }else{
+    CHECK_EQ(proto_.update_codec(), ParamProto::kThreshold);
+    threshold=proto_.update_threshold();
+  }
+  sparse_idx_.clear();
+  sparse_val_.clear();
+  int nnz=ExtractSparse(acc.dptr, n, threshold, max, &sparse_idx_,
+      &sparse_val_);
+  auto encoding=proto_.wire_encoding();
+  msg->set_codec(proto_.update_codec());
+  msg->set_encoding(encoding);
+  msg->add_frame(sparse_idx_.data(), nnz*sizeof(int));
+  size_t nbytes=EncodedBytes(encoding, nnz);
+  sparse_buf_.resize((nbytes+sizeof(float)-1)/sizeof(float));
+  EncodeFloats(encoding, sparse_val_.data(), nnz, sparse_buf_.data());
+  msg->add_frame(sparse_buf_.data(), nbytes);
+}
+
+void Param::ReadSparseGradFrames(Msg* msg){
+  CheckEncoding(msg);
+  int nnz=msg->frame_size()/sizeof(int);
+  const int* idx=static_cast<int*>(msg->frame_data());
+  CHECK(msg->next_frame());
+  CHECK_EQ(msg->frame_size(), EncodedBytes(proto_.wire_encoding(), nnz));
+  sparse_buf_.resize(nnz);
+  DecodeFloats(proto_.wire_encoding(), msg->frame_data(), nnz,
+      sparse_buf_.data());
+  // scatter into a zero gradient, then the Updater works as for dense ones
+  int n=size();
+  float* grad=grad_.mutable_cpu_data();
+  memset(grad, 0, sizeof(float)*n);
+  for(int i=0;i<nnz;i++){
+    CHECK_LT(idx[i], n);
+    grad[idx[i]]=sparse_buf_[i];
+  }
+}
+
+void Param::AddQuantizedGradFrames(Msg* msg, int slice){
+  int n=slice_size(slice), cols=QuantizeColumns();
+  auto codec=proto_.update_codec();
+  size_t nbytes=QuantizedBytes(codec, n, cols);
+  sparse_val_.resize((nbytes+sizeof(float)-1)/sizeof(float));
+  // the residual keeps the quantization error
+  Quantize(codec, AccumulateResidual(slice), n, cols, sparse_val_.data(),
+      &sparse_buf_);
+  msg->set_codec(codec);
+  msg->add_frame(sparse_val_.data(), nbytes);
+}
+
+void Param::ReadQuantizedGradFrames(Msg* msg){
+  auto codec=static_cast<ParamProto::UpdateCodec>(msg->codec());
+  int n=size(), cols=QuantizeColumns();
+  CHECK_EQ(msg->frame_size(), QuantizedBytes(codec, n, cols))<<"Param ("
+    <<id()<<") has a different shape on the worker";
+  Dequantize(codec, msg->frame_data(), n, cols, grad_.mutable_cpu_data());
+}
+
+void Param::CheckEncoding(Msg* msg){
+  auto encoding=static_cast<ParamProto::WireEncoding>(msg->encoding());
+  CHECK_EQ(encoding, proto_.wire_encoding())<<"Param ("<<id()
+    <<") is sent in "<<ParamProto::WireEncoding_Name(encoding)<<" but "
+    <<ParamProto::WireEncoding_Name(proto_.wire_encoding())
+    <<" is expected, check wire_encoding of all ParamProto configurations";
+}
+
 void Param::Setup(const ParamProto& proto, const vector<int>& shape,
     int fan_in){
   data_.Reshape(shape);
@@ -143,6 +555,27 @@ void Param::Setup(const ParamProto& proto, const vector<int>& shape,
   history_.Reshape(shape);
   proto_=proto;
   fan_in_=fan_in;
+  Slice(proto.split_threshold());
+}
+
+void Param::Slice(int max_size){
+  slice_offsets_.clear();
+  slice_versions_.clear();
+  slice_received_.clear();
+  nslices_received_=0;
+  int n=size();
+  if(max_size<=0||n<=max_size)
+    return;
+  int cols=QuantizeColumns(), rows=n/cols;
+  int rows_per_slice=std::max(1, max_size/cols);
+  int nslices=(rows+rows_per_slice-1)/rows_per_slice;
+  if(nslices<2)
+    return;
+  CHECK_LE(nslices, 1<<(24-kSliceShift))<<"Param ("<<name()
+    <<") has too many slices, increase its split_threshold";
+  // rows are spread evenly over the slices
+  for(int k=0;k<=nslices;k++)
+    slice_offsets_.push_back(static_cast<int64_t>(rows)*k/nslices*cols);
 }
 
 void Param::Init(int v){
@@ -186,160 +619,183 @@ void Param::Init(int v){
   }
 }
 
-/**************************RandomSyncParam********************************
-const vector<int> RandomSyncParam::RandomSample(int seed, int m, int n){
-  vector<int> samples(m);
-  std::mt19937 gen(seed);
-  std::uniform_real_distribution<float> dist(0.f,1.f);
-  for(int i=0,k=0;i<n&&k<m;i++)
-    if((m-k)*1.0f/(n-i)>dist(gen)){
-      samples[k++]=i;
-    }
-  return samples;
-}
-
-zmsg_t* RandomSyncParam::HandleSyncMsg(zmsg_t** msg){
-  int64_t start=zclock_mono();
-  char* control=zframe_strdup(zmsg_first(*msg));
-  int seed, count;
-  sscanf(control, "%d-%d", &seed,&count);
-  delete control;
-  zframe_t* syncframe=zmsg_next(*msg);
-  CHECK_EQ(zframe_size(syncframe), count*sizeof(float));
-  float* syncptr=(float*)zframe_data(syncframe);
-  float* dptr=data_.mutable_cpu_data();
-  int k=0;
-  if(count==data_.count()){
-    for(int idx=0;idx<count;idx++){
-      float x=dptr[idx];
-      dptr[idx]+=syncptr[k];
-      syncptr[k]=x;
-      k++;
-    }
-  }else{
-    for(int idx: RandomSample(seed, count, data_.count())){
-      float x=dptr[idx];
-      dptr[idx]+=syncptr[k];
-      syncptr[k]=x;
-      k++;
-    }
-  }
-  CHECK_EQ(k,count);
-  CHECK_EQ(zframe_size(syncframe), count*sizeof(float));
-  return *msg;
-}
+/**************************RandomSyncParam********************************/
+/**
+ * Blocks sampled by one sync, i.e., blocks start, start+stride, ... of
+ * kSyncBlock values.
+ */
+struct SyncSamples{
+  int start, stride, nblocks;
+};
 
-zmsg_t *RandomSyncParam::GenSyncMsgFromWorker(float sample_ratio){
-  int64_t start=zclock_mono();
-  zmsg_t* msg=zmsg_new();
-  unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-  int m=data_.count()*sample_ratio;
-  zmsg_addstrf(msg, "%u-%d", seed, m);
-  float* updateptr=new float[m];
-  float* dptr=data_.mutable_cpu_data();
-  float* sdptr=snapshot_.mutable_cpu_data();
-  int k=0;
-  if(m==data_.count()){
-    for(int idx=0;idx<m;idx++)
-      updateptr[k++]=dptr[idx]-sdptr[idx];
-  }else{
-    const vector<int> samples=RandomSample(seed, m, data_.count());
-    for(int idx:samples){
-      updateptr[k++]=dptr[idx]-sdptr[idx];
-    }
+/**
+ * Call func(begin, end) for the value ranges of the sampled blocks.
+ *
+ * @return num of sampled values
+ */
+template<typename Func>
+static int ForSampledBlocks(const SyncSamples& s, int n, Func func){
+  int count=0;
+  for(int b=0;b<s.nblocks;b++){
+    int begin=(s.start+b*s.stride)*kSyncBlock;
+    int end=std::min(n, begin+kSyncBlock);
+    func(begin, end, count);
+    count+=end-begin;
   }
-  CHECK_EQ(k,m);
-  zframe_t* frame=zframe_new(updateptr, sizeof(float)*m);
-  zmsg_append(msg, &frame);
-  delete updateptr;
-  worker_gen_sync+=zclock_mono()-start;
-  return msg;
+  return count;
 }
 
-void RandomSyncParam::ParseSyncMsgFromPS(zmsg_t** msg){
-  int64_t start=zclock_mono();
-  //LOG(ERROR)<<"worker sync "<<id();
-  char* control=zmsg_popstr(*msg);
-  int seed, count;
-  sscanf(control, "%u-%d", &seed, &count);
-  //LOG(ERROR)<<"worker sync "<<id()<<" "<<control;
-  delete control;
-  zframe_t* psdataframe=zmsg_pop(*msg);
-  CHECK_EQ(zframe_size(psdataframe), count*sizeof(float));
-  float* psdptr=(float*)zframe_data(psdataframe);
-  float* dptr=data_.mutable_cpu_data();
-  float* sdptr=snapshot_.mutable_cpu_data();
-  int k=0;
-  if(count==data_.count()){
-    for(int idx=0;idx<count;idx++){
-      dptr[idx]+=psdptr[k++]-sdptr[idx];
-      sdptr[idx]=dptr[idx];
-    }
-  }else{
-    for(int idx: RandomSample(seed, count, data_.count())){
-      dptr[idx]+=psdptr[k++]-sdptr[idx];
-      sdptr[idx]=dptr[idx];
-    }
-  }
-  zframe_destroy(&psdataframe);
-  worker_handle_sync+=zclock_mono()-start;
-  zmsg_destroy(msg);
+RandomSyncParam::RandomSyncParam():
+  gen_(std::chrono::system_clock::now().time_since_epoch().count()){
 }
 
-
 void RandomSyncParam::Setup(const ParamProto& proto, const vector<int>& shape,
     int fan_in){
   Param::Setup(proto, shape, fan_in);
+  // sampled blocks are synced with one server
+  Slice(0);
   snapshot_.Reshape(shape);
 }
 
-void RandomSyncParam::Init(){
-  Param::Init();
-  memcpy(snapshot_.mutable_cpu_data(), data_.mutable_cpu_data(),
+void RandomSyncParam::Init(int v){
+  Param::Init(v);
+  memcpy(snapshot_.mutable_cpu_data(), data_.cpu_data(),
       sizeof(float)*data_.count());
 }
-*/
-
-/***************************ElasticParam************************************
-zmsg_t* ElasticParam::HandleSyncMsg(zmsg_t** msg){
-  int64_t start=zclock_mono();
-  char* control=zframe_strdup(zmsg_first(*msg));
-  float alpha;int count;
-  sscanf(control, "%f-%d", &alpha,&count);
-  delete control;
-  zframe_t* syncframe=zmsg_next(*msg);
-  CHECK_EQ(size(), count);
-  Tensor<cpu, 1> server(data_.mutable_cpu_data(), Shape1(count));
-  Tensor<cpu, 1> worker((float*)zframe_data(syncframe), Shape1(count));
-  worker=(worker-server)*alpha;
-  server+=worker;
+
+int RandomSyncParam::ParseGetResponseMsg(Msg** msg){
+  Param::ParseGetResponseMsg(msg);
+  memcpy(snapshot_.mutable_cpu_data(), data_.cpu_data(),
+      sizeof(float)*data_.count());
+  return 1;
+}
+
+Msg* RandomSyncParam::GenSyncMsg(void* arg){
+  int n=size();
+  int nblocks=(n+kSyncBlock-1)/kSyncBlock;
+  SyncSamples samples;
+  samples.nblocks=std::min(nblocks, std::max(1,
+        static_cast<int>(std::ceil(nblocks*proto_.sync_sample_ratio()))));
+  samples.stride=nblocks/samples.nblocks;
+  samples.start=gen_()%samples.stride;
+  Msg* msg=new Msg();
+  msg->set_type(kSyncRequest);
+  msg->set_target(id());
+  msg->set_version(version());
+  msg->set_size(n);
+  msg->add_frame(&samples, sizeof(samples));
+  sparse_val_.resize(samples.nblocks*kSyncBlock);
+  const float* dptr=data_.cpu_data();
+  const float* sptr=snapshot_.cpu_data();
+  float* delta=sparse_val_.data();
+  int count=ForSampledBlocks(samples, n, [=](int begin, int end, int k){
+      for(int i=begin;i<end;i++)
+        delta[k+i-begin]=dptr[i]-sptr[i];
+      });
+  msg->add_frame(delta, sizeof(float)*count);
+  return msg;
+}
+
+Msg* RandomSyncParam::HandleSyncMsg(Msg** msg){
+  CHECK_EQ((*msg)->size(), size());
+  CHECK_EQ((*msg)->frame_size(), sizeof(SyncSamples));
+  SyncSamples samples=*static_cast<SyncSamples*>((*msg)->frame_data());
+  CHECK((*msg)->next_frame());
+  // the changes are swapped with the server values in place, and the
+  // request is sent back as the response
+  float* buf=static_cast<float*>((*msg)->frame_data());
+  float* dptr=data_.mutable_cpu_data();
+  int count=ForSampledBlocks(samples, size(), [=](int begin, int end, int k){
+      for(int i=begin;i<end;i++){
+        float x=dptr[i];
+        dptr[i]+=buf[k+i-begin];
+        buf[k+i-begin]=x;
+      }
+      });
+  CHECK_EQ((*msg)->frame_size(), sizeof(float)*count);
+  set_version(version()+1);
+  (*msg)->SwapAddr();
+  (*msg)->set_type(kSyncResponse);
   return *msg;
 }
 
-zmsg_t *ElasticParam::GenSyncMsgFromWorker(float alpha){
-  int64_t start=zclock_mono();
-  zmsg_t* msg=zmsg_new();
-  zmsg_addstrf(msg, "%f-%d", alpha, size());
-  zmsg_addmem(msg, mutable_cpu_data(), sizeof(float)*size());
-  worker_gen_sync+=zclock_mono()-start;
+int RandomSyncParam::ParseSyncResponseMsg(Msg** msg){
+  CHECK_EQ((*msg)->size(), size());
+  CHECK_EQ((*msg)->frame_size(), sizeof(SyncSamples));
+  SyncSamples samples=*static_cast<SyncSamples*>((*msg)->frame_data());
+  CHECK((*msg)->next_frame());
+  const float* buf=static_cast<float*>((*msg)->frame_data());
+  float* dptr=data_.mutable_cpu_data();
+  float* sptr=snapshot_.mutable_cpu_data();
+  int count=ForSampledBlocks(samples, size(), [=](int begin, int end, int k){
+      for(int i=begin;i<end;i++){
+        dptr[i]+=buf[k+i-begin]-sptr[i];
+        sptr[i]=dptr[i];
+      }
+      });
+  CHECK_EQ((*msg)->frame_size(), sizeof(float)*count);
+  set_version((*msg)->version());
+  delete *msg;
+  *msg=nullptr;
+  return 1;
+}
+
+/***************************ElasticParam************************************/
+void ElasticParam::Setup(const ParamProto& proto, const vector<int>& shape,
+    int fan_in){
+  Param::Setup(proto, shape, fan_in);
+  Slice(0);
+}
+
+Msg* ElasticParam::GenSyncMsg(void* arg){
+  Msg* msg=new Msg();
+  msg->set_type(kSyncRequest);
+  msg->set_target(id());
+  msg->set_version(version());
+  msg->set_size(size());
+  float alpha=*static_cast<float*>(arg);
+  msg->add_frame(&alpha, sizeof(float));
+  AddBlobFrame(msg, &data_);
   return msg;
 }
 
-void ElasticParam::ParseSyncMsgFromPS(zmsg_t** msg){
-  int64_t start=zclock_mono();
-  //LOG(ERROR)<<"worker sync "<<id();
-  char* control=zmsg_popstr(*msg);
-  float alpha;int count;
-  sscanf(control, "%f-%d", &alpha, &count);
-  delete control;
-  zframe_t* frame=zmsg_pop(*msg);
-  CHECK_EQ(zframe_size(frame), count*sizeof(float));
-  Tensor<cpu, 1> diff((float*)zframe_data(frame), Shape1(count));
-  Tensor<cpu, 1> data(mutable_cpu_data(), Shape1(count));
+Msg* ElasticParam::HandleSyncMsg(Msg** msg){
+  CHECK_EQ((*msg)->size(), size());
+  CHECK_EQ((*msg)->frame_size(), sizeof(float));
+  float alpha=*static_cast<float*>((*msg)->frame_data());
+  CHECK((*msg)->next_frame());
+  // the worker param is read into the gradient, which is unused by servers
+  // in this mode
+  ReadBlobFrame(*msg, &grad_, false);
+  Tensor<cpu, 1> center(data_.mutable_cpu_data(), Shape1(size()));
+  Tensor<cpu, 1> diff(grad_.mutable_cpu_data(), Shape1(size()));
+  diff=(diff-center)*alpha;
+  center+=diff;
+  set_version(version()+1);
+  Msg* response=new Msg();
+  response->SetAddr(*msg);
+  response->SwapAddr();
+  response->set_type(kSyncResponse);
+  response->set_target(id());
+  // the worker waits for the version it requested
+  response->set_version((*msg)->version());
+  response->set_size(size());
+  AddBlobFrame(response, &grad_);
+  delete *msg;
+  *msg=nullptr;
+  return response;
+}
+
+int ElasticParam::ParseSyncResponseMsg(Msg** msg){
+  CHECK_EQ((*msg)->size(), size());
+  ReadBlobFrame(*msg, &grad_, true);
+  Tensor<cpu, 1> data(data_.mutable_cpu_data(), Shape1(size()));
+  Tensor<cpu, 1> diff(grad_.mutable_cpu_data(), Shape1(size()));
   data-=diff;
-  zframe_destroy(&frame);
-  zmsg_destroy(msg);
-  worker_handle_sync+=zclock_mono()-start;
+  set_version((*msg)->version());
+  delete *msg;
+  *msg=nullptr;
+  return 1;
 }
-*/
+
 }  // namespace singa
@@ -0,0 +1,100 @@
+#include <glog/logging.h>
+#include <algorithm>
+#include "utils/placement.h"
+#include "utils/codec.h"
+#include "utils/common.h"
+
+namespace singa {
+//!< flops of the Updater per value, e.g., momentum and weight decay
+const double kUpdateFlops=4;
+
+ParamLoad ParamPlacement::Load(shared_ptr<Param> param, int slice){
+  ParamLoad load{SliceTarget(param->id(), slice), 0, 0};
+  if(param->owner()>=0&&param->owner()!=param->id())
+    return load;
+  const ParamProto& proto=param->proto();
+  int n=param->slice_size(slice);
+  double values=EncodedBytes(proto.wire_encoding(), n);
+  load.bytes=values;
+  switch(proto.update_codec()){
+    case ParamProto::kDense:
+      load.bytes+=values;
+      break;
+    case ParamProto::kTopK:
+    case ParamProto::kThreshold:
+      // indices and values of the expected num of nonzeros
+      load.bytes+=n*proto.update_ratio()*(sizeof(int)
+          +EncodedBytes(proto.wire_encoding(), 1));
+      break;
+    default:
+      load.bytes+=QuantizedBytes(proto.update_codec(), n, 1);
+  }
+  load.flops=n*kUpdateFlops;
+  return load;
+}
+
+void ParamPlacement::Setup(std::vector<ParamLoad> loads, int nservers){
+  CHECK_GT(nservers, 0);
+  id2server_.clear();
+  bytes_.assign(nservers, 0);
+  flops_.assign(nservers, 0);
+  double total_bytes=0, total_flops=0;
+  for(auto& load: loads){
+    total_bytes+=load.bytes;
+    total_flops+=load.flops;
+  }
+  total_bytes=std::max(total_bytes, 1.0);
+  total_flops=std::max(total_flops, 1.0);
+  auto cost=[=](double bytes, double flops){
+    return std::max(bytes/total_bytes, flops/total_flops);
+  };
+  // ties are broken by id to get the same placement in every procs
+  std::sort(loads.begin(), loads.end(),
+      [&cost](const ParamLoad& a, const ParamLoad& b){
+        double ca=cost(a.bytes, a.flops), cb=cost(b.bytes, b.flops);
+        return ca>cb||(ca==cb&&a.id<b.id);
+      });
+  for(auto& load: loads){
+    int best=0;
+    double best_cost=0;
+    for(int s=0;s<nservers;s++){
+      double c=cost(bytes_[s]+load.bytes, flops_[s]+load.flops);
+      if(s==0||c<best_cost){
+        best=s;
+        best_cost=c;
+      }
+    }
+    id2server_[load.id]=best;
+    bytes_[best]+=load.bytes;
+    flops_[best]+=load.flops;
+  }
+}
+
+int ParamPlacement::Server(int target, int nservers,
+    int server_group) const{
+  if(nmoved_.load(std::memory_order_acquire)>0){
+    std::lock_guard<std::mutex> lock(moved_mutex_);
+    auto it=moved_.find(std::make_pair(server_group, target));
+    if(it!=moved_.end())
+      return it->second;
+  }
+  auto it=id2server_.find(target);
+  if(it==id2server_.end()||it->second>=nservers)
+    return (ParamOfTarget(target)+SliceOfTarget(target))%nservers;
+  return it->second;
+}
+
+void ParamPlacement::Move(int server_group, int target, int server){
+  std::lock_guard<std::mutex> lock(moved_mutex_);
+  moved_[std::make_pair(server_group, target)]=server;
+  nmoved_.store(moved_.size(), std::memory_order_release);
+}
+
+std::string ParamPlacement::ToString() const{
+  std::string ret;
+  for(size_t s=0;s<bytes_.size();s++)
+    ret+=StringPrintf("\tserver %lu: %.0f bytes, %.0f flops per step\n", s,
+        bytes_[s], flops_[s]);
+  return ret;
+}
+}  // namespace singa